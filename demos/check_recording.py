@@ -0,0 +1,183 @@
+"""
+Checks that the python decoder agrees with the C++ one.
+
+Run the codec_check demo with a directory first,
+which writes a recording (check.dtsr) and the frames it holds (check.bin) into it:
+
+    ./codec_check out
+    python demos/check_recording.py out
+
+We decode the recording with pdts.recording and make sure every frame comes back bit for bit,
+including when the recording is cut short at and around block boundaries,
+or a block has a damaged frame count.
+pdts.recording is loaded straight from the source tree,
+so the compiled module (and MAVSDK) are not needed.
+
+Exits with zero if everything matches.
+"""
+
+from __future__ import annotations
+
+import importlib.util
+import io
+import pathlib
+import random
+import sys
+from typing import Dict
+
+import numpy as np
+
+# Load the decoder without importing the compiled module:
+
+RECORDING_PATH = pathlib.Path(__file__).resolve().parent.parent / "python" / "pdts" / "recording.py"
+
+spec = importlib.util.spec_from_file_location("recording", RECORDING_PATH)
+recording = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(recording)
+
+# Layout of check.bin, see write_raw() in codec_check.cpp
+
+FIELDS = 12
+
+RAW = np.dtype([
+    ("stream", "<u2"),
+    ("mask", "<u2"),
+    ("pad", "<u4"),
+    ("recv_ns", "<i8"),
+    ("timestamp_us", "<u8"),
+    ("vehicle_ns", "<i8"),
+    ("sample_ns", "<i8"),
+    ("values", "<f8", (FIELDS,)),
+])
+
+COLUMNS = ("stream", "mask", "recv_ns", "timestamp_us", "vehicle_ns", "sample_ns")
+
+
+def same(data: Dict[str, np.ndarray], frames: np.ndarray) -> bool:
+    """Determines if decoded frames match the expected ones bit for bit"""
+
+    if len(data["recv_ns"]) != len(frames):
+        return False
+
+    for column in COLUMNS:
+        if not np.array_equal(data[column], frames[column]):
+            return False
+
+    # Compare the bits, so NaN values match:
+
+    return np.array_equal(data["values"].view(np.uint64), frames["values"].view(np.uint64))
+
+
+def check(data: bytes, frames: np.ndarray, what: str) -> bool:
+    """Decodes a recording and makes sure it holds exactly the given frames"""
+
+    with recording.Recording(io.BytesIO(data)) as rec:
+        result = rec.read_all()
+
+    if not same(result, frames):
+        print(f"{what}: decoded {len(result['recv_ns'])} frames, expected {len(frames)}, or they do not match")
+        return False
+
+    return True
+
+
+def patch(data: bytes, offset: int, value: int) -> bytes:
+    """Overwrites a little endian 32 bit value in a recording"""
+
+    return data[:offset] + value.to_bytes(4, "little") + data[offset + 4:]
+
+
+def main(directory: str) -> int:
+
+    path = pathlib.Path(directory)
+    data = (path / "check.dtsr").read_bytes()
+    frames = np.fromfile(path / "check.bin", dtype=RAW)
+
+    # Frames are sorted by receive time, just like the C++ reader:
+
+    frames = frames[np.argsort(frames["recv_ns"], kind="stable")]
+
+    good = check(data, frames, "closed recording")
+
+    with recording.Recording(io.BytesIO(data)) as rec:
+        index = rec.index
+
+        # Time ranges, against a brute force search:
+
+        rng = random.Random(7)
+
+        for _ in range(100):
+
+            stream = rng.randrange(rec.streams)
+            start = rng.randint(int(frames["recv_ns"][0]), int(frames["recv_ns"][-1]))
+            stop = start + rng.randrange(2000000000)
+
+            want = frames[(frames["stream"] == stream) & (frames["recv_ns"] >= start) & (frames["recv_ns"] <= stop)]
+
+            if not same(rec.read_range(stream, start, stop), want):
+                print(f"range {start} to {stop} of stream {stream} does not match")
+                good = False
+
+    # Cut the recording short at and around some of the block boundaries:
+    # (Decoding in python is slow, codec_check covers every boundary)
+    # (The last block ends where the index starts)
+
+    ends = [info.offset for info in index[1:]]
+    ends.append(int.from_bytes(data[-12:-4], "little"))
+
+    checked = 0
+
+    for block, end in enumerate(ends):
+
+        if block % 8 != 0 and block != len(ends) - 1:
+            continue
+
+        for cut in (end - 1, end, end + 1, end + 31):
+
+            # Frames of the blocks that are complete:
+
+            complete = [info for info, bend in zip(index, ends) if bend <= cut]
+            keep = np.zeros(len(frames), dtype=bool)
+
+            for info in complete:
+                keep |= (frames["stream"] == info.stream) & (frames["recv_ns"] >= info.first_ns) & (frames["recv_ns"] <= info.last_ns)
+
+            good &= check(data[:cut], frames[keep], f"recording cut at {cut} (block {block})")
+            checked += 1
+
+    # Damaged frame counts in the first block, which must be skipped rather than trusted:
+    # (The count is at offset 8 of a block header, and offset 4 of an index entry)
+
+    index_offset = int.from_bytes(data[-12:-4], "little")
+    header_count = index[0].offset + 8
+    index_count = index_offset + 8 + 4
+
+    first = (frames["stream"] == index[0].stream) & (frames["recv_ns"] >= index[0].first_ns) & (frames["recv_ns"] <= index[0].last_ns)
+
+    for count in (0, 0x40000000):
+
+        what = f" with a count of {count} in the first block"
+
+        # Walking the blocks leaves the damaged one out:
+
+        good &= check(patch(data[:index_offset], header_count, count), frames[~first], "unclosed recording" + what)
+
+        # A damaged index is ignored, and the (intact) blocks are walked instead:
+
+        good &= check(patch(data, index_count, count), frames, "closed recording" + what + " index entry")
+
+        good &= check(patch(patch(data, header_count, count), index_count, count), frames[~first], "closed recording" + what + " and index entry")
+
+    print(f"Checked {len(frames)} frames and {checked} truncated recordings")
+    print("All recordings match" if good else "MISMATCH")
+
+    return 0 if good else 1
+
+
+if __name__ == "__main__":
+
+    if len(sys.argv) < 2:
+        print(f"Usage: {sys.argv[0]} DIRECTORY")
+        sys.exit(2)
+
+    sys.exit(main(sys.argv[1]))
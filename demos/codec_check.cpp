@@ -0,0 +1,422 @@
+/**
+ * @file codec_check.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Checks that recordings decode exactly as written
+ * @version 0.1
+ * @date 2025-01-06
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file writes synthetic telemetry into recordings and decodes them again,
+ * making sure every frame comes back bit for bit:
+ *
+ * - A closed recording, read through its index
+ * - A recording that was never closed, read by walking its blocks
+ * - Both cut short at and around every block boundary (and at random points),
+ *   which must decode all complete blocks and nothing else
+ * - Time range queries, against a brute force search
+ * - Damaged frame counts, which must be skipped rather than trusted
+ *
+ * No autopilot is needed.
+ * Returns zero if everything matches.
+ *
+ * If a directory is provided, we also write the closed recording (check.dtsr)
+ * along with the frames we expect (check.bin) into it,
+ * so demos/check_recording.py can make sure the python decoder agrees.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "codec.hpp"
+
+/// Number of frames to generate
+const std::size_t NUM = 5000;
+
+/// Maximum number of frames in a block, small so we get plenty of blocks
+const std::size_t BLOCK = 64;
+
+/**
+ * @brief Generates synthetic telemetry
+ *
+ * Streams arrive at steady rates with some jitter, and values drift slowly,
+ * which is what the encoding is tuned for.
+ * We also throw in the cases it is not tuned for:
+ * masks that change, clock jumps, NaN and infinite values, and a value with random bits.
+ *
+ * Receive times are unique, so frames sorted by receive time have a single order.
+ *
+ * @return std::vector<Frame> Frames, in the order they were received
+ */
+std::vector<Frame> generate() {
+
+    std::mt19937_64 rng(42);
+    std::normal_distribution<double> noise(0, 1);
+
+    std::vector<Frame> frames(NUM);
+
+    int64_t recv = 1000000000;
+    std::array<double, FRAME_FIELDS> drift{};
+
+    for (std::size_t i = 0; i < NUM; ++i) {
+
+        Frame& frame = frames[i];
+
+        frame.stream = static_cast<uint16_t>(rng() % STREAMS);
+
+        // Steady arrivals with jitter, and the occasional long gap:
+
+        recv += 1000000 + static_cast<int64_t>(rng() % 50000) + (i % 2000 == 1999 ? 3000000000 : 0);
+
+        frame.recv_ns = recv;
+
+        // Streams carry all values, except for a while where one only carries a few:
+
+        frame.mask = frame.stream == 3 && i > 2000 && i < 3000 ? 0b101 : 0b111111111111;
+
+        // Some streams are timestamped by the autopilot:
+
+        if (frame.stream % 2 == 0) {
+            frame.mask |= TIMESTAMP_BIT;
+            frame.timestamp_us = static_cast<uint64_t>(recv / 1000) - 250 + (i % 1000 == 999 ? 0 : rng() % 3);
+        }
+
+        // Clocks are synchronized after a while:
+
+        if (i > 500) {
+            frame.mask |= CLOCK_BIT;
+            frame.vehicle_ns = recv - 5000000 + static_cast<int64_t>(rng() % 1000);
+
+            // The synchronized clock occasionally jumps backwards:
+
+            frame.sample_ns = recv - (i % 1500 == 1499 ? 100000000000 : 2000000);
+        }
+
+        for (std::size_t slot = 0; slot < FRAME_FIELDS; ++slot) {
+
+            if ((frame.mask & (1U << slot)) == 0) {
+                continue;
+            }
+
+            drift[slot] += noise(rng) * 0.01;
+
+            double value = drift[slot];
+
+            if (slot == 4) {
+                value = std::round(value * 10) / 10;  // Changes rarely
+            } else if (slot == 5 && i % 97 == 0) {
+                value = std::numeric_limits<double>::quiet_NaN();
+            } else if (slot == 6 && i % 101 == 0) {
+                value = -std::numeric_limits<double>::infinity();
+            } else if (slot == 7) {
+                const uint64_t bits = rng();
+                std::memcpy(&value, &bits, sizeof(value));  // Anything goes
+            }
+
+            frame.values[slot] = value;
+        }
+    }
+
+    return frames;
+}
+
+/**
+ * @brief Determines if a decoded frame matches the original bit for bit
+ *
+ * The link is not recorded, so it is ignored.
+ *
+ * @param a Original frame
+ * @param b Decoded frame
+ * @return bool true if identical, false if not
+ */
+bool same(const Frame& a, const Frame& b) {
+
+    return a.stream == b.stream && a.mask == b.mask && a.recv_ns == b.recv_ns && a.timestamp_us == b.timestamp_us && a.vehicle_ns == b.vehicle_ns && a.sample_ns == b.sample_ns &&
+           std::memcmp(a.values.data(), b.values.data(), sizeof(a.values)) == 0;
+}
+
+/**
+ * @brief Writes frames into a recording
+ *
+ * @param frames Frames to write
+ * @param close Determines if the recording is closed, which writes the index
+ * @return std::string Bytes of the recording
+ */
+std::string record(const std::vector<Frame>& frames, bool close) {
+
+    std::ostringstream out(std::ios::binary);
+
+    RecordWriter writer(out, BLOCK);
+
+    writer.write(frames);
+
+    if (close) {
+        writer.close();
+    } else {
+        writer.flush();
+    }
+
+    // We grab the bytes before the writer is destroyed, which would close the recording:
+
+    return out.str();
+}
+
+/**
+ * @brief Decodes a recording, checking each frame against the originals
+ *
+ * @param data Bytes of the recording
+ * @param frames Original frames
+ * @param expected Number of frames we expect to decode
+ * @param what Description of the recording, for errors
+ * @return bool true if everything matches, false if not
+ */
+bool check(const std::string& data, const std::vector<Frame>& frames, std::size_t expected, const std::string& what) {
+
+    std::istringstream in(data, std::ios::binary);
+
+    RecordReader reader(in);
+
+    if (!reader.is_valid()) {
+        std::cerr << what << ": not a valid recording" << '\n';
+        return false;
+    }
+
+    std::vector<Frame> out;
+
+    reader.read_all(out);
+
+    if (out.size() != expected) {
+        std::cerr << what << ": decoded " << out.size() << " frames, expected " << expected << '\n';
+        return false;
+    }
+
+    // Frames must be sorted, and match the original received at the same time:
+
+    for (std::size_t i = 0; i < out.size(); ++i) {
+
+        if (i > 0 && out[i - 1].recv_ns >= out[i].recv_ns) {
+            std::cerr << what << ": frame " << i << " is out of order" << '\n';
+            return false;
+        }
+
+        auto iter = std::lower_bound(frames.begin(), frames.end(), out[i].recv_ns, [](const Frame& frame, int64_t time) { return frame.recv_ns < time; });
+
+        if (iter == frames.end() || !same(*iter, out[i])) {
+            std::cerr << what << ": frame " << i << " does not match" << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Writes frames in a raw format python can read with numpy
+ *
+ * Each frame is written as little endian stream (u16), mask (u16), padding (u32),
+ * recv_ns (i64), timestamp_us (u64), vehicle_ns (i64), sample_ns (i64) and the values (f64).
+ * This assumes a little endian host.
+ *
+ * @param path Path to write to
+ * @param frames Frames to write
+ */
+void write_raw(const std::string& path, const std::vector<Frame>& frames) {
+
+    std::ofstream file(path, std::ios::binary);
+
+    const uint32_t pad = 0;
+
+    for (const Frame& frame : frames) {
+        file.write(reinterpret_cast<const char*>(&frame.stream), sizeof(frame.stream));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&frame.mask), sizeof(frame.mask));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&pad), sizeof(pad));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&frame.recv_ns), sizeof(frame.recv_ns));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&frame.timestamp_us), sizeof(frame.timestamp_us));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&frame.vehicle_ns), sizeof(frame.vehicle_ns));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(&frame.sample_ns), sizeof(frame.sample_ns));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+        file.write(reinterpret_cast<const char*>(frame.values.data()), sizeof(frame.values));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    }
+}
+
+/**
+ * @brief Overwrites a little endian 32 bit value in a recording
+ *
+ * @param data Bytes of the recording
+ * @param offset Offset of the value
+ * @param value Value to write
+ * @return std::string Bytes of the damaged recording
+ */
+std::string patch(std::string data, std::size_t offset, uint32_t value) {
+
+    for (std::size_t i = 0; i < 4; ++i) {
+        data[offset + i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+
+    return data;
+}
+
+int main(int argc, char** argv) {
+
+    const std::vector<Frame> frames = generate();
+
+    bool good = true;
+
+    // Round trip, with and without the index:
+
+    const std::string closed = record(frames, true);
+    const std::string open = record(frames, false);
+
+    good &= check(closed, frames, NUM, "closed recording");
+    good &= check(open, frames, NUM, "unclosed recording");
+
+    std::cout << NUM << " frames in " << closed.size() << " bytes ("
+              << static_cast<double>(closed.size()) / static_cast<double>(NUM * sizeof(Frame)) * 100 << "% of raw)" << '\n';
+
+    // Grab the block layout, so we know what each truncation should keep:
+
+    std::istringstream in(closed, std::ios::binary);
+
+    RecordReader reader(in);
+
+    const std::vector<BlockInfo> blocks = reader.get_index();
+
+    // (The last block ends where the index starts, which is where the unclosed recording ends)
+
+    std::vector<uint64_t> ends;
+
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        ends.push_back(i + 1 < blocks.size() ? blocks[i + 1].offset : open.size());
+    }
+
+    // Truncate at and around every block boundary, and at a few points inside blocks:
+
+    std::vector<std::size_t> cuts;
+
+    for (const uint64_t end : ends) {
+        cuts.push_back(end - 1);
+        cuts.push_back(end);
+        cuts.push_back(end + 1);
+        cuts.push_back(end + 31);
+    }
+
+    std::mt19937_64 rng(7);
+
+    for (std::size_t i = 0; i < 200; ++i) {
+        cuts.push_back(8 + rng() % (closed.size() - 8));
+    }
+
+    std::size_t checked = 0;
+
+    for (const std::size_t cut : cuts) {
+
+        // Frames of the blocks that are complete:
+
+        std::size_t expected = 0;
+
+        for (std::size_t i = 0; i < blocks.size(); ++i) {
+            if (ends[i] <= cut) {
+                expected += blocks[i].count;
+            }
+        }
+
+        // Cutting the closed recording loses the index, so both are read by walking blocks:
+
+        for (const std::string* data : {&closed, &open}) {
+
+            if (cut >= data->size()) {
+                continue;
+            }
+
+            good &= check(data->substr(0, cut), frames, expected, "recording cut at " + std::to_string(cut));
+            ++checked;
+        }
+    }
+
+    std::cout << "Checked " << checked << " truncated recordings" << '\n';
+
+    // Damaged frame counts in the first block, which must be skipped rather than trusted:
+    // (The count is at offset 8 of a block header, and offset 4 of an index entry)
+
+    uint64_t index_offset = 0;
+
+    for (std::size_t i = 0; i < 8; ++i) {
+        index_offset |= static_cast<uint64_t>(static_cast<uint8_t>(closed[closed.size() - 12 + i])) << (8 * i);
+    }
+
+    const std::size_t header_count = blocks[0].offset + 8;
+    const std::size_t index_count = index_offset + 8 + 4;
+
+    for (const uint32_t count : {0U, 0x40000000U}) {
+
+        const std::string what = " with a count of " + std::to_string(count) + " in the first block";
+
+        // Walking the blocks leaves the damaged one out:
+
+        good &= check(patch(open, header_count, count), frames, NUM - blocks[0].count, "unclosed recording" + what);
+
+        // A damaged index is ignored, and the (intact) blocks are walked instead:
+
+        good &= check(patch(closed, index_count, count), frames, NUM, "closed recording" + what + " index entry");
+
+        good &= check(patch(patch(closed, header_count, count), index_count, count), frames, NUM - blocks[0].count, "closed recording" + what + " and index entry");
+    }
+
+    // Time ranges, against a brute force search:
+
+    for (std::size_t i = 0; i < 100; ++i) {
+
+        const std::size_t stream = rng() % STREAMS;
+        const int64_t start = frames.front().recv_ns + static_cast<int64_t>(rng() % static_cast<uint64_t>(frames.back().recv_ns - frames.front().recv_ns));
+        const int64_t stop = start + static_cast<int64_t>(rng() % 2000000000);
+
+        std::vector<Frame> out;
+
+        reader.read_range(stream, start, stop, out);
+
+        std::vector<Frame> want;
+
+        for (const Frame& frame : frames) {
+            if (frame.stream == stream && frame.recv_ns >= start && frame.recv_ns <= stop) {
+                want.push_back(frame);
+            }
+        }
+
+        const bool match = out.size() == want.size() && std::equal(want.begin(), want.end(), out.begin(), same);
+
+        if (!match) {
+            std::cerr << "range " << start << " to " << stop << " of stream " << stream << " does not match" << '\n';
+        }
+
+        good &= match;
+    }
+
+    // Write files for the python decoder:
+
+    if (argc > 1) {
+
+        const std::string dir = argv[1];  // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+
+        std::ofstream file(dir + "/check.dtsr", std::ios::binary);
+
+        file.write(closed.data(), static_cast<std::streamsize>(closed.size()));
+
+        write_raw(dir + "/check.bin", frames);
+
+        std::cout << "Wrote " << dir << "/check.dtsr and " << dir << "/check.bin" << '\n';
+    }
+
+    std::cout << (good ? "All recordings match" : "MISMATCH") << '\n';
+
+    return good ? 0 : 1;
+}
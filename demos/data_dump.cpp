@@ -8,6 +8,8 @@
  * @copyright Copyright (c) 2024
  * 
  * This file dumps any and all flight data to a JSON file for later analysis.
+ * We retrieve frames in batches, so every frame that is received ends up in the file,
+ * each tagged with its stream and receive time.
  * The path to this file is hardcoded within this program,
  * so if one wishes to save to another location they MUST change and recompile.
  * 
@@ -19,17 +21,25 @@
  */
 
 #include <atomic>
+#include <chrono>
 #include <csignal>
-#include <cstdint>
+#include <cstddef>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "dts.hpp"
 
 /// Define path to output data
 const std::string PATH = "out.json";
 
+/// Maximum number of frames to retrieve at once
+const std::size_t BATCH_SIZE = 4096;
+
+/// Time to wait for frames before checking if we are still running
+const std::chrono::milliseconds BATCH_TIMEOUT(100);
+
 /// Boolean determining if we are running
 std::atomic<bool> running(true);
 
@@ -67,19 +77,37 @@ int main() {
 
     ofile << "{\"data\": [";
 
+    // Vector of frames, reused between batches:
+
+    std::vector<Frame> frames;
+    frames.reserve(BATCH_SIZE);
+
+    // Determines if we need a separating comma:
+    // (Trailing commas are against the JSON spec!)
+
+    bool first = true;
+
     // Iterate until completion:
 
     while (running) {
 
+        // Get all available frames:
+
+        frames.clear();
+        dstream.get_batch(frames, BATCH_SIZE, BATCH_TIMEOUT);
+
         // Output data to file:
 
-        ofile << dstream.get_data() << ",";
-    }
+        for (const Frame& frame : frames) {
 
-    // Seek to the last character to overwrite trailing comma:
-    // (Trailing commas are against the JSON spec!)
+            if (!first) {
+                ofile << ",";
+            }
 
-    ofile.seekp(static_cast<int64_t>(ofile.tellp()) - 1);
+            ofile << describe_frame(frame).dump();
+            first = false;
+        }
+    }
 
     // Finally, write the closing data:
 
@@ -0,0 +1,500 @@
+/**
+ * @file link_check.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Checks duplicate suppression across redundant links
+ * @version 0.1
+ * @date 2025-01-06
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file checks that samples arriving over several links are delivered exactly once,
+ * and that each link is measured correctly. This is done in two steps:
+ *
+ * - Offline - We feed the Deduplicator two simulated links (one fast, one slow and lossy)
+ * - Loopback - We pretend to be an autopilot, sending MAVLink over two UDP ports on this machine,
+ *   with extra delay and loss injected into the second one, and receive it with a DTStream
+ *
+ * No autopilot is needed, but the loopback step needs ports 14601 and 14602 to be free.
+ * Pass --offline to skip it.
+ * Returns zero if everything checks out.
+ *
+ * The loopback step uses POSIX sockets, so it is left out on Windows,
+ * where only the offline step runs.
+ */
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <plugins/mavlink_passthrough/mavlink_passthrough.h>
+
+#include "dts.hpp"
+#include "links.hpp"
+
+/// Ports the fake autopilot sends to, one per link
+const std::array<uint16_t, 2> PORTS = {14601, 14602};
+
+/// Extra delay of the slow link
+const std::chrono::milliseconds DELAY(40);
+
+/// Fraction of telemetry the slow link drops
+const double LOSS = 0.1;
+
+/// Rate telemetry is sent at, in Hz
+const int RATE = 50;
+
+/// Time we receive telemetry for
+const std::chrono::seconds DURATION(10);
+
+/**
+ * @brief Reports the outcome of a check
+ *
+ * @param good Determines if the check passed
+ * @param what Description of the check
+ * @return bool The outcome, so checks can be chained
+ */
+bool expect(bool good, const std::string& what) {
+
+    std::cout << (good ? "[ OK ] " : "[FAIL] ") << what << '\n';
+
+    return good;
+}
+
+/**
+ * @brief Checks the Deduplicator against two simulated links
+ *
+ * Link 0 arrives after 5 ms and drops 1% of samples,
+ * link 1 arrives after 25 ms and drops 10% of samples.
+ * We send a timestamped stream (position) and one without timestamps (fixedwing metrics),
+ * whose values repeat, as an idle airspeed would.
+ *
+ * @return bool true if everything checks out
+ */
+bool check_offline() {
+
+    std::cout << "Offline:" << '\n';
+
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    const int64_t period = 10000000;
+    const std::size_t samples = 6000;
+
+    const std::array<int64_t, 2> latency = {5000000, 25000000};
+    const std::array<int64_t, 2> jitter = {1000000, 2000000};
+    const std::array<double, 2> loss = {0.01, 0.1};
+
+    // Build the copies that arrive over each link:
+
+    std::vector<Frame> arrivals;
+
+    std::array<std::size_t, STREAMS> sent{};
+
+    for (std::size_t i = 0; i < samples; ++i) {
+
+        const int64_t time = static_cast<int64_t>(i) * period;
+
+        for (const std::size_t stream : {STREAM_POSITION, STREAM_FIXEDWING_METRICS}) {
+
+            Frame frame;
+
+            frame.stream = static_cast<uint16_t>(stream);
+
+            if (stream == STREAM_POSITION) {
+                frame.values[0] = static_cast<double>(i);
+                frame.timestamp_us = static_cast<uint64_t>(time / 1000);
+                frame.mask = 0b1 | TIMESTAMP_BIT;
+            } else {
+                frame.values[0] = static_cast<double>(i / 7);  // Repeats
+                frame.mask = 0b1;
+            }
+
+            bool arrived = false;
+
+            for (uint16_t link = 0; link < 2; ++link) {
+
+                if (uniform(rng) < loss[link]) {
+                    continue;
+                }
+
+                frame.link = link;
+                frame.recv_ns = time + latency[link] + static_cast<int64_t>(uniform(rng) * static_cast<double>(jitter[link]));
+
+                arrivals.push_back(frame);
+                arrived = true;
+            }
+
+            sent[stream] += arrived ? 1 : 0;
+        }
+    }
+
+    // Hand them over in the order they arrived:
+
+    std::stable_sort(arrivals.begin(), arrivals.end(), [](const Frame& a, const Frame& b) { return a.recv_ns < b.recv_ns; });
+
+    Deduplicator dedup(2, 500000000);
+
+    std::array<std::size_t, STREAMS> delivered{};
+    std::multiset<uint64_t> stamps;
+
+    for (const Frame& frame : arrivals) {
+
+        if (!dedup.add(frame, 0b11)) {
+            continue;
+        }
+
+        ++delivered[frame.stream];
+
+        if (frame.stream == STREAM_POSITION) {
+            stamps.insert(frame.timestamp_us);
+        }
+    }
+
+    std::array<LinkStats, 2> stats;
+
+    dedup.get_stats(0, stats[0]);
+    dedup.get_stats(1, stats[1]);
+
+    bool good = true;
+
+    // Every timestamped sample that arrived at all is delivered exactly once:
+
+    good &= expect(delivered[STREAM_POSITION] == sent[STREAM_POSITION], "timestamped samples delivered once (" + std::to_string(delivered[STREAM_POSITION]) + " of " + std::to_string(sent[STREAM_POSITION]) + ")");
+
+    good &= expect(std::adjacent_find(stamps.begin(), stamps.end()) == stamps.end(), "no timestamp delivered twice");
+
+    // Repeating values can't always be paired up when both links lose copies,
+    // but we must never deliver more than was sent, and rarely less:
+
+    good &= expect(delivered[STREAM_FIXEDWING_METRICS] <= sent[STREAM_FIXEDWING_METRICS] && delivered[STREAM_FIXEDWING_METRICS] * 100 >= sent[STREAM_FIXEDWING_METRICS] * 99,
+                   "repeating values delivered (" + std::to_string(delivered[STREAM_FIXEDWING_METRICS]) + " of " + std::to_string(sent[STREAM_FIXEDWING_METRICS]) + ")");
+
+    // The slow link mostly delivers duplicates, and lags by the difference in latency:
+
+    good &= expect(stats[1].duplicates > stats[1].delivered * 10, "slow link mostly delivers duplicates");
+
+    good &= expect(stats[0].lag_ns < 1000000, "fast link lag " + std::to_string(stats[0].lag_ns / 1000) + " us");
+
+    good &= expect(stats[1].lag_ns > 15000000 && stats[1].lag_ns < 25000000, "slow link lag " + std::to_string(stats[1].lag_ns / 1000) + " us, expected about 20000 us");
+
+    // Loss is a recent average, so it is noisy:
+
+    good &= expect(stats[0].loss < 0.04, "fast link loss " + std::to_string(stats[0].loss) + ", expected about 0.01");
+
+    good &= expect(stats[1].loss > 0.05 && stats[1].loss < 0.15, "slow link loss " + std::to_string(stats[1].loss) + ", expected about 0.1");
+
+    const auto total = static_cast<double>(sent[STREAM_POSITION] + sent[STREAM_FIXEDWING_METRICS]);
+
+    good &= expect(static_cast<double>(stats[1].missed) / total > 0.08 && static_cast<double>(stats[1].missed) / total < 0.12, "slow link missed " + std::to_string(stats[1].missed) + " samples");
+
+    return good;
+}
+
+#ifndef _WIN32
+
+/**
+ * @brief Pretends to be an autopilot, sending telemetry over two UDP links
+ *
+ * The first link sends everything right away.
+ * The second link delays everything by DELAY, and drops LOSS of the telemetry
+ * (heartbeats are never dropped, so the link stays connected).
+ *
+ * We send GLOBAL_POSITION_INT (timestamped) and VFR_HUD (not timestamped) at RATE,
+ * where each sample has a unique value so we can tell exactly which ones were delivered.
+ */
+class FakeAutopilot {
+private:
+
+    /// Socket of each link
+    std::array<int, 2> sockets{-1, -1};
+
+    /// Thread sending telemetry
+    std::thread thread;
+
+    /// Determines if we are running
+    std::atomic<bool> running{false};
+
+    /**
+     * @brief Sends a message over a link
+     *
+     * @param link Index of the link
+     * @param data Bytes of the message
+     */
+    void send(std::size_t link, const std::vector<uint8_t>& data) const {
+
+        sockaddr_in addr{};
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(PORTS[link]);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        sendto(this->sockets[link], data.data(), data.size(), 0, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    }
+
+    /**
+     * @brief Serializes a message
+     *
+     * @param message Message to serialize
+     * @return std::vector<uint8_t> Bytes to send
+     */
+    static std::vector<uint8_t> serialize(const mavlink_message_t& message) {
+
+        std::vector<uint8_t> data(MAVLINK_MAX_PACKET_LEN);
+
+        data.resize(mavlink_msg_to_send_buffer(data.data(), &message));
+
+        return data;
+    }
+
+    /**
+     * @brief Sends telemetry until stopped
+     */
+    void run() {
+
+        std::mt19937_64 rng(2);
+        std::uniform_real_distribution<double> uniform(0, 1);
+
+        // Messages waiting out the delay of the slow link:
+
+        std::deque<std::pair<std::chrono::steady_clock::time_point, std::vector<uint8_t>>> delayed;
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto period = std::chrono::microseconds(1000000 / RATE);
+
+        auto next_sample = start;
+        auto next_heartbeat = start;
+
+        uint32_t sample = 0;
+
+        while (this->running) {
+
+            const auto now = std::chrono::steady_clock::now();
+
+            std::vector<std::vector<uint8_t>> messages;
+            bool lossy = true;
+
+            if (now >= next_heartbeat) {
+
+                mavlink_message_t message;
+
+                mavlink_msg_heartbeat_pack(1, MAV_COMP_ID_AUTOPILOT1, &message, MAV_TYPE_QUADROTOR, MAV_AUTOPILOT_PX4, MAV_MODE_FLAG_CUSTOM_MODE_ENABLED, 0, MAV_STATE_ACTIVE);
+
+                messages.push_back(serialize(message));
+
+                next_heartbeat += std::chrono::seconds(1);
+                lossy = false;
+
+            } else if (now >= next_sample) {
+
+                const auto boot_ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(next_sample - start).count());
+
+                mavlink_message_t message;
+
+                mavlink_msg_global_position_int_pack(1, MAV_COMP_ID_AUTOPILOT1, &message, boot_ms, 473977420 + static_cast<int32_t>(sample), 85455940, 488000, 10000, 0, 0, 0, 0);
+
+                messages.push_back(serialize(message));
+
+                mavlink_msg_vfr_hud_pack(1, MAV_COMP_ID_AUTOPILOT1, &message, static_cast<float>(sample), 0, 0, 0, 0, 0);
+
+                messages.push_back(serialize(message));
+
+                next_sample += period;
+                ++sample;
+            }
+
+            for (const auto& data : messages) {
+
+                this->send(0, data);
+
+                if (!lossy || uniform(rng) >= LOSS) {
+                    delayed.emplace_back(now + DELAY, data);
+                }
+            }
+
+            // Send the delayed messages that are due:
+
+            while (!delayed.empty() && delayed.front().first <= now) {
+                this->send(1, delayed.front().second);
+                delayed.pop_front();
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }
+
+public:
+
+    FakeAutopilot() = default;
+
+    FakeAutopilot(const FakeAutopilot&) = delete;
+    FakeAutopilot& operator=(const FakeAutopilot&) = delete;
+
+    ~FakeAutopilot() { this->stop(); }
+
+    /**
+     * @brief Opens the sockets and starts sending
+     *
+     * @return bool true if started, false if the sockets could not be opened
+     */
+    bool start() {
+
+        for (int& sock : this->sockets) {
+
+            sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+            if (sock < 0) {
+                std::cerr << "Unable to open socket" << '\n';
+                return false;
+            }
+        }
+
+        this->running = true;
+        this->thread = std::thread(&FakeAutopilot::run, this);
+
+        return true;
+    }
+
+    /**
+     * @brief Stops sending and closes the sockets
+     */
+    void stop() {
+
+        this->running = false;
+
+        if (this->thread.joinable()) {
+            this->thread.join();
+        }
+
+        for (int& sock : this->sockets) {
+
+            if (sock >= 0) {
+                close(sock);
+                sock = -1;
+            }
+        }
+    }
+};
+
+/**
+ * @brief Checks a DTStream receiving from the fake autopilot over two links
+ *
+ * @return bool true if everything checks out
+ */
+bool check_loopback() {
+
+    std::cout << "Loopback:" << '\n';
+
+    DTStream dstream("udp://:" + std::to_string(PORTS[0]));
+
+    dstream.add_cstr("udp://:" + std::to_string(PORTS[1]));
+    dstream.set_ingest_mode(IngestMode::Passthrough);
+
+    FakeAutopilot autopilot;
+
+    if (!autopilot.start() || !dstream.start(std::chrono::seconds(10))) {
+        return expect(false, "connected to the fake autopilot");
+    }
+
+    // Give the slow link a moment to connect as well:
+
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    // Receive for a while, remembering the value of each sample:
+
+    std::array<std::vector<double>, STREAMS> values;
+
+    std::vector<Frame> frames;
+
+    const auto stop = std::chrono::steady_clock::now() + DURATION;
+
+    while (std::chrono::steady_clock::now() < stop) {
+
+        frames.clear();
+        dstream.get_batch(frames, 4096, std::chrono::milliseconds(100));
+
+        for (const Frame& frame : frames) {
+            values[frame.stream].push_back(frame.stream == STREAM_POSITION ? std::round((frame.values[0] - 47.397742) * 1e7) : frame.values[0]);
+        }
+    }
+
+    const std::vector<LinkStats> stats = dstream.get_link_stats();
+    const int fastest = dstream.get_fastest_link();
+
+    dstream.stop();
+    autopilot.stop();
+
+    bool good = true;
+
+    // The fast link is lossless, so each sample must show up exactly once, in order:
+
+    for (const std::size_t stream : {STREAM_POSITION, STREAM_FIXEDWING_METRICS}) {
+
+        const std::vector<double>& vals = values[stream];
+
+        bool consecutive = vals.size() > static_cast<std::size_t>(RATE);
+
+        for (std::size_t i = 1; i < vals.size(); ++i) {
+            consecutive &= vals[i] == vals[i - 1] + 1;
+        }
+
+        good &= expect(consecutive, std::string(STREAM_NAMES[stream]) + ": " + std::to_string(vals.size()) + " samples, each delivered once");
+    }
+
+    if (!expect(stats.size() == 2 && stats[0].connected && stats[1].connected, "both links connected")) {
+        return false;
+    }
+
+    good &= expect(stats[1].duplicates > stats[1].delivered * 10, "slow link mostly delivers duplicates (" + std::to_string(stats[1].duplicates) + " duplicates)");
+
+    good &= expect(stats[1].lag_ns > DELAY.count() * 500000 && stats[1].lag_ns < DELAY.count() * 1500000, "slow link lag " + std::to_string(stats[1].lag_ns / 1000) + " us, expected about " + std::to_string(DELAY.count() * 1000) + " us");
+
+    good &= expect(stats[0].loss < 0.02, "fast link loss " + std::to_string(stats[0].loss) + ", expected 0");
+
+    good &= expect(stats[1].loss > LOSS / 2 && stats[1].loss < LOSS * 2, "slow link loss " + std::to_string(stats[1].loss) + ", expected about " + std::to_string(LOSS));
+
+    good &= expect(fastest == 0, "fastest link is " + std::to_string(fastest) + ", expected 0");
+
+    return good;
+}
+
+#endif
+
+int main(int argc, char** argv) {
+
+    bool good = check_offline();
+
+#ifndef _WIN32
+    if (argc < 2 || std::string(argv[1]) != "--offline") {  // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        good &= check_loopback();
+    }
+#else
+    static_cast<void>(argc);
+    static_cast<void>(argv);
+
+    std::cout << "Loopback step is not supported on Windows, skipping it" << '\n';
+#endif
+
+    std::cout << (good ? "All checks passed" : "SOME CHECKS FAILED") << '\n';
+
+    return good ? 0 : 1;
+}
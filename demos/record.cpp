@@ -0,0 +1,138 @@
+/**
+ * @file record.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Records telemetry into a compressed recording
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file records any and all flight data into a compressed recording.
+ * This is much smaller than the JSON made by data_dump,
+ * and is cheap enough to run during flight.
+ *
+ * If a path to a recording is provided,
+ * we instead decode that recording and print each frame as JSON, one per line.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "codec.hpp"
+#include "dts.hpp"
+
+/// Define path to output data
+const std::string PATH = "out.dtsr";
+
+/// Maximum number of frames to retrieve at once
+const std::size_t BATCH_SIZE = 4096;
+
+/// Time to wait for frames before checking if we are still running
+const std::chrono::milliseconds BATCH_TIMEOUT(100);
+
+/// Boolean determining if we are running
+std::atomic<bool> running(true);
+
+void signal_callback_handler(int signum) {
+    std::cout << "Caught signal " << signum << '\n';
+    running = false;
+}
+
+/**
+ * @brief Prints all frames in a recording as JSON
+ *
+ * @param path Path to the recording
+ * @return int Exit code
+ */
+int decode(const std::string& path) {
+
+    std::ifstream ifile(path, std::ios::binary);
+
+    RecordReader reader(ifile);
+
+    if (!reader.is_valid()) {
+        return -1;
+    }
+
+    // Decode one block at a time, so we never hold the whole recording in memory:
+
+    std::vector<Frame> frames;
+
+    for (std::size_t i = 0; i < reader.get_index().size(); ++i) {
+
+        frames.clear();
+
+        if (!reader.read_block(i, frames)) {
+            std::cerr << "Block " << i << " is damaged, skipping" << '\n';
+            continue;
+        }
+
+        for (const Frame& frame : frames) {
+            std::cout << describe_frame(frame).dump() << '\n';
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    // Decode a recording if we are given one:
+
+    if (argc > 1) {
+        return decode(argv[1]);  // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+
+    // Configure signal handler:
+
+    signal(SIGINT, signal_callback_handler);
+
+    // Create stream instance:
+
+    DTStream dstream;
+
+    // Start the stream:
+
+    auto stat = dstream.start();
+
+    // Do something if we fail:
+
+    if (!stat) {
+        return -1;
+    }
+
+    // Open file for writing:
+
+    std::ofstream ofile(PATH, std::ios::binary);
+
+    RecordWriter writer(ofile);
+
+    // Vector of frames, reused between batches:
+
+    std::vector<Frame> frames;
+    frames.reserve(BATCH_SIZE);
+
+    // Iterate until completion:
+
+    while (running) {
+
+        frames.clear();
+        dstream.get_batch(frames, BATCH_SIZE, BATCH_TIMEOUT);
+
+        writer.write(frames);
+    }
+
+    // Finish the recording, which writes the index:
+
+    writer.close();
+
+    std::cout << "Recorded " << writer.get_frames() << " frames in " << writer.get_bytes() << " bytes" << '\n';
+
+    return 0;
+}
@@ -0,0 +1,260 @@
+/**
+ * @file clock_sync.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Synchronization between the autopilot and host clocks
+ * @version 0.1
+ * @date 2024-12-14
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes components for relating the autopilot clock (time since boot)
+ * to the host steady clock (CLOCK_MONOTONIC on Linux).
+ * Without this, autopilot timestamps can't be compared with host times,
+ * so we can't tell how old a sample is, or line up streams that carry no timestamp.
+ *
+ * We estimate the offset between the clocks, along with the drift between them,
+ * from two sources of information:
+ *
+ * - MAVLink TIMESYNC exchanges - We send our time, the autopilot answers with its time.
+ *   The autopilot time corresponds to some point during the round trip,
+ *   so exchanges with short round trips are the most accurate.
+ * - Receive times - A frame can't arrive before it was sampled,
+ *   so each timestamped frame puts a lower bound on the offset.
+ */
+
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * @brief Estimated relation between the autopilot and host clocks
+ *
+ * The autopilot clock is modeled as:
+ *
+ * vehicle = host + offset + drift * (host - ref)
+ *
+ * All times are in nanoseconds.
+ */
+struct ClockEstimate {
+
+    /// Determines if this estimate is usable
+    bool valid = false;
+
+    /// Host time the offset applies to
+    int64_t ref_ns = 0;
+
+    /// Autopilot time minus host time, at the reference time
+    int64_t offset_ns = 0;
+
+    /// Rate at which the offset changes, in nanoseconds per nanosecond of host time
+    double drift = 0;
+
+    /// Shortest round trip time of the exchanges used for this estimate, -1 if none
+    int64_t rtt_ns = -1;
+
+    /// Number of TIMESYNC exchanges used for this estimate
+    std::size_t exchanges = 0;
+
+    /**
+     * @brief Converts a host time into autopilot time
+     *
+     * @param host_ns Host steady clock time
+     * @return int64_t Autopilot time
+     */
+    int64_t to_vehicle(int64_t host_ns) const {
+        return host_ns + this->offset_ns + std::llround(this->drift * static_cast<double>(host_ns - this->ref_ns));
+    }
+
+    /**
+     * @brief Converts an autopilot time into host time
+     *
+     * @param vehicle_ns Autopilot time
+     * @return int64_t Host steady clock time
+     */
+    int64_t to_host(int64_t vehicle_ns) const {
+        return this->ref_ns + std::llround(static_cast<double>(vehicle_ns - this->ref_ns - this->offset_ns) / (1.0 + this->drift));
+    }
+};
+
+/**
+ * @brief Estimates the offset and drift between the autopilot and host clocks
+ *
+ * TIMESYNC requests are created with make_request() and sent by the caller,
+ * and responses are handed back through add_response().
+ * We only accept responses to our own requests,
+ * as MAVSDK also runs TIMESYNC exchanges of its own.
+ *
+ * From the most recent exchanges, we only keep those with a short round trip,
+ * and fit a line through them to get the offset and drift.
+ * The midpoint of the round trip is used as the host time of each exchange,
+ * so the error is at most half of the round trip.
+ *
+ * Frames with autopilot timestamps are handed to add_receive().
+ * As a frame can't arrive before it was sampled, the highest (autopilot - receive time)
+ * seen recently is a lower bound on the offset, and the estimate is raised to meet it.
+ * If the autopilot does not answer TIMESYNC at all, this lower bound becomes the estimate,
+ * which is then late by the smallest transport latency.
+ *
+ * If the autopilot clock jumps (say, the autopilot rebooted), we start over.
+ *
+ * All functions are thread safe.
+ */
+class ClockSync {
+private:
+
+    /// A single TIMESYNC exchange
+    struct Exchange {
+
+        /// Host time at the middle of the round trip
+        int64_t host_ns = 0;
+
+        /// Autopilot time reported in the response
+        int64_t vehicle_ns = 0;
+
+        /// Round trip time
+        int64_t rtt_ns = 0;
+    };
+
+    /// Highest (autopilot - receive time) seen over a period of time
+    struct Bound {
+
+        /// Index of the period this bound covers
+        int64_t period = 0;
+
+        /// Host receive time of the frame that set this bound
+        int64_t host_ns = 0;
+
+        /// Autopilot time minus receive time
+        int64_t offset_ns = 0;
+    };
+
+    /// Number of exchanges to keep
+    static constexpr std::size_t EXCHANGES = 64;
+
+    /// Number of requests we remember while waiting for responses
+    static constexpr std::size_t PENDING = 16;
+
+    /// Number of receive time bounds to keep
+    static constexpr std::size_t BOUNDS = 16;
+
+    /// Mutex protecting everything below
+    mutable std::mutex mutex;
+
+    /// Most recent exchanges, used as a ring
+    std::array<Exchange, EXCHANGES> exchanges{};
+
+    /// Number of exchanges in the ring
+    std::size_t exchange_count = 0;
+
+    /// Position of the next exchange in the ring
+    std::size_t exchange_next = 0;
+
+    /// Times of requests we are waiting on
+    std::array<int64_t, PENDING> pending{};
+
+    /// Position of the next request
+    std::size_t pending_next = 0;
+
+    /// Receive time bounds, one per period, used as a ring
+    std::array<Bound, BOUNDS> bounds{};
+
+    /// Number of bounds in the ring
+    std::size_t bound_count = 0;
+
+    /// Position of the current bound
+    std::size_t bound_current = 0;
+
+    /// Estimate from the exchanges alone
+    ClockEstimate exchange_estimate;
+
+    /// Final estimate
+    ClockEstimate estimate;
+
+    /// Longest round trip we accept
+    int64_t max_rtt_ns = 200000000;
+
+    /// Error between a sample and the estimate that makes us start over
+    int64_t jump_ns = 2000000000;
+
+    /// Length of the period covered by each receive time bound
+    int64_t bound_period_ns = 1000000000;
+
+    /// Shortest host time span needed to estimate drift
+    int64_t drift_span_ns = 10000000000;
+
+    /// Largest drift we believe, anything beyond this is noise
+    double max_drift = 500e-6;
+
+    /// Autopilot times beyond this are not time since boot (likely UNIX time), so we ignore them
+    int64_t max_vehicle_ns = 100000000000000000;
+
+    /**
+     * @brief Fits the exchange estimate to the exchanges we have
+     *
+     * The mutex MUST be held when calling this function.
+     */
+    void fit_exchanges();
+
+    /**
+     * @brief Combines the exchange estimate with the receive time bounds
+     *
+     * The mutex MUST be held when calling this function.
+     */
+    void update_estimate();
+
+    /**
+     * @brief Forgets everything
+     *
+     * The mutex MUST be held when calling this function.
+     */
+    void clear();
+
+public:
+
+    /**
+     * @brief Creates a TIMESYNC request
+     *
+     * We remember the time, so we can match the response later.
+     * This time should be sent as ts1, with tc1 set to zero.
+     *
+     * @param host_ns Current host time
+     * @return int64_t Value to send as ts1
+     */
+    int64_t make_request(int64_t host_ns);
+
+    /**
+     * @brief Handles a TIMESYNC response
+     *
+     * @param ts1 ts1 of the response, which is the time of our request
+     * @param tc1 tc1 of the response, which is the autopilot time
+     * @param host_ns Host time the response was received
+     * @return bool true if this was a response to one of our requests
+     */
+    bool add_response(int64_t ts1, int64_t tc1, int64_t host_ns);
+
+    /**
+     * @brief Handles a frame with an autopilot timestamp
+     *
+     * @param vehicle_ns Autopilot timestamp of the frame
+     * @param host_ns Host time the frame was received
+     */
+    void add_receive(int64_t vehicle_ns, int64_t host_ns);
+
+    /**
+     * @brief Gets the current estimate
+     *
+     * @return ClockEstimate Current estimate, check valid before using it
+     */
+    ClockEstimate get_estimate() const;
+
+    /**
+     * @brief Forgets everything, and starts over
+     *
+     * This should be called when we connect to a (possibly different) autopilot.
+     */
+    void reset();
+};
@@ -0,0 +1,324 @@
+/**
+ * @file codec.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Compressed recordings of telemetry frames
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes components for writing and reading compressed recordings of frames.
+ * Recordings use the encoding described in the Gorilla paper (Pelkonen et al., 2015),
+ * which works very well on telemetry, as most values change very little between samples.
+ *
+ * Frames are gathered into blocks, where each block only contains frames from one stream.
+ * Inside a block, data is stored by column:
+ *
+ * - Receive times - delta of delta encoded
+ * - Autopilot timestamps - delta of delta encoded (if present)
+ * - Synchronized autopilot and sample times - delta of delta encoded (if present)
+ * - Values - XOR encoded, one column per value present in the frames
+ *
+ * Each block starts with a small header that describes the stream and time range it covers,
+ * and a recording ends with an index of all blocks,
+ * which allows readers to jump straight to the blocks they care about.
+ * If a recording was never closed (say, the program crashed),
+ * the index is missing and readers find the blocks by walking the recording instead.
+ *
+ * The layout of a recording is as follows (all integers are little endian):
+ *
+ * - Header - "DTSR", version, number of streams, number of fields, reserved (8 bytes)
+ * - Blocks - "BLK0", stream, reserved, mask, count, first receive time, last receive time, payload size, payload
+ * - Index - "IDX0", number of blocks, one entry per block
+ * - Trailer - Offset of the index, "DTSE"
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "frame.hpp"
+
+/// Version of the recording format
+/// (Version 2 added synchronized times, readers still accept version 1)
+const uint8_t RECORD_VERSION = 2;
+
+/// Default number of frames in a block
+const std::size_t RECORD_BLOCK_FRAMES = 512;
+
+/**
+ * @brief Describes a block in a recording
+ *
+ * Blocks of the same stream are always stored in the order they were received.
+ */
+struct BlockInfo {
+
+    /// Index of the stream in this block
+    uint16_t stream = 0;
+
+    /// Mask shared by all frames in this block
+    uint16_t mask = 0;
+
+    /// Number of frames in this block
+    uint32_t count = 0;
+
+    /// Receive time of the first frame in this block
+    int64_t first_ns = 0;
+
+    /// Receive time of the last frame in this block
+    int64_t last_ns = 0;
+
+    /// Offset of the block header from the start of the recording
+    uint64_t offset = 0;
+};
+
+/**
+ * @brief Writes compressed recordings of frames
+ *
+ * Frames are kept in a per-stream block until the block is full,
+ * or until a frame with a different mask arrives, at which point the block is encoded and written out.
+ * Block buffers (sized for the worst case) are allocated once, and headers are written in place,
+ * so writing frames does not allocate, other than the block index growing now and then.
+ *
+ * The index is only written when the recording is closed,
+ * so be sure to call close() (or let the writer be destroyed) when done.
+ * Until then the recording is still readable, just without the index.
+ */
+class RecordWriter {
+private:
+
+    /// Frames that are waiting to be encoded for a stream
+    struct Pending {
+
+        /// Frames in this block
+        std::vector<Frame> frames;
+
+        /// Mask shared by all frames
+        uint16_t mask = 0;
+    };
+
+    /// Stream we write to
+    std::ostream& out;
+
+    /// Maximum number of frames in a block
+    std::size_t block_frames;
+
+    /// Pending blocks for each stream
+    std::array<Pending, STREAMS> pending;
+
+    /// Buffer blocks are encoded into
+    std::vector<uint8_t> scratch;
+
+    /// Index of all blocks written so far
+    std::vector<BlockInfo> index;
+
+    /// Number of bytes written so far
+    uint64_t position = 0;
+
+    /// Number of frames written so far
+    uint64_t frames = 0;
+
+    /// Determines if the recording is closed
+    bool closed = false;
+
+    /**
+     * @brief Encodes and writes the pending block of a stream
+     *
+     * @param stream Index of the stream
+     */
+    void write_block(std::size_t stream);
+
+    /**
+     * @brief Writes raw bytes to the stream
+     *
+     * @param data Bytes to write
+     * @param size Number of bytes
+     */
+    void write_bytes(const uint8_t* data, std::size_t size);
+
+public:
+
+    /**
+     * @brief Construct a new RecordWriter
+     *
+     * We write the recording header right away.
+     *
+     * @param output Stream to write to, should be opened in binary mode
+     * @param block Maximum number of frames in a block
+     */
+    explicit RecordWriter(std::ostream& output, std::size_t block = RECORD_BLOCK_FRAMES);
+
+    ~RecordWriter();
+
+    RecordWriter(const RecordWriter&) = delete;
+    RecordWriter& operator=(const RecordWriter&) = delete;
+
+    /**
+     * @brief Adds a frame to the recording
+     *
+     * Frames of each stream must be written in the order they were received.
+     *
+     * @param frame Frame to add
+     */
+    void write(const Frame& frame);
+
+    /**
+     * @brief Adds many frames to the recording
+     *
+     * @param frames Frames to add
+     */
+    void write(const std::vector<Frame>& frames);
+
+    /**
+     * @brief Writes out all pending blocks
+     *
+     * This is useful to limit how much data is lost if the program dies,
+     * at the cost of smaller (and thus less compressed) blocks.
+     */
+    void flush();
+
+    /**
+     * @brief Finishes the recording
+     *
+     * We write out all pending blocks, followed by the index.
+     * No frames can be added after this.
+     */
+    void close();
+
+    /**
+     * @brief Gets the number of bytes written so far
+     *
+     * @return uint64_t Number of bytes
+     */
+    uint64_t get_bytes() const { return this->position; }
+
+    /**
+     * @brief Gets the number of frames written so far
+     *
+     * Frames that are still pending are not included.
+     *
+     * @return uint64_t Number of frames
+     */
+    uint64_t get_frames() const { return this->frames; }
+};
+
+/**
+ * @brief Reads compressed recordings of frames
+ *
+ * When opened, we load the index of the recording
+ * (or rebuild it by walking the blocks if it is missing).
+ * Blocks can then be decoded individually, so only the parts of interest are read.
+ *
+ * Recordings that were cut short (say, the program died while writing) are read
+ * up to the last complete block, a block cut short is dropped.
+ * read_block() reports damaged blocks, while read_range() and read_all() skip them.
+ * A block whose frame count could not fit in its payload is damaged,
+ * and is left out of the index (an index with such a block is ignored, and the blocks are walked instead).
+ * This matches the python decoder in pdts.recording.
+ */
+class RecordReader {
+private:
+
+    /// Stream we read from
+    std::istream& in;
+
+    /// Index of all blocks
+    std::vector<BlockInfo> index;
+
+    /// Positions in the index of the blocks of each stream
+    std::array<std::vector<std::size_t>, STREAMS> stream_blocks;
+
+    /// Buffer payloads are read into
+    std::vector<uint8_t> scratch;
+
+    /// Determines if the recording is valid
+    bool valid = false;
+
+    /**
+     * @brief Loads the index written at the end of the recording
+     *
+     * @return bool true if loaded, false if the recording has no index
+     */
+    bool load_index();
+
+    /**
+     * @brief Builds the index by walking all blocks
+     *
+     * We stop at the first block that is not complete.
+     */
+    void scan_index();
+
+public:
+
+    /**
+     * @brief Construct a new RecordReader
+     *
+     * @param input Stream to read from, must be seekable and opened in binary mode
+     */
+    explicit RecordReader(std::istream& input);
+
+    /**
+     * @brief Determines if the recording was opened successfully
+     *
+     * @return bool true if valid, false if not a recording
+     */
+    bool is_valid() const { return this->valid; }
+
+    /**
+     * @brief Gets the index of all blocks
+     *
+     * Blocks are listed in the order they appear in the recording.
+     *
+     * @return const std::vector<BlockInfo>& Index of blocks
+     */
+    const std::vector<BlockInfo>& get_index() const { return this->index; }
+
+    /**
+     * @brief Finds the first block of a stream that contains frames at or after a time
+     *
+     * @param stream Index of the stream
+     * @param recv_ns Receive time to look for
+     * @return std::size_t Position of the block in the index, or the size of the index if none
+     */
+    std::size_t find_block(std::size_t stream, int64_t recv_ns) const;
+
+    /**
+     * @brief Decodes a block
+     *
+     * Frames are appended to the given vector.
+     *
+     * @param block Position of the block in the index
+     * @param out Vector to append frames to
+     * @return bool true if decoded, false if the block is damaged
+     */
+    bool read_block(std::size_t block, std::vector<Frame>& out);
+
+    /**
+     * @brief Decodes all frames of a stream received in a time range
+     *
+     * We only decode the blocks that overlap the range.
+     *
+     * @param stream Index of the stream
+     * @param start_ns Start of the range (inclusive)
+     * @param stop_ns End of the range (inclusive)
+     * @param out Vector to append frames to
+     * @return std::size_t Number of frames added
+     */
+    std::size_t read_range(std::size_t stream, int64_t start_ns, int64_t stop_ns, std::vector<Frame>& out);
+
+    /**
+     * @brief Decodes all frames in the recording
+     *
+     * Frames are appended sorted by the time they were received
+     * (frames received at the same time keep the order they appear in the recording).
+     *
+     * @param out Vector to append frames to
+     * @return std::size_t Number of frames added
+     */
+    std::size_t read_all(std::vector<Frame>& out);
+};
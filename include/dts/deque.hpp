@@ -12,10 +12,13 @@
 
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
 #include <mutex>
 #include <deque>
+#include <vector>
 
 /**
  * @brief A thread safe Deque
@@ -131,4 +134,45 @@ public:
 
         return std::move(val);
     }
+
+    /**
+     * @brief Removes many values from the queue at once
+     *
+     * This function removes up to max values from the queue,
+     * and appends them to the given vector, oldest first.
+     * The mutex is acquired only once, no matter how many values we take.
+     * Unlike pop(), this function never waits for values to arrive.
+     *
+     * @param out Vector to append values to
+     * @param max Maximum number of values to remove
+     * @return std::size_t Number of values removed
+     */
+    std::size_t drain(std::vector<T>& out, std::size_t max) {
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        const std::size_t num = std::min(max, this->deque.size());
+
+        // The oldest values live at the back of the deque:
+
+        for (std::size_t i = 0; i < num; ++i) {
+            out.push_back(std::move(this->deque[this->deque.size() - 1 - i]));
+        }
+
+        this->deque.erase(this->deque.end() - static_cast<std::ptrdiff_t>(num), this->deque.end());
+
+        return num;
+    }
+
+    /**
+     * @brief Gets the number of values in the queue
+     *
+     * @return std::size_t Number of values in the queue
+     */
+    std::size_t size() {
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        return this->deque.size();
+    }
 };
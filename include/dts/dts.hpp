@@ -18,18 +18,67 @@
 #include <utility>
 #include <memory>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <mavsdk.h>
 #include <plugins/telemetry/telemetry.h>
+#include <plugins/mavlink_passthrough/mavlink_passthrough.h>
 #include <nlohmann/json.hpp>
 
 #include "squeue.hpp"
+#include "clock_sync.hpp"
 #include "deque.hpp"
+#include "frame.hpp"
+#include "geodetic.hpp"
+#include "history.hpp"
+#include "links.hpp"
+#include "spsc.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
 
 using json = nlohmann::json;
 
-/// Number of streams this component is tracking
-const unsigned int STREAMS = 6;
+/**
+ * @brief Connection states of a DTStream
+ *
+ * A stream starts out as Stopped.
+ * Once started it is Connecting until an autopilot is discovered,
+ * at which point it becomes Connected.
+ * If the system stops sending heartbeats the stream is Lost,
+ * and when the same system reappears we are Reconnecting
+ * while telemetry is resubscribed, after which we are Connected again.
+ */
+enum class ConnectionState : uint8_t {
+    Stopped,
+    Connecting,
+    Connected,
+    Lost,
+    Reconnecting
+};
+
+/**
+ * @brief Ways telemetry can be ingested
+ *
+ * - Telemetry - Use the MAVSDK telemetry plugin and its subscribe_* callbacks
+ * - Passthrough - Decode the MAVLink messages we need ourselves via MAVSDK's MavlinkPassthrough
+ *
+ * Passthrough mode skips the translation and locking done by the telemetry plugin,
+ * and exposes some extra values, such as attitude quaternions,
+ * HIGHRES_IMU fields_updated and the autopilot timestamp of most streams.
+ */
+enum class IngestMode : uint8_t {
+    Telemetry,
+    Passthrough
+};
 
 /**
  * @brief Entry point for all telemetry operations
@@ -48,12 +97,55 @@ const unsigned int STREAMS = 6;
  * A drop rate of 2 will accept the first received packet and then drop the next two.
  * A drop rate of 0 will not drop any packets, and is the default.
  * 
+ * Streams can be started and stopped as many times as necessary.
+ * Discovery happens in the background, so users can start a stream
+ * without blocking and check on the connection state later.
+ * If the connection to the system is lost, we will automatically
+ * resubscribe to telemetry once it reappears.
+ * The queues are kept intact, so consumers will simply see a gap in the data.
+ * 
+ * Each stream is watched by a watchdog, which measures its rate
+ * and reports a health state for it.
+ * Optionally, stalled streams can be automatically resubscribed.
+ * 
+ * MAVSDK delivers all telemetry on a single callback thread,
+ * so we keep our callbacks as short as possible.
+ * They only copy the incoming values into a frame and hand it off through a lock free queue.
+ * A dedicated worker thread then does the heavy lifting (bookkeeping, conversions, queueing).
+ * Frames are only converted into JSON when a consumer asks for it.
+ * The worker can optionally be pinned to a CPU and run with real time priority.
+ * 
+ * Position frames can optionally be converted into a local frame (ECEF, ENU or NED)
+ * around an origin, such as the ground station.
+ * The worker converts positions in batches, and adds the results to the position stream.
+ * 
+ * Telemetry can be received over several links to the same autopilot at once (see add_cstr()).
+ * Each link gets its own MAVSDK instance, and the worker only keeps the first copy of each sample,
+ * while measuring the lag and loss of each link.
+ * 
+ * We keep the autopilot and host clocks synchronized (see ClockSync),
+ * using TIMESYNC exchanges sent by the monitor thread, along with the timestamps of incoming frames.
+ * Once synchronized, every frame is stamped with its autopilot time and the host time it was sampled,
+ * so streams can be lined up and their latency measured.
+ * 
+ * Each stream can also keep a fixed size history of recent frames, indexed by receive time,
+ * which can be queried by time range without consuming anything from the queues.
+ * 
+ * The worker can also keep sliding window statistics (mean, variance, min/max, rate of change)
+ * over any value, so consumers can query them at any time without buffering data themselves.
+ * 
+ * When built with DTS_ENABLE_TRACING, each stage of the pipeline (callbacks, queueing, merging, serialization)
+ * records trace points that can be written out with trace_flush(), see trace.hpp.
+ * 
+ * By default we ingest telemetry via the MAVSDK telemetry plugin,
+ * but users can instead select passthrough mode, where we decode raw MAVLink messages.
+ * See IngestMode for more info.
  */
 class DTStream {
 private:
 
-    /// Connection URL to utilize
-    std::string connection_url = "udp://:14540";
+    /// Connection URLs to utilize, one per link
+    std::vector<std::string> connection_urls{"udp://:14540"};
 
     /// Component type (we hardcode to ground station)
     mavsdk::Mavsdk::ComponentType component_type = mavsdk::Mavsdk::ComponentType::GroundStation;
@@ -61,38 +153,453 @@ private:
     /// MAVSDK configuration instance
     mavsdk::Mavsdk::Configuration config;
 
-    /// MAVSDK instance to utilize
-    mavsdk::Mavsdk mavsdk;
+    /// Mode used to ingest telemetry
+    IngestMode ingest_mode = IngestMode::Telemetry;
+
+    /// A single connection to the autopilot
+    struct Link {
+
+        /// Index of this link
+        uint16_t index = 0;
+
+        /// Connection URL of this link
+        std::string url;
+
+        /// MAVSDK instance of this link (created on start, destroyed on stop)
+        std::unique_ptr<mavsdk::Mavsdk> mavsdk;
+
+        /// System we are receiving telemetry from
+        std::shared_ptr<mavsdk::System> system;
+
+        /// Telemetry pointer (only used in telemetry mode)
+        std::unique_ptr<mavsdk::Telemetry> telemetry;
+
+        /// MAVLink passthrough pointer
+        std::unique_ptr<mavsdk::MavlinkPassthrough> passthrough;
+
+        /// Determines if we have received ATTITUDE_QUATERNION in passthrough mode
+        std::atomic<bool> quaternion_seen{false};
+
+        /// Handle of the new system callback
+        mavsdk::Mavsdk::NewSystemHandle system_handle;
+
+        /// Functions that remove each telemetry subscription
+        std::array<std::function<void()>, STREAMS> unsubscribers;
 
-    /// Telemetry pointer
-    std::unique_ptr<mavsdk::Telemetry> telemetry;
+        /// Function that removes the TIMESYNC subscription
+        std::function<void()> timesync_unsubscriber;
+
+        /// Connection state of this link
+        ConnectionState state = ConnectionState::Stopped;
+
+        /// Queue handing frames off from the MAVSDK instance of this link to the worker thread
+        SPSCQueue<Frame> handoff{1024};
+
+        /// Recent average TIMESYNC round trip time, -1 if unknown
+        std::atomic<int64_t> rtt_ns{-1};
+    };
+
+    /// Links we receive telemetry over (created on start, kept after stop so statistics can be read)
+    std::vector<std::unique_ptr<Link>> links;
+
+    /// Bitmask of the links that are connected
+    std::atomic<uint32_t> active_links{0};
+
+    /// Suppresses samples that arrive over more than one link
+    Deduplicator dedup;
+
+    /// Mutex protecting the deduplicator
+    std::mutex dedup_mutex;
+
+    /// Time samples are remembered for duplicate suppression
+    std::chrono::milliseconds dedup_window{500};
+
+    /// Current connection state
+    std::atomic<ConnectionState> state{ConnectionState::Stopped};
+
+    /// Mutex protecting the connection state and MAVSDK components
+    std::mutex state_mutex;
+
+    /// Condition variable notified on each state change
+    std::condition_variable state_cond;
+
+    /// User callback invoked on each state change
+    /// (Shared, so grabbing it under the mutex never copies the function itself, which may need the Python GIL)
+    std::shared_ptr<const std::function<void(ConnectionState)>> state_callback;
+
+    /// Watchdog monitoring the health of each stream
+    Watchdog<STREAMS> watchdog;
+
+    /// User callback invoked on each stream health change
+    /// (Shared for the same reason as state_callback)
+    std::shared_ptr<const Watchdog<STREAMS>::HealthCallback> health_callback;
+
+    /// Determines if stalled streams are automatically resubscribed
+    std::atomic<bool> auto_resubscribe{false};
+
+    /// Thread that periodically checks on the streams
+    std::thread monitor_thread;
+
+    /// Determines if the monitor thread should keep running
+    bool monitor_running = false;
+
+    /// Mutex protecting the monitor thread state
+    std::mutex monitor_mutex;
+
+    /// Condition variable used to wake the monitor thread
+    std::condition_variable monitor_cond;
+
+    /// Interval between monitor checks
+    std::chrono::milliseconds monitor_interval{100};
+
+    /// Minimum time between resubscribe attempts of a stream
+    std::chrono::milliseconds resubscribe_backoff{2000};
 
     /// Array of queues for each stream
-    std::array<Deque<json>, STREAMS> deque;
+    std::array<Deque<Frame>, STREAMS> deque;
+
+    /// Number of batches the worker has queued, used to wake batch consumers
+    std::atomic<uint64_t> published{0};
+
+    /// Number of consumers waiting in get_batch()
+    std::atomic<int> batch_waiters{0};
+
+    /// Mutex used to put batch consumers to sleep
+    std::mutex batch_mutex;
+
+    /// Condition variable used to wake batch consumers
+    std::condition_variable batch_cond;
+
+    /// Stream get_batch() starts draining from, rotated so all streams get a fair share
+    std::atomic<std::size_t> batch_start{0};
+
+    /// History of recent frames for each stream, disabled by default
+    std::array<History, STREAMS> history;
 
     /// Array of drop rates for each stream
-    std::array<uint16_t, STREAMS> drops;
+    std::array<uint16_t, STREAMS> drops{};
 
     /// Drop rate of this queue
     uint16_t drop_rate = 1;
 
+    /// Number of frames lost because a handoff queue was full
+    std::atomic<uint64_t> overruns{0};
+
+    /// Thread that processes incoming frames
+    std::thread worker_thread;
+
+    /// Determines if the worker thread should keep running
+    bool worker_running = false;
+
+    /// Determines if the worker thread is waiting for frames
+    std::atomic<bool> worker_sleeping{false};
+
+    /// Mutex used to put the worker thread to sleep
+    std::mutex worker_mutex;
+
+    /// Condition variable used to wake the worker thread
+    std::condition_variable worker_cond;
+
+    /// Maximum number of frames the worker processes at once
+    static constexpr std::size_t WORKER_BATCH = 64;
+
+    /// Transform used to convert positions into a local frame
+    GeodeticTransform local_transform;
+
+    /// Determines if positions are converted into a local frame
+    bool local_enabled = false;
+
+    /// Mutex protecting the local frame configuration
+    std::mutex local_mutex;
+
+    /// CPU to pin the worker thread to, -1 for none
+    int worker_cpu = -1;
+
+    /// SCHED_FIFO priority of the worker thread, 0 for normal scheduling
+    int worker_priority = 0;
+
+    /// Synchronizes the autopilot and host clocks
+    ClockSync clock;
+
+    /// Time between TIMESYNC requests once synchronized
+    std::chrono::milliseconds timesync_interval{1000};
+
+    /// Sliding window statistics kept over a value
+    struct Statistic {
+
+        /// Name of the value
+        std::string field;
+
+        /// Slot of the value in its frames
+        std::size_t slot = 0;
+
+        /// Window of samples
+        WindowStats window;
+    };
+
+    /// Statistics kept for each stream
+    std::array<std::vector<Statistic>, STREAMS> statistics;
+
+    /// Mutex protecting the statistics
+    std::mutex stats_mutex;
+
+    /// Determines if any statistics are kept, so the worker can skip them entirely
+    std::atomic<bool> stats_enabled{false};
+
+    /**
+     * @brief Subscribes to TIMESYNC responses of a link
+     * 
+     * The passthrough plugin of the link MUST be created before calling this function.
+     * Any previous TIMESYNC subscription of the link is removed first,
+     * so each response is only handed to the clock once.
+     * 
+     * @param link Link to subscribe on
+     */
+    void subscribe_timesync(Link* link);
+
+    /**
+     * @brief Sends a TIMESYNC request to the autopilot
+     * 
+     * One request is sent over each connected link,
+     * so we also learn the round trip time of each link.
+     */
+    void send_timesync();
+
+    /**
+     * @brief Suppresses duplicates in a batch
+     * 
+     * Only the first copy of each sample is kept,
+     * the batch is compacted in place.
+     * 
+     * @param frames Frames to check
+     * @param count Number of frames
+     * @return std::size_t Number of frames kept
+     */
+    std::size_t deduplicate(Frame* frames, std::size_t count);
+
+    /**
+     * @brief Determines if all handoff queues are empty
+     * 
+     * @return bool true if empty, false if not
+     */
+    bool handoff_empty() const;
+
+    /**
+     * @brief Stamps frames with synchronized times
+     * 
+     * Timestamped frames are first handed to the clock synchronization,
+     * then all frames are stamped with the current estimate (if any).
+     * 
+     * @param frames Frames to stamp
+     * @param count Number of frames
+     */
+    void stamp_batch(Frame* frames, std::size_t count);
+
+    /**
+     * @brief Finds a statistic by name
+     *
+     * The statistics mutex MUST be held when calling this function.
+     *
+     * @param field Name of the value
+     * @return Statistic* Statistic, or nullptr if not kept
+     */
+    Statistic* find_statistic(const std::string& field);
+
     /**
      * @brief Callback for saving telemetry data
      *
      * This function is called by MAVSDK when new telemetry data is available.
-     * We will add the incoming data into a data strucure (TODO)
-     * that will contain incoming telemetry data.
+     * We simply hand the frame off to the worker thread,
+     * so this function never blocks on anything but a very short wake up.
+     * If the worker can't keep up, the frame is dropped and counted as an overrun.
      *
-     * @param data JSON Data to add to the collection
+     * @param link Link the frame arrived over
+     * @param frame Frame to add to the collection
      */
-    void telem_callback(const json& data, std::size_t index);
+    void telem_callback(Link* link, Frame frame);
+
+    /**
+     * @brief Processes a single frame
+     *
+     * Called by the worker thread for each frame.
+     * We finish any conversions left over from ingest, update the watchdog, apply the drop rate,
+     * and add the frame to the queue of its stream.
+     *
+     * @param frame Frame to process
+     */
+    void process_frame(Frame& frame);
+
+    /**
+     * @brief Processes a batch of frames
+     *
+     * Called by the worker thread with all frames it could grab at once.
+     * If enabled, we convert all positions in the batch into the local frame,
+     * and then process each frame in order.
+     *
+     * @param frames Frames to process
+     * @param count Number of frames
+     */
+    void process_batch(Frame* frames, std::size_t count);
+
+    /**
+     * @brief Main loop of the worker thread
+     *
+     * We configure the thread as requested,
+     * and then process frames until we are stopped and the handoff queues are empty.
+     * With several links, batches are a merge of the handoff queues:
+     * we always take the frame received first across all links,
+     * so the first copy of a sample we see is the freshest, even if one link has a backlog.
+     */
+    void worker_loop();
+
+    /**
+     * @brief Subscribes to a single telemetry stream
+     *
+     * We register the MAVSDK callback for the given stream,
+     * and save a function that will remove the subscription.
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to subscribe on
+     * @param index Index of the stream to subscribe to
+     */
+    void subscribe_stream(Link* link, std::size_t index);
+
+    /**
+     * @brief Subscribes to a single stream in passthrough mode
+     *
+     * We register callbacks for the MAVLink messages that make up the given stream,
+     * and decode them into frames directly.
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to subscribe on
+     * @param index Index of the stream to subscribe to
+     */
+    void subscribe_raw_stream(Link* link, std::size_t index);
+
+    /**
+     * @brief Requests a stream rate from the autopilot in passthrough mode
+     *
+     * We send MAV_CMD_SET_MESSAGE_INTERVAL for the messages that make up the stream.
+     * The command is queued without waiting for an acknowledgement.
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to send the command over
+     * @param index Index of the stream
+     * @param rate Rate to request in Hz
+     */
+    void request_raw_rate(Link* link, std::size_t index, double rate);
+
+    /**
+     * @brief Subscribes to all telemetry streams of a link
+     *
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to subscribe on
+     */
+    void subscribe_telemetry(Link* link);
+
+    /**
+     * @brief Removes all telemetry subscriptions of a link
+     *
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to unsubscribe from
+     */
+    void unsubscribe_telemetry(Link* link);
+
+    /**
+     * @brief Determines if any link is connected
+     *
+     * The state mutex MUST be held when calling this function.
+     *
+     * @return bool true if any link is connected, false if not
+     */
+    bool any_connected() const;
+
+    /**
+     * @brief Changes the connection state
+     *
+     * We update the state and wake up anyone waiting on it.
+     * The state mutex MUST be held when calling this function.
+     * The user callback is NOT called here, see notify_state().
+     *
+     * @param nstate New state to set
+     */
+    void set_state(ConnectionState nstate);
+
+    /**
+     * @brief Calls the user state callback
+     *
+     * The state mutex must NOT be held when calling this function,
+     * so the callback is free to call back into this class.
+     *
+     * @param nstate State to report
+     */
+    void notify_state(ConnectionState nstate);
+
+    /**
+     * @brief Callback for new systems
+     *
+     * Called by MAVSDK when systems are discovered on a link.
+     * If the link is not tracking a system yet,
+     * we select the first one with an autopilot and subscribe to its telemetry.
+     * We are Connected as soon as any link is.
+     *
+     * @param link Link the system was discovered on
+     */
+    void on_new_system(Link* link);
+
+    /**
+     * @brief Callback for connection changes
+     *
+     * Called by MAVSDK when the tracked system of a link is lost or reappears.
+     * Upon reappearance we resubscribe to all telemetry of the link.
+     * We are only Lost once all links are.
+     *
+     * @param link Link the change happened on
+     * @param connected true if the system is connected, false if not
+     */
+    void on_connection_change(Link* link, bool connected);
+
+    /**
+     * @brief Requests a stream rate from the autopilot
+     *
+     * We ask the autopilot to send the messages of the given stream
+     * at the given rate.
+     * This is done asynchronously, errors are only reported.
+     * The state mutex MUST be held when calling this function.
+     *
+     * @param link Link to send the request over
+     * @param index Index of the stream
+     * @param rate Rate to request in Hz
+     */
+    void request_rate(Link* link, std::size_t index, double rate);
+
+    /**
+     * @brief Resubscribes a single stream
+     *
+     * We remove the subscription of the stream on each connected link and add it again.
+     * If an expected rate is configured, we also request it again.
+     * Nothing is done if we are not connected.
+     *
+     * @param index Index of the stream
+     */
+    void resubscribe(std::size_t index);
+
+    /**
+     * @brief Main loop of the monitor thread
+     *
+     * We periodically check the health of each stream,
+     * report any changes and resubscribe stalled streams if configured to.
+     */
+    void monitor_loop();
 
 public:
 
-    DTStream() : config(this->component_type), mavsdk(config) {}
+    DTStream() : config(this->component_type) {}
 
-    DTStream(const std::string& str) : connection_url(str), config(this->component_type), mavsdk(config) {}
-    DTStream(std::string&& str) : connection_url(std::move(str)), config(this->component_type), mavsdk(config) {}
+    DTStream(const std::string& str) : connection_urls{str}, config(this->component_type) {}
+    DTStream(std::string&& str) : connection_urls{std::move(str)}, config(this->component_type) {}
 
     ~DTStream() { this->stop(); }
 
@@ -121,18 +628,429 @@ public:
     /**
      * @brief Sets the connection string
      * 
+     * This replaces all connection strings, so we only use a single link.
      * This string must be set BEFORE this class is started!
      * 
      * @param cstr New connection string to utilize
      */
-    void set_cstr(std::string cstr) { this->connection_url = std::move(cstr); }
+    void set_cstr(std::string cstr) { this->connection_urls.assign(1, std::move(cstr)); }
 
     /**
      * @brief Gets the connection string
      * 
+     * If several links are configured, this is the first one.
+     * 
      * @return const std::string& Connection string utilized
      */
-    const std::string& get_cstr() const { return this->connection_url; }
+    const std::string& get_cstr() const { return this->connection_urls.front(); }
+
+    /**
+     * @brief Adds a connection string
+     * 
+     * Each connection string becomes a separate link to the same autopilot,
+     * such as a telemetry radio alongside a LTE modem,
+     * or two UDP ports fed by a MAVLink router.
+     * Every sample is delivered once, using the copy that arrived first,
+     * and each link is measured (see get_link_stats()).
+     * We are Connected while any link is connected.
+     * 
+     * This must be called BEFORE this class is started!
+     * 
+     * @param cstr Connection string to add
+     * @return bool true if added, false if we already have MAX_LINKS links
+     */
+    bool add_cstr(std::string cstr);
+
+    /**
+     * @brief Gets all connection strings
+     * 
+     * @return const std::vector<std::string>& Connection strings, one per link
+     */
+    const std::vector<std::string>& get_cstrs() const { return this->connection_urls; }
+
+    /**
+     * @brief Gets the statistics of each link
+     * 
+     * Statistics are kept from the last start, and are still available after stopping.
+     * Latency is reported relative to the fastest link (lag_ns),
+     * along with the TIMESYNC round trip time of each link (rtt_ns).
+     * 
+     * @return std::vector<LinkStats> Statistics, one per link, empty if never started
+     */
+    std::vector<LinkStats> get_link_stats();
+
+    /**
+     * @brief Gets the link that currently delivers samples first
+     * 
+     * This is the connected link with the lowest lag behind the fastest copy.
+     * 
+     * @return int Index of the link, -1 if no link is connected
+     */
+    int get_fastest_link();
+
+    /**
+     * @brief Sets the time samples are remembered for duplicate suppression
+     * 
+     * This should be longer than the largest difference in latency between links,
+     * otherwise late copies are delivered again.
+     * This must be set BEFORE this class is started!
+     * 
+     * @param window Time to remember samples
+     */
+    void set_dedup_window(std::chrono::milliseconds window) { this->dedup_window = window; }
+
+    /**
+     * @brief Gets the time samples are remembered for duplicate suppression
+     * 
+     * @return std::chrono::milliseconds Time samples are remembered
+     */
+    std::chrono::milliseconds get_dedup_window() const { return this->dedup_window; }
+
+    /**
+     * @brief Sets the ingest mode
+     * 
+     * This must be set BEFORE this class is started!
+     * 
+     * @param mode New ingest mode to utilize
+     */
+    void set_ingest_mode(IngestMode mode) { this->ingest_mode = mode; }
+
+    /**
+     * @brief Gets the ingest mode
+     * 
+     * @return IngestMode Ingest mode utilized
+     */
+    IngestMode get_ingest_mode() const { return this->ingest_mode; }
+
+    /**
+     * @brief Gets the current connection state
+     *
+     * @return ConnectionState Current connection state
+     */
+    ConnectionState get_state() const { return this->state.load(); }
+
+    /**
+     * @brief Sets the connection state callback
+     *
+     * The given function is called each time the connection state changes.
+     * It is called from a MAVSDK background thread (or from the thread calling stop()),
+     * so it should return quickly!
+     * stop() waits for the MAVSDK threads, so the callback MUST NOT block on anything
+     * held by the thread calling stop() (such as the Python GIL).
+     *
+     * @param callback Function to call on state changes
+     */
+    void set_state_callback(std::function<void(ConnectionState)> callback);
+
+    /**
+     * @brief Gets the health of a stream
+     *
+     * @param index Index of the stream
+     * @return StreamHealth Current health of the stream
+     */
+    StreamHealth get_health(std::size_t index) const { return this->watchdog.get_health(index); }
+
+    /**
+     * @brief Gets the measured rate of a stream
+     *
+     * @param index Index of the stream
+     * @return double Measured rate in Hz
+     */
+    double get_rate(std::size_t index) const { return this->watchdog.get_rate(index); }
+
+    /**
+     * @brief Sets the expected rate of a stream
+     *
+     * The watchdog compares the measured rate against this value,
+     * and will consider the stream stalled if nothing arrives for a few periods.
+     * A rate of 0 means we only compare against the measured rate.
+     * 
+     * If auto resubscribe is enabled, this rate will be requested
+     * from the autopilot when the stream is resubscribed.
+     *
+     * @param index Index of the stream
+     * @param rate Expected rate in Hz
+     */
+    void set_expected_rate(std::size_t index, double rate) { this->watchdog.set_expected_rate(index, rate); }
+
+    /**
+     * @brief Gets the expected rate of a stream
+     *
+     * @param index Index of the stream
+     * @return double Expected rate in Hz, 0 if not configured
+     */
+    double get_expected_rate(std::size_t index) const { return this->watchdog.get_expected_rate(index); }
+
+    /**
+     * @brief Sets the stream health callback
+     *
+     * The given function is called with the stream index and new health
+     * each time the health of a stream changes.
+     * It is called from the monitor thread, so it should return quickly!
+     * stop() joins the monitor thread, so the callback MUST NOT block on anything
+     * held by the thread calling stop() (such as the Python GIL).
+     *
+     * @param callback Function to call on health changes
+     */
+    void set_health_callback(std::function<void(std::size_t, StreamHealth)> callback);
+
+    /**
+     * @brief Enables or disables automatic resubscription
+     *
+     * If enabled, stalled streams are resubscribed,
+     * and their expected rate is requested from the autopilot again.
+     * This is disabled by default.
+     *
+     * @param enabled true to enable, false to disable
+     */
+    void set_auto_resubscribe(bool enabled) { this->auto_resubscribe = enabled; }
+
+    /**
+     * @brief Determines if automatic resubscription is enabled
+     *
+     * @return bool true if enabled, false if not
+     */
+    bool get_auto_resubscribe() const { return this->auto_resubscribe.load(); }
+
+    /**
+     * @brief Enables the local frame
+     * 
+     * Once enabled, position frames will contain the coordinates of the drone
+     * in the given frame around the given origin, in addition to the usual values:
+     * 
+     * - ECEF - ecef_x_m, ecef_y_m, ecef_z_m
+     * - ENU - east_m, north_m, up_m
+     * - NED - north_m, east_m, down_m
+     * 
+     * Positions are converted using absolute_altitude_m,
+     * the altitude above mean sea level (AMSL) reported by the autopilot,
+     * so the altitude of the origin MUST also be AMSL (NOT relative to home).
+     * 
+     * We treat AMSL altitudes as heights above the WGS84 ellipsoid, as no geoid model is applied.
+     * In ENU and NED the geoid height is (almost) the same at the origin and the drone, so it cancels out.
+     * ECEF coordinates are offset along the vertical by the geoid height at the drone
+     * (up to about 100 meters, depending on location).
+     * This can be changed at any time.
+     * 
+     * @param lat_deg Latitude of the origin in degrees
+     * @param lon_deg Longitude of the origin in degrees
+     * @param alt_m Altitude of the origin in meters
+     * @param frame Frame to convert positions into
+     */
+    void set_local_frame(double lat_deg, double lon_deg, double alt_m, LocalFrame frame);
+
+    /**
+     * @brief Disables the local frame
+     */
+    void disable_local_frame();
+
+    /**
+     * @brief Determines if the local frame is enabled
+     * 
+     * @return bool true if enabled, false if not
+     */
+    bool local_frame_enabled();
+
+    /**
+     * @brief Sets the CPU the worker thread is pinned to
+     * 
+     * This must be set BEFORE this class is started!
+     * Only supported on Linux.
+     * 
+     * @param cpu Index of the CPU, -1 to not pin the thread
+     */
+    void set_worker_cpu(int cpu) { this->worker_cpu = cpu; }
+
+    /**
+     * @brief Gets the CPU the worker thread is pinned to
+     * 
+     * @return int Index of the CPU, -1 if not pinned
+     */
+    int get_worker_cpu() const { return this->worker_cpu; }
+
+    /**
+     * @brief Sets the real time priority of the worker thread
+     * 
+     * If greater than 0, the worker thread is scheduled with SCHED_FIFO at this priority.
+     * This usually requires elevated privileges (CAP_SYS_NICE).
+     * If we fail to set the priority, we report it and continue with normal scheduling.
+     * 
+     * This must be set BEFORE this class is started!
+     * Only supported on Linux.
+     * 
+     * @param priority SCHED_FIFO priority (1-99), 0 for normal scheduling
+     */
+    void set_worker_priority(int priority) { this->worker_priority = priority; }
+
+    /**
+     * @brief Gets the real time priority of the worker thread
+     * 
+     * @return int SCHED_FIFO priority, 0 for normal scheduling
+     */
+    int get_worker_priority() const { return this->worker_priority; }
+
+    /**
+     * @brief Gets the current estimate of the autopilot clock
+     * 
+     * This can be used to convert between autopilot and host times.
+     * Be sure to check if the estimate is valid before using it.
+     * 
+     * @return ClockEstimate Current estimate
+     */
+    ClockEstimate get_clock_estimate() const { return this->clock.get_estimate(); }
+
+    /**
+     * @brief Sets the time between TIMESYNC requests
+     * 
+     * Until we are synchronized, requests are sent more often.
+     * 
+     * @param interval Time between requests
+     */
+    void set_timesync_interval(std::chrono::milliseconds interval) { this->timesync_interval = interval; }
+
+    /**
+     * @brief Gets the time between TIMESYNC requests
+     * 
+     * @return std::chrono::milliseconds Time between requests
+     */
+    std::chrono::milliseconds get_timesync_interval() const { return this->timesync_interval; }
+
+    /**
+     * @brief Keeps sliding window statistics over a value
+     * 
+     * The worker thread updates the statistics as each frame is processed,
+     * so they are always up to date and never miss a sample
+     * (they are not affected by the drop rate).
+     * Updates are O(1) and never allocate.
+     * 
+     * The window holds the newest count samples,
+     * and if a time span is given, samples older than it are dropped as well.
+     * If statistics are already kept over this value, they are replaced.
+     * This can be called at any time.
+     * 
+     * @param field Name of the value, such as "airspeed_m_s"
+     * @param count Maximum number of samples in the window
+     * @param span Maximum age of samples in the window, zero for no limit
+     * @return bool true if added, false if no value has this name
+     */
+    bool add_statistic(const std::string& field, std::size_t count, std::chrono::milliseconds span = std::chrono::milliseconds(0));
+
+    /**
+     * @brief Stops keeping statistics over a value
+     * 
+     * @param field Name of the value
+     */
+    void remove_statistic(const std::string& field);
+
+    /**
+     * @brief Gets statistics over the whole window of a value
+     * 
+     * This is O(1).
+     * If no statistics are kept over this value, the summary is empty.
+     * 
+     * @param field Name of the value
+     * @return WindowSummary Statistics over the window
+     */
+    WindowSummary get_statistics(const std::string& field);
+
+    /**
+     * @brief Gets statistics over the newest samples of a value
+     * 
+     * This is O(count), as we walk the samples involved.
+     * 
+     * @param field Name of the value
+     * @param count Number of samples to include, at most the size of the window
+     * @return WindowSummary Statistics over the samples
+     */
+    WindowSummary get_statistics(const std::string& field, std::size_t count);
+
+    /**
+     * @brief Gets statistics over the samples of a value received in a recent span of time
+     * 
+     * The span is measured back from the newest sample,
+     * and is limited to the samples in the window.
+     * 
+     * @param field Name of the value
+     * @param span Time span to include
+     * @return WindowSummary Statistics over the samples
+     */
+    WindowSummary get_statistics(const std::string& field, std::chrono::milliseconds span);
+
+    /**
+     * @brief Keeps a history of recent frames of a stream
+     * 
+     * The newest frames of the stream are kept, up to the given number,
+     * so memory use is fixed (each frame is about 140 bytes).
+     * The history is filled by the worker thread before the drop rate is applied,
+     * and reading it never removes frames from the queues,
+     * so it can stay enabled at full rate alongside the live consumers.
+     * 
+     * Any frames already kept are discarded.
+     * This can be called at any time.
+     * 
+     * @param index Index of the stream
+     * @param capacity Number of frames to keep, zero to disable the history
+     * @return bool true if set, false if there is no such stream
+     */
+    bool set_history(std::size_t index, std::size_t capacity);
+
+    /**
+     * @brief Gets the number of frames kept in the history of a stream
+     * 
+     * @param index Index of the stream
+     * @return std::size_t Number of frames the history can hold, zero if disabled
+     */
+    std::size_t get_history(std::size_t index) const;
+
+    /**
+     * @brief Gets the frames of a stream received in a time range
+     * 
+     * Times are host steady clock nanoseconds, the same clock as recv_ns (see host_time_ns()),
+     * and the range is inclusive on both ends.
+     * The range is found with a binary search, so the cost only depends on the number of frames returned.
+     * Frames are appended to the given vector, oldest first.
+     * 
+     * @param index Index of the stream
+     * @param start_ns Start of the range
+     * @param stop_ns End of the range
+     * @param out Vector to append frames to
+     * @return std::size_t Number of frames found
+     */
+    std::size_t get_range(std::size_t index, int64_t start_ns, int64_t stop_ns, std::vector<Frame>& out) const;
+
+    /**
+     * @brief Gets the frames of a stream received in a time range
+     * 
+     * Same as above, but we return a new vector.
+     * 
+     * @param index Index of the stream
+     * @param start_ns Start of the range
+     * @param stop_ns End of the range
+     * @return std::vector<Frame> Frames found, oldest first
+     */
+    std::vector<Frame> get_range(std::size_t index, int64_t start_ns, int64_t stop_ns) const;
+
+    /**
+     * @brief Gets the frame of a stream that was current at a time
+     * 
+     * This is the newest frame received at or before the given time.
+     * 
+     * @param index Index of the stream
+     * @param time_ns Time to look up, host steady clock nanoseconds
+     * @param out Frame to fill in
+     * @return bool true if found, false if the history holds nothing that old
+     */
+    bool get_at(std::size_t index, int64_t time_ns, Frame& out) const;
+
+    /**
+     * @brief Gets the number of overruns
+     * 
+     * An overrun occurs when the worker thread can't keep up
+     * and an incoming frame has to be dropped.
+     * 
+     * @return uint64_t Number of frames dropped due to overruns
+     */
+    uint64_t get_overruns() const { return this->overruns.load(); }
 
     /**
      * @brief Gets the latest telemetry packet
@@ -146,33 +1064,150 @@ public:
     std::string get_data();
 
     /**
-     * @brief Preforms all required start operations
+     * @brief Gets the latest values of the selected fields
+     * 
+     * Same as get_data(), but we only wait on the streams that contain a selected value,
+     * and only serialize the selected values.
+     * The cost is proportional to what is selected,
+     * and a stream that never arrives (say, fixedwing metrics on a multirotor)
+     * does not block consumers that don't need it.
+     * Streams that are not selected are left untouched in their queues.
+     * 
+     * @param fields Values to retrieve, see compile_fields()
+     * @return std::string String JSON data holding the selected values
+     */
+    std::string get_data(const FieldMask& fields);
+
+    /**
+     * @brief Gets the latest values of the named fields
+     * 
+     * Same as above, but the names are compiled on each call.
+     * Consumers that call this often should compile the names once instead.
+     * Unknown names are reported and skipped.
+     * 
+     * @param fields Names of the values to retrieve, such as "latitude_deg" or "yaw_deg"
+     * @return std::string String JSON data holding the selected values
+     */
+    std::string get_data(const std::vector<std::string>& fields);
+
+    /**
+     * @brief Gets the latest values of the selected fields without JSON
+     * 
+     * Like get_data(), we wait on the streams that contain a selected value,
+     * but the values are copied into the given vector in the order they were named.
+     * Timestamps are converted to double,
+     * and values missing from their frame are NaN.
+     * 
+     * @param fields Values to retrieve, see compile_fields()
+     * @param out Vector to fill, resized to the number of selected values
+     */
+    void get_values(const FieldMask& fields, std::vector<double>& out);
+
+    /**
+     * @brief Gets many frames at once
+     * 
+     * We remove all available frames from each stream (up to max_frames in total),
+     * taking each stream's lock only once, and append them to the given vector
+     * in the order they were received.
+     * If nothing is available, we wait until the worker queues more frames,
+     * or until the timeout is reached.
+     * 
+     * This is much cheaper than calling get_data() in a loop,
+     * and does not lose any frames, so it is ideal for recorders.
+     * Note that get_data() and this function consume from the same queues.
+     * 
+     * @param out Vector to append frames to
+     * @param max_frames Maximum number of frames to retrieve
+     * @param timeout Time to wait if no frames are available
+     * @return std::size_t Number of frames retrieved
+     */
+    std::size_t get_batch(std::vector<Frame>& out, std::size_t max_frames, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Gets many frames at once
+     * 
+     * Same as above, but we return a new vector.
+     * 
+     * @param max_frames Maximum number of frames to retrieve
+     * @param timeout Time to wait if no frames are available
+     * @return std::vector<Frame> Frames retrieved
+     */
+    std::vector<Frame> get_batch(std::size_t max_frames, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Gets many frames at once as JSON
+     * 
+     * Same as get_batch(), but we return a JSON array of frames as a string.
+     * Each frame is a JSON object that contains its values,
+     * along with the name of its stream ("stream") and the time it was received ("recv_ns").
+     * 
+     * @param max_frames Maximum number of frames to retrieve
+     * @param timeout Time to wait if no frames are available
+     * @return std::string String JSON array of frames
+     */
+    std::string get_batch_json(std::size_t max_frames, std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Starts this stream without waiting for a system
      * 
      * This function prepares this instance for communicating
      * with a system via MAVLINK.
      * We preform the following:
      * 
      * - Create required components and structures
-     * - Connect to any added systems and determine if they are eligible
-     * - Add callback functions to react to incoming telemetry data
+     * - Add the connection and start listening for systems
      * 
-     * All these steps are REQUIRED for proper functionality,
-     * and this function MUST be called before any operations are preformed. 
+     * Once a system with an autopilot is discovered,
+     * we will add callback functions to react to incoming telemetry data
+     * and the state will change to Connected.
+     * This happens in the background, so this function returns right away.
+     * 
+     * Calling this function on a started stream does nothing.
+     * 
+     * @return bool true if successful, false if the connection could not be added
+     */
+    bool start_async();
+
+    /**
+     * @brief Starts this stream and waits for a system
+     * 
+     * Same as start_async(), but we block until a system is connected.
+     * This function, or start_async(), MUST be called before any operations are preformed.
      * 
      * @return bool true if successful, false if not
      */
     bool start();
 
+    /**
+     * @brief Starts this stream and waits for a system with timeout
+     * 
+     * Same as start(), but we only wait until the timeout is reached.
+     * If we time out, discovery will continue in the background,
+     * so the stream may still become connected later.
+     * 
+     * @param timeout Time to wait for a system
+     * @return bool true if connected, false if not
+     */
+    bool start(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Waits until this stream is connected
+     * 
+     * @param timeout Time to wait for a connection
+     * @return bool true if connected, false if we timed out or were stopped
+     */
+    bool wait_connected(std::chrono::milliseconds timeout);
+
     /**
      * @brief Preforms all required stop operations
      * 
      * This function destroys the MAVSDK object.
      * This will ensure all resources are freed and all background threads are killed.
      * This function will be called automatically when this object is destroyed,
-     * but it can be called automatically if necessary.
+     * but it can be called manually if necessary.
      * 
-     * Once a telemetry object is stopped,
-     * then it CAN'T be restarted or used again!
+     * Any queued telemetry data is kept,
+     * and the stream can be started again later.
      */
     void stop();
 };
@@ -0,0 +1,336 @@
+/**
+ * @file frame.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Typed telemetry frames
+ * @version 0.1
+ * @date 2024-11-10
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes the frames that carry telemetry data through DTS.
+ * A frame is a small, fixed size structure that holds the values of one sample
+ * of one stream, along with some timing information.
+ * Frames never allocate, so they can be cheaply copied between threads.
+ * The names of each value are defined in tables below,
+ * which are also used when converting frames into JSON.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+/// Number of streams this component is tracking
+const unsigned int STREAMS = 6;
+
+/// Maximum number of values a frame can hold
+const unsigned int FRAME_FIELDS = 12;
+
+/// Indices of each stream we track
+enum StreamIndex : std::size_t {
+    STREAM_POSITION = 0,
+    STREAM_ANGULAR_VELOCITY = 1,
+    STREAM_VELOCITY_NED = 2,
+    STREAM_FIXEDWING_METRICS = 3,
+    STREAM_IMU = 4,
+    STREAM_ATTITUDE = 5
+};
+
+/// Names of each stream
+constexpr std::array<const char*, STREAMS> STREAM_NAMES = {
+    "position",
+    "angular_velocity",
+    "velocity_ned",
+    "fixedwing_metrics",
+    "imu",
+    "attitude"
+};
+
+/// Names of the values in each stream, unused slots are nullptr
+constexpr std::array<std::array<const char*, FRAME_FIELDS>, STREAMS> FIELD_NAMES = {{
+    {"latitude_deg", "longitude_deg", "relative_altitude_m",
+     "ecef_x_m", "ecef_y_m", "ecef_z_m", "east_m", "north_m", "up_m", "down_m", "absolute_altitude_m"},
+    {"roll_rad_s", "pitch_rad_s", "yaw_rad_s"},
+    {"north_m_s", "east_m_s", "down_m_s"},
+    {"airspeed_m_s", "throttle_percentage", "climb_rate_m_s"},
+    {"acceleration_forward_m_s2", "acceleration_right_m_s2", "acceleration_down_m_s2",
+     "angular_velocity_forward_rad_s", "angular_velocity_right_rad_s", "angular_velocity_down_rad_s",
+     "magnetic_field_forward_gauss", "magnetic_field_right_gauss", "magnetic_field_down_gauss",
+     "temperature_degc", "fields_updated"},
+    {"roll_deg", "pitch_deg", "yaw_deg", "q_w", "q_x", "q_y", "q_z"}
+}};
+
+/// Bitmask of the values in each stream that are integers
+constexpr std::array<uint16_t, STREAMS> INTEGER_FIELDS = {
+    0,
+    0,
+    0,
+    0,
+    1U << 10,
+    0
+};
+
+/// Names of the autopilot timestamp of each stream
+constexpr std::array<const char*, STREAMS> TIMESTAMP_NAMES = {
+    "position_timestamp_us",
+    "angular_velocity_timestamp_us",
+    "velocity_ned_timestamp_us",
+    "fixedwing_metrics_timestamp_us",
+    "timestamp_us",
+    "timestamp"
+};
+
+/// Bit of the frame mask that determines if the autopilot timestamp is valid
+const uint16_t TIMESTAMP_BIT = 1U << 15;
+
+/// Bit of the frame mask that determines if the synchronized times (vehicle_ns, sample_ns) are valid
+const uint16_t CLOCK_BIT = 1U << 14;
+
+/// Slot used to refer to the autopilot timestamp in a FieldMask, matching TIMESTAMP_BIT
+const uint16_t TIMESTAMP_SLOT = 15;
+
+/**
+ * @brief A single sample of a stream
+ *
+ * Frames hold the values of a sample in a fixed array,
+ * where the meaning of each slot is defined by FIELD_NAMES.
+ * The mask determines which slots actually contain a value.
+ */
+struct Frame {
+
+    /// Time the host received this frame, steady clock nanoseconds
+    int64_t recv_ns = 0;
+
+    /// Timestamp reported by the autopilot in microseconds, only valid if TIMESTAMP_BIT is set
+    uint64_t timestamp_us = 0;
+
+    /// Autopilot time of this frame in nanoseconds, only valid if CLOCK_BIT is set
+    /// (The autopilot timestamp if present, otherwise the receive time converted to autopilot time)
+    int64_t vehicle_ns = 0;
+
+    /// Time the autopilot sampled this frame, steady clock nanoseconds, only valid if CLOCK_BIT is set
+    /// (Frames without an autopilot timestamp use the receive time)
+    int64_t sample_ns = 0;
+
+    /// Index of the stream this frame belongs to
+    uint16_t stream = 0;
+
+    /// Bitmask of the slots that contain a value, along with TIMESTAMP_BIT and CLOCK_BIT
+    uint16_t mask = 0;
+
+    /// Index of the link this frame arrived over
+    uint16_t link = 0;
+
+    /// Values of this frame
+    std::array<double, FRAME_FIELDS> values{};
+};
+
+/**
+ * @brief Gets the current time of the host
+ *
+ * This is the clock used for all host side timestamps in frames.
+ *
+ * @return int64_t Steady clock time in nanoseconds
+ */
+inline int64_t host_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Creates a frame for a stream
+ *
+ * We stamp the frame with the current host time.
+ *
+ * @param stream Index of the stream
+ * @return Frame New frame
+ */
+inline Frame make_frame(std::size_t stream) {
+
+    Frame frame;
+
+    frame.recv_ns = host_time_ns();
+    frame.stream = static_cast<uint16_t>(stream);
+
+    return frame;
+}
+
+/**
+ * @brief Finds the stream and slot of a value by name
+ *
+ * @param name Name of the value, as in FIELD_NAMES
+ * @param stream Set to the index of the stream containing the value
+ * @param slot Set to the slot of the value in the frame
+ * @return bool true if found, false if no value has this name
+ */
+inline bool find_field(const std::string& name, std::size_t& stream, std::size_t& slot) {
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        for (std::size_t j = 0; j < FRAME_FIELDS; ++j) {
+
+            if (FIELD_NAMES[i][j] != nullptr && std::strcmp(FIELD_NAMES[i][j], name.c_str()) == 0) {
+                stream = i;
+                slot = j;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Selection of values to retrieve
+ *
+ * Consumers that only need a few values can compile their names into a mask once
+ * (see compile_fields()), and hand it to DTStream::get_data() on each call.
+ * Only the streams that contain a selected value are waited on,
+ * and only the selected values are serialized or copied.
+ */
+struct FieldMask {
+
+    /// Bitmask of the selected values of each stream, using the bits of the frame mask
+    /// (TIMESTAMP_BIT selects the autopilot timestamp)
+    std::array<uint16_t, STREAMS> masks{};
+
+    /// Stream and slot of each selected value, in the order they were named
+    /// (The autopilot timestamp uses TIMESTAMP_SLOT)
+    std::vector<std::pair<uint16_t, uint16_t>> order;
+};
+
+/**
+ * @brief Compiles value names into a field mask
+ *
+ * Names are the names of values (FIELD_NAMES) or autopilot timestamps (TIMESTAMP_NAMES),
+ * exactly as they appear in JSON output.
+ * Unknown names are reported and skipped.
+ *
+ * @param names Names of the values to select
+ * @param fields Field mask to fill
+ * @return bool true if all names are known, false if not
+ */
+inline bool compile_fields(const std::vector<std::string>& names, FieldMask& fields) {
+
+    fields = FieldMask();
+
+    bool known = true;
+
+    for (const std::string& name : names) {
+
+        std::size_t stream = 0;
+        std::size_t slot = 0;
+
+        if (!find_field(name, stream, slot)) {
+
+            // Maybe this is a timestamp:
+
+            stream = STREAMS;
+
+            for (std::size_t i = 0; i < STREAMS; ++i) {
+                if (name == TIMESTAMP_NAMES[i]) {
+                    stream = i;
+                    slot = TIMESTAMP_SLOT;
+                    break;
+                }
+            }
+
+            if (stream == STREAMS) {
+                std::cerr << "Unknown field: " << name << '\n';
+                known = false;
+                continue;
+            }
+        }
+
+        fields.masks[stream] |= static_cast<uint16_t>(1U << slot);
+        fields.order.emplace_back(static_cast<uint16_t>(stream), static_cast<uint16_t>(slot));
+    }
+
+    return known;
+}
+
+/**
+ * @brief Adds the selected values of a frame to a JSON object
+ *
+ * Each selected value present in the frame is added under its name,
+ * along with the autopilot timestamp if it is selected and valid.
+ * Existing members of the object are left alone,
+ * so values from several frames can be added to the same object.
+ *
+ * @param data JSON object to add to
+ * @param frame Frame to convert
+ * @param fields Bitmask of the values to add, using the bits of the frame mask
+ */
+inline void add_json(nlohmann::json& data, const Frame& frame, uint16_t fields) {
+
+    const auto& names = FIELD_NAMES[frame.stream];
+    const uint16_t mask = frame.mask & fields;
+
+    for (std::size_t i = 0; i < FRAME_FIELDS; ++i) {
+
+        if ((mask & (1U << i)) == 0) {
+            continue;
+        }
+
+        if ((INTEGER_FIELDS[frame.stream] & (1U << i)) != 0) {
+            data[names[i]] = static_cast<int64_t>(frame.values[i]);
+        } else {
+            data[names[i]] = frame.values[i];
+        }
+    }
+
+    if ((mask & TIMESTAMP_BIT) != 0) {
+        data[TIMESTAMP_NAMES[frame.stream]] = frame.timestamp_us;
+    }
+}
+
+/**
+ * @brief Converts a frame into JSON
+ *
+ * Each value present in the frame is added under its name,
+ * along with the autopilot timestamp if it is valid.
+ * This allows frames to be assigned to JSON objects directly.
+ *
+ * @param data JSON object to fill
+ * @param frame Frame to convert
+ */
+inline void to_json(nlohmann::json& data, const Frame& frame) {
+
+    data = nlohmann::json::object();
+
+    add_json(data, frame, UINT16_MAX);
+}
+
+/**
+ * @brief Converts a frame into a self describing JSON object
+ *
+ * Unlike to_json(), we also add the name of the stream ("stream")
+ * and the host receive time ("recv_ns"),
+ * so frames from different streams can be stored side by side.
+ * If the clocks are synchronized, we also add the autopilot time ("vehicle_ns")
+ * and the time the frame was sampled ("sample_ns").
+ *
+ * @param frame Frame to convert
+ * @return nlohmann::json JSON object describing the frame
+ */
+inline nlohmann::json describe_frame(const Frame& frame) {
+
+    nlohmann::json data = frame;
+
+    data["stream"] = STREAM_NAMES[frame.stream];
+    data["recv_ns"] = frame.recv_ns;
+
+    if ((frame.mask & CLOCK_BIT) != 0) {
+        data["vehicle_ns"] = frame.vehicle_ns;
+        data["sample_ns"] = frame.sample_ns;
+    }
+
+    return data;
+}
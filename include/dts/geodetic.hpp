@@ -0,0 +1,153 @@
+/**
+ * @file geodetic.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Batch geodetic coordinate transforms
+ * @version 0.1
+ * @date 2024-11-23
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes components for converting geodetic positions
+ * (latitude, longitude, altitude) into Cartesian frames.
+ * We support Earth-Centered Earth-Fixed (ECEF) coordinates,
+ * as well as the local tangent frames East-North-Up (ENU) and North-East-Down (NED)
+ * around a configurable origin, such as the ground station.
+ *
+ * All conversions work on batches of positions stored as separate arrays,
+ * which allows us to use SIMD kernels (AVX2) when the CPU supports them.
+ * If not, we fall back to plain scalar code.
+ * All computations use the WGS84 ellipsoid.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Frames positions can be converted into
+ *
+ * - ECEF - Earth-Centered Earth-Fixed
+ * - ENU - East-North-Up, relative to an origin
+ * - NED - North-East-Down, relative to an origin
+ */
+enum class LocalFrame : uint8_t {
+    ECEF,
+    ENU,
+    NED
+};
+
+/**
+ * @brief Converts a batch of geodetic positions into ECEF coordinates
+ *
+ * @param lat_deg Latitudes in degrees
+ * @param lon_deg Longitudes in degrees
+ * @param alt_m Heights above the ellipsoid in meters
+ * @param count Number of positions
+ * @param x Output ECEF X coordinates in meters
+ * @param y Output ECEF Y coordinates in meters
+ * @param z Output ECEF Z coordinates in meters
+ */
+void lla_to_ecef(const double* lat_deg, const double* lon_deg, const double* alt_m, std::size_t count, double* x, double* y, double* z);
+
+/**
+ * @brief Determines if the SIMD kernels are in use
+ *
+ * @return bool true if the AVX2 kernels are used, false if we use the scalar fallback
+ */
+bool geodetic_simd();
+
+/**
+ * @brief Converts geodetic positions into a frame around an origin
+ *
+ * This class holds an origin and an output frame,
+ * and converts batches of positions into that frame.
+ * Everything that only depends on the origin is computed once,
+ * when the origin is set.
+ *
+ * The altitude of the origin and the positions must use the same reference.
+ * For example, if the positions use the altitude above mean sea level,
+ * the origin should also use an altitude above mean sea level.
+ * Altitudes are treated as heights above the ellipsoid,
+ * so any other reference shifts both ends by (almost) the same amount, which cancels out in ENU and NED.
+ * The error this introduces is negligible over the ranges we care about.
+ * ECEF coordinates do not cancel this way, see DTStream::set_local_frame().
+ */
+class GeodeticTransform {
+private:
+
+    /// Frame positions are converted into
+    LocalFrame frame = LocalFrame::ENU;
+
+    /// Latitude of the origin in degrees
+    double origin_lat = 0;
+
+    /// Longitude of the origin in degrees
+    double origin_lon = 0;
+
+    /// Altitude of the origin in meters
+    double origin_alt = 0;
+
+    /// ECEF coordinates of the origin
+    double ox = 0, oy = 0, oz = 0;
+
+    /// Sine and cosine of the origin latitude and longitude
+    double slat = 0, clat = 1, slon = 0, clon = 1;
+
+public:
+
+    GeodeticTransform() { this->set_origin(0, 0, 0); }
+
+    GeodeticTransform(double lat_deg, double lon_deg, double alt_m, LocalFrame nframe = LocalFrame::ENU) : frame(nframe) { this->set_origin(lat_deg, lon_deg, alt_m); }
+
+    /**
+     * @brief Sets the origin of the local frame
+     *
+     * @param lat_deg Latitude of the origin in degrees
+     * @param lon_deg Longitude of the origin in degrees
+     * @param alt_m Altitude of the origin in meters
+     */
+    void set_origin(double lat_deg, double lon_deg, double alt_m);
+
+    /**
+     * @brief Sets the frame positions are converted into
+     *
+     * @param nframe New frame to utilize
+     */
+    void set_frame(LocalFrame nframe) { this->frame = nframe; }
+
+    /**
+     * @brief Gets the frame positions are converted into
+     *
+     * @return LocalFrame Frame utilized
+     */
+    LocalFrame get_frame() const { return this->frame; }
+
+    /// Gets the latitude of the origin in degrees
+    double get_origin_lat() const { return this->origin_lat; }
+
+    /// Gets the longitude of the origin in degrees
+    double get_origin_lon() const { return this->origin_lon; }
+
+    /// Gets the altitude of the origin in meters
+    double get_origin_alt() const { return this->origin_alt; }
+
+    /**
+     * @brief Converts a batch of positions
+     *
+     * The outputs depend on the frame:
+     *
+     * - ECEF - (x, y, z)
+     * - ENU - (east, north, up)
+     * - NED - (north, east, down)
+     *
+     * @param lat_deg Latitudes in degrees
+     * @param lon_deg Longitudes in degrees
+     * @param alt_m Altitudes in meters
+     * @param count Number of positions
+     * @param a First output coordinate in meters
+     * @param b Second output coordinate in meters
+     * @param c Third output coordinate in meters
+     */
+    void transform(const double* lat_deg, const double* lon_deg, const double* alt_m, std::size_t count, double* a, double* b, double* c) const;
+};
@@ -0,0 +1,277 @@
+/**
+ * @file history.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Time indexed history of frames
+ * @version 0.1
+ * @date 2024-12-28
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes a fixed size history of recent frames,
+ * which can be queried by time without removing anything.
+ * This allows diagnostic consumers to look back at recent data
+ * (say, the attitude during the last two seconds before a tracking loss)
+ * without disturbing the consumers of the live queues, and without a full recorder.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "frame.hpp"
+
+/**
+ * @brief Fixed size history of frames, indexed by receive time
+ *
+ * Frames are kept in a ring, and the oldest frame is overwritten once the ring is full,
+ * so memory use is fixed no matter how long we run.
+ * The receive times are kept in a separate ring,
+ * so lookups are a binary search over plain integers.
+ *
+ * Frames are indexed by their host receive time (steady clock nanoseconds, see host_time_ns()),
+ * which is always available, unlike the synchronized sample time.
+ * The index must never decrease, so a frame received "earlier" than the one before it
+ * (which can happen when merging several links) is indexed at the time of the previous frame.
+ *
+ * All functions are thread safe.
+ */
+class History {
+private:
+
+    /// Frames, used as a ring
+    std::vector<Frame> frames;
+
+    /// Index time of each frame
+    std::vector<int64_t> times;
+
+    /// Number of frames the ring can hold, zero if disabled
+    std::atomic<std::size_t> capacity{0};
+
+    /// Position of the oldest frame
+    std::size_t start = 0;
+
+    /// Number of frames in the ring
+    std::size_t count = 0;
+
+    /// Mutex protecting everything above
+    mutable std::mutex mutex;
+
+    /**
+     * @brief Converts a position relative to the oldest frame into a position in the ring
+     *
+     * The mutex MUST be held when calling this function.
+     *
+     * @param pos Position relative to the oldest frame, less than the capacity
+     * @return std::size_t Position in the ring
+     */
+    std::size_t wrap(std::size_t pos) const {
+
+        // Cheaper than a modulo, as start + pos is always less than twice the capacity:
+
+        pos += this->start;
+
+        return pos >= this->frames.size() ? pos - this->frames.size() : pos;
+    }
+
+    /**
+     * @brief Finds the first frame indexed after a time
+     *
+     * The mutex MUST be held when calling this function.
+     *
+     * @param time_ns Time to search for
+     * @return std::size_t Position of the frame relative to the oldest, count if none
+     */
+    std::size_t upper_bound(int64_t time_ns) const {
+
+        std::size_t low = 0;
+        std::size_t high = this->count;
+
+        while (low < high) {
+
+            const std::size_t mid = low + (high - low) / 2;
+
+            if (this->times[this->wrap(mid)] <= time_ns) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        return low;
+    }
+
+public:
+
+    /**
+     * @brief Changes the number of frames kept
+     *
+     * The history is cleared.
+     * A size of zero disables the history and frees its memory.
+     *
+     * @param size Number of frames to keep
+     */
+    void resize(std::size_t size) {
+
+        // Allocate outside of the lock:
+
+        std::vector<Frame> nframes(size);
+        std::vector<int64_t> ntimes(size);
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        this->frames.swap(nframes);
+        this->times.swap(ntimes);
+        this->start = 0;
+        this->count = 0;
+        this->capacity = size;
+    }
+
+    /**
+     * @brief Adds the frames of a stream
+     *
+     * Frames of other streams are ignored,
+     * so a whole batch can be handed over while taking the lock only once.
+     *
+     * @param batch Frames to add
+     * @param num Number of frames
+     * @param stream Index of the stream to keep
+     */
+    void add(const Frame* batch, std::size_t num, std::size_t stream) {
+
+        if (this->capacity.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        const std::size_t cap = this->frames.size();
+
+        if (cap == 0) {
+            return;
+        }
+
+        for (std::size_t i = 0; i < num; ++i) {
+
+            const Frame& frame = batch[i];
+
+            if (frame.stream != stream) {
+                continue;
+            }
+
+            int64_t time = frame.recv_ns;
+
+            // Keep the index sorted:
+
+            if (this->count > 0) {
+                time = std::max(time, this->times[this->wrap(this->count - 1)]);
+            }
+
+            // Overwrite the oldest frame if we are full:
+
+            std::size_t pos = 0;
+
+            if (this->count == cap) {
+                pos = this->start;
+                this->start = this->wrap(1);
+            } else {
+                pos = this->wrap(this->count);
+                ++this->count;
+            }
+
+            this->frames[pos] = frame;
+            this->times[pos] = time;
+        }
+    }
+
+    /**
+     * @brief Gets all frames received in a time range
+     *
+     * Frames are appended to the given vector, oldest first.
+     * The range is inclusive on both ends.
+     *
+     * @param start_ns Start of the range, steady clock nanoseconds
+     * @param stop_ns End of the range, steady clock nanoseconds
+     * @param out Vector to append frames to
+     * @return std::size_t Number of frames found
+     */
+    std::size_t get_range(int64_t start_ns, int64_t stop_ns, std::vector<Frame>& out) const {
+
+        if (stop_ns < start_ns) {
+            return 0;
+        }
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        // Find the frames around the range, everything in between is inside it:
+
+        const std::size_t first = start_ns == INT64_MIN ? 0 : this->upper_bound(start_ns - 1);
+        const std::size_t last = this->upper_bound(stop_ns);
+
+        out.reserve(out.size() + (last - first));
+
+        for (std::size_t i = first; i < last; ++i) {
+            out.push_back(this->frames[this->wrap(i)]);
+        }
+
+        return last - first;
+    }
+
+    /**
+     * @brief Gets the frame that was current at a time
+     *
+     * This is the newest frame received at or before the given time.
+     *
+     * @param time_ns Time to look up, steady clock nanoseconds
+     * @param out Frame to fill in
+     * @return bool true if found, false if we have no frame that old
+     */
+    bool get_at(int64_t time_ns, Frame& out) const {
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        const std::size_t pos = this->upper_bound(time_ns);
+
+        if (pos == 0) {
+            return false;
+        }
+
+        out = this->frames[this->wrap(pos - 1)];
+
+        return true;
+    }
+
+    /**
+     * @brief Removes all frames
+     */
+    void clear() {
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        this->start = 0;
+        this->count = 0;
+    }
+
+    /**
+     * @brief Gets the number of frames kept
+     *
+     * @return std::size_t Number of frames in the history
+     */
+    std::size_t size() const {
+
+        const std::lock_guard<std::mutex> lock(this->mutex);
+
+        return this->count;
+    }
+
+    /**
+     * @brief Gets the number of frames the history can hold
+     *
+     * @return std::size_t Capacity, zero if disabled
+     */
+    std::size_t get_capacity() const { return this->capacity.load(); }
+};
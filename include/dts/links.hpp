@@ -0,0 +1,360 @@
+/**
+ * @file links.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Duplicate suppression across redundant links
+ * @version 0.1
+ * @date 2024-12-21
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes components for receiving telemetry from the same autopilot
+ * over several links at once (say, a telemetry radio and a LTE modem).
+ * Each sample usually arrives once per link, so we keep track of the samples seen recently,
+ * only let the first (freshest) copy through, and measure how each link is doing along the way.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "frame.hpp"
+
+/// Maximum number of links a stream can receive telemetry from
+const unsigned int MAX_LINKS = 8;
+
+/**
+ * @brief Statistics of a single link
+ *
+ * Loss is measured against all samples seen on any link,
+ * so a link configured with lower rates than the others will report some loss.
+ */
+struct LinkStats {
+
+    /// Connection URL of the link
+    std::string url;
+
+    /// Determines if the autopilot is currently connected over this link
+    bool connected = false;
+
+    /// Number of samples received over this link
+    uint64_t received = 0;
+
+    /// Number of samples that arrived over this link first, and were delivered
+    uint64_t delivered = 0;
+
+    /// Number of samples that arrived over this link after another link
+    uint64_t duplicates = 0;
+
+    /// Number of samples seen on other links that never arrived over this link
+    uint64_t missed = 0;
+
+    /// Recent fraction of samples missed by this link
+    double loss = 0;
+
+    /// Recent average time samples arrive after the fastest copy
+    int64_t lag_ns = 0;
+
+    /// Recent average TIMESYNC round trip time over this link, -1 if unknown
+    int64_t rtt_ns = -1;
+};
+
+/**
+ * @brief Suppresses duplicate samples arriving over several links
+ *
+ * Samples are identified by their stream and autopilot timestamp.
+ * Samples without a timestamp are identified by their values instead.
+ * We don't use the MAVLink sequence number, as each link (autopilot port) counts its own.
+ *
+ * For each stream, we keep the samples that arrived within the window in a ring.
+ * A sample matches an entry if it has the same identity,
+ * and has not arrived over the same link before.
+ * This way, a value that legitimately repeats on a single link (an idle airspeed of zero)
+ * is never mistaken for a duplicate.
+ *
+ * Once an entry leaves the window (or is pushed out of the ring), we know which links
+ * never delivered it, and count it as missed for each of them that was connected.
+ * Entries are only retired when their stream is active, so loss of quiet streams is reported late.
+ *
+ * Lag is only measured from samples with a timestamp,
+ * as copies of a value that repeats can't be paired up reliably.
+ *
+ * Frames should be handed over in the order they were received,
+ * so the first copy we see is the freshest one.
+ *
+ * This class is NOT thread safe.
+ */
+class Deduplicator {
+private:
+
+    /// A sample seen recently
+    struct Entry {
+
+        /// Receive time of the first copy
+        int64_t first_ns = 0;
+
+        /// Autopilot timestamp, or hash of the values
+        uint64_t key = 0;
+
+        /// Mask of the sample
+        uint16_t mask = 0;
+
+        /// Bitmask of the links that delivered a copy
+        uint32_t seen = 0;
+    };
+
+    /// Counters kept for each link
+    struct Counters {
+
+        /// Number of samples received
+        uint64_t received = 0;
+
+        /// Number of samples delivered first
+        uint64_t delivered = 0;
+
+        /// Number of late copies
+        uint64_t duplicates = 0;
+
+        /// Number of samples missed
+        uint64_t missed = 0;
+
+        /// Recent fraction of samples missed
+        double loss = 0;
+
+        /// Recent average delay behind the fastest copy
+        double lag_ns = 0;
+    };
+
+    /// Number of entries kept for each stream, MUST be a power of two
+    static constexpr std::size_t HISTORY = 256;
+
+    /// Weight of new samples in the loss average
+    static constexpr double LOSS_WEIGHT = 1.0 / 128;
+
+    /// Weight of new samples in the lag average
+    static constexpr double LAG_WEIGHT = 1.0 / 64;
+
+    /// Ring of entries for each stream
+    std::vector<Entry> entries;
+
+    /// Position of the next entry of each stream
+    std::array<std::size_t, STREAMS> heads{};
+
+    /// Number of entries of each stream
+    std::array<std::size_t, STREAMS> counts{};
+
+    /// Counters of each link
+    std::array<Counters, MAX_LINKS> counters{};
+
+    /// Number of links
+    std::size_t links = 1;
+
+    /// Time a sample is remembered after its first copy arrives
+    int64_t window_ns = 500000000;
+
+    /**
+     * @brief Identifies a sample
+     *
+     * @param frame Frame to identify
+     * @return uint64_t Autopilot timestamp, or FNV-1a hash of the values
+     */
+    static uint64_t identify(const Frame& frame) {
+
+        if ((frame.mask & TIMESTAMP_BIT) != 0) {
+            return frame.timestamp_us;
+        }
+
+        uint64_t hash = 14695981039346656037ULL;
+
+        for (std::size_t i = 0; i < FRAME_FIELDS; ++i) {
+
+            if ((frame.mask & (1U << i)) == 0) {
+                continue;
+            }
+
+            uint64_t bits = 0;
+            std::memcpy(&bits, &frame.values[i], sizeof(bits));
+
+            hash = (hash ^ bits) * 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    /**
+     * @brief Retires an entry, counting it as missed on each active link that never saw it
+     *
+     * @param entry Entry to retire
+     * @param active Bitmask of the links that are connected
+     */
+    void retire(const Entry& entry, uint32_t active) {
+
+        for (std::size_t i = 0; i < this->links; ++i) {
+
+            const uint32_t bit = 1U << i;
+
+            if ((active & bit) == 0) {
+                continue;
+            }
+
+            Counters& counter = this->counters[i];
+            const double missed = (entry.seen & bit) != 0 ? 0.0 : 1.0;
+
+            counter.missed += static_cast<uint64_t>(missed);
+            counter.loss += (missed - counter.loss) * LOSS_WEIGHT;
+        }
+    }
+
+    /**
+     * @brief Updates the lag average of a link
+     *
+     * @param link Index of the link
+     * @param lag_ns Delay behind the fastest copy
+     */
+    void add_lag(std::size_t link, int64_t lag_ns) {
+
+        Counters& counter = this->counters[link];
+
+        counter.lag_ns += (static_cast<double>(lag_ns) - counter.lag_ns) * LAG_WEIGHT;
+    }
+
+public:
+
+    Deduplicator() : Deduplicator(1, 500000000) {}
+
+    /**
+     * @brief Creates a new deduplicator
+     *
+     * @param nlinks Number of links, at most MAX_LINKS
+     * @param window Time a sample is remembered after its first copy arrives
+     */
+    Deduplicator(std::size_t nlinks, int64_t window) : entries(STREAMS * HISTORY), links(nlinks < MAX_LINKS ? nlinks : MAX_LINKS), window_ns(window) {}
+
+    /**
+     * @brief Handles an incoming frame
+     *
+     * @param frame Frame to handle, its link member determines where it came from
+     * @param active Bitmask of the links that are connected
+     * @return bool true if this is the first copy and should be delivered, false if it is a duplicate
+     */
+    bool add(const Frame& frame, uint32_t active) {
+
+        const std::size_t link = frame.link < this->links ? frame.link : 0;
+        const uint32_t bit = 1U << link;
+        const uint64_t key = identify(frame);
+        const bool stamped = (frame.mask & TIMESTAMP_BIT) != 0;
+
+        Entry* ring = &this->entries[frame.stream * HISTORY];
+        std::size_t& head = this->heads[frame.stream];
+        std::size_t& count = this->counts[frame.stream];
+
+        ++this->counters[link].received;
+
+        // Retire entries that left the window:
+
+        while (count > 0) {
+
+            const Entry& oldest = ring[(head - count) & (HISTORY - 1)];
+
+            if (frame.recv_ns - oldest.first_ns <= this->window_ns) {
+                break;
+            }
+
+            this->retire(oldest, active);
+            --count;
+        }
+
+        // Search for an earlier copy, oldest first:
+        // (Copies arrive over each link in order, so identical values are paired up correctly)
+
+        for (std::size_t i = count; i > 0; --i) {
+
+            Entry& entry = ring[(head - i) & (HISTORY - 1)];
+
+            if (entry.key == key && entry.mask == frame.mask && (entry.seen & bit) == 0) {
+
+                entry.seen |= bit;
+
+                ++this->counters[link].duplicates;
+
+                if (stamped) {
+                    this->add_lag(link, frame.recv_ns > entry.first_ns ? frame.recv_ns - entry.first_ns : 0);
+                }
+
+                return false;
+            }
+        }
+
+        // This is the first copy, make room for it if the ring is full:
+
+        if (count == HISTORY) {
+            this->retire(ring[head], active);
+            --count;
+        }
+
+        ring[head] = Entry{frame.recv_ns, key, frame.mask, bit};
+
+        head = (head + 1) & (HISTORY - 1);
+        ++count;
+
+        ++this->counters[link].delivered;
+
+        if (stamped) {
+            this->add_lag(link, 0);
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Fills in the statistics of a link
+     *
+     * Only the counters are filled in, the URL, connection state and round trip time are left alone.
+     *
+     * @param link Index of the link
+     * @param stats Statistics to fill in
+     */
+    void get_stats(std::size_t link, LinkStats& stats) const {
+
+        if (link >= this->links) {
+            return;
+        }
+
+        const Counters& counter = this->counters[link];
+
+        stats.received = counter.received;
+        stats.delivered = counter.delivered;
+        stats.duplicates = counter.duplicates;
+        stats.missed = counter.missed;
+        stats.loss = counter.loss;
+        stats.lag_ns = static_cast<int64_t>(counter.lag_ns);
+    }
+
+    /**
+     * @brief Gets the number of links
+     *
+     * @return std::size_t Number of links
+     */
+    std::size_t get_links() const { return this->links; }
+
+    /**
+     * @brief Gets the time a sample is remembered
+     *
+     * @return int64_t Window in nanoseconds
+     */
+    int64_t get_window() const { return this->window_ns; }
+
+    /**
+     * @brief Sets the time a sample is remembered
+     *
+     * This should be longer than the largest difference in latency between links,
+     * or late copies will be delivered again.
+     *
+     * @param window Window in nanoseconds
+     */
+    void set_window(int64_t window) { this->window_ns = window; }
+};
@@ -0,0 +1,206 @@
+/**
+ * @file spsc.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief A lock free single producer, single consumer queue
+ * @version 0.1
+ * @date 2024-11-10
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes a lock free ring buffer, SPSCQueue!
+ * Unlike SQueue and Deque, this queue never blocks and never allocates after construction.
+ * This makes it ideal for handing off data from a thread we do not want to hold up,
+ * such as the MAVSDK callback thread.
+ * The catch is that exactly one thread may push and exactly one thread may pop.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * @brief A lock free single producer, single consumer queue
+ *
+ * This class represents a bounded ring buffer that can be safely used
+ * by one producing thread and one consuming thread at the same time,
+ * without any locks.
+ *
+ * The producer and consumer positions live on separate cache lines,
+ * and each side keeps a cached copy of the other position,
+ * so in the common case pushing and popping do not touch the other thread's cache line.
+ *
+ * If the queue is full, pushing fails and it is up to the caller to decide what to do.
+ * Nothing is ever overwritten.
+ *
+ * @tparam T Type of value this queue will contain
+ */
+template<typename T>
+class SPSCQueue {
+private:
+
+    /// Size of a cache line, used to avoid false sharing
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    /// Storage for all values
+    std::unique_ptr<T[]> buffer;
+
+    /// Capacity of the buffer, always a power of two
+    std::size_t capacity;
+
+    /// Mask used to wrap positions into the buffer
+    std::size_t mask;
+
+    /// Position of the next value to pop, written by the consumer
+    alignas(CACHE_LINE) std::atomic<std::size_t> head{0};
+
+    /// Copy of the producer position, only used by the consumer
+    std::size_t cached_tail = 0;
+
+    /// Position of the next value to push, written by the producer
+    alignas(CACHE_LINE) std::atomic<std::size_t> tail{0};
+
+    /// Copy of the consumer position, only used by the producer
+    std::size_t cached_head = 0;
+
+    /**
+     * @brief Rounds a number up to the next power of two
+     *
+     * @param val Number to round
+     * @return std::size_t Next power of two
+     */
+    static std::size_t round_pow2(std::size_t val) {
+
+        std::size_t res = 1;
+
+        while (res < val) {
+            res <<= 1;
+        }
+
+        return res;
+    }
+
+public:
+
+    /**
+     * @brief Construct a new SPSCQueue
+     *
+     * @param size Minimum number of values this queue can hold, rounded up to a power of two
+     */
+    explicit SPSCQueue(std::size_t size = 1024) : buffer(std::make_unique<T[]>(round_pow2(size))), capacity(round_pow2(size)), mask(round_pow2(size) - 1) {}
+
+    /**
+     * @brief Pushes a value into the queue
+     *
+     * Must only be called from the producer thread.
+     *
+     * @param val Value to push
+     * @return bool true if pushed, false if the queue is full
+     */
+    bool push(const T& val) {
+
+        const std::size_t pos = this->tail.load(std::memory_order_relaxed);
+
+        // Only look at the real consumer position if our copy says we are full:
+
+        if (pos - this->cached_head >= this->capacity) {
+
+            this->cached_head = this->head.load(std::memory_order_acquire);
+
+            if (pos - this->cached_head >= this->capacity) {
+                return false;
+            }
+        }
+
+        this->buffer[pos & this->mask] = val;
+
+        // Publish the value to the consumer:
+
+        this->tail.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * @brief Pops a value from the queue
+     *
+     * Must only be called from the consumer thread.
+     *
+     * @param val Variable queue contents are placed into
+     * @return bool true if a value was popped, false if the queue is empty
+     */
+    bool pop(T& val) {
+
+        const std::size_t pos = this->head.load(std::memory_order_relaxed);
+
+        // Only look at the real producer position if our copy says we are empty:
+
+        if (pos == this->cached_tail) {
+
+            this->cached_tail = this->tail.load(std::memory_order_acquire);
+
+            if (pos == this->cached_tail) {
+                return false;
+            }
+        }
+
+        val = this->buffer[pos & this->mask];
+
+        // Hand the slot back to the producer:
+
+        this->head.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * @brief Gets the value that would be popped next, without popping it
+     *
+     * Must only be called from the consumer thread.
+     * The value stays valid until it is popped.
+     *
+     * @return const T* Next value, nullptr if the queue is empty
+     */
+    const T* front() {
+
+        const std::size_t pos = this->head.load(std::memory_order_relaxed);
+
+        if (pos == this->cached_tail) {
+
+            this->cached_tail = this->tail.load(std::memory_order_acquire);
+
+            if (pos == this->cached_tail) {
+                return nullptr;
+            }
+        }
+
+        return &this->buffer[pos & this->mask];
+    }
+
+    /**
+     * @brief Determines if the queue is empty
+     *
+     * This can be called from any thread,
+     * but the result may be stale by the time it is used.
+     *
+     * @return bool true if empty, false if not
+     */
+    bool empty() const { return this->head.load(std::memory_order_acquire) == this->tail.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Gets the number of values in the queue
+     *
+     * Like empty(), the result may be stale.
+     *
+     * @return std::size_t Number of values in the queue
+     */
+    std::size_t size() const { return this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Gets the capacity of the queue
+     *
+     * @return std::size_t Maximum number of values this queue can hold
+     */
+    std::size_t get_capacity() const { return this->capacity; }
+};
@@ -0,0 +1,483 @@
+/**
+ * @file stats.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Sliding window statistics over telemetry values
+ * @version 0.1
+ * @date 2024-12-07
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes components for keeping statistics over a sliding window of samples,
+ * such as the rolling mean, variance, min/max and rate of change of a value.
+ * Statistics are updated incrementally as samples arrive,
+ * so keeping them up to date costs the same no matter how large the window is.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Statistics over a window of samples
+ *
+ * If the window is empty, count is zero and all other values are NaN.
+ */
+struct WindowSummary {
+
+    /// Number of samples in the window
+    std::size_t count = 0;
+
+    /// Mean of the samples
+    double mean = std::numeric_limits<double>::quiet_NaN();
+
+    /// Variance of the samples (population)
+    double variance = std::numeric_limits<double>::quiet_NaN();
+
+    /// Smallest sample
+    double min = std::numeric_limits<double>::quiet_NaN();
+
+    /// Largest sample
+    double max = std::numeric_limits<double>::quiet_NaN();
+
+    /// Rate of change between the oldest and newest sample, per second
+    double rate = std::numeric_limits<double>::quiet_NaN();
+
+    /// Newest sample
+    double last = std::numeric_limits<double>::quiet_NaN();
+
+    /// Time of the oldest sample, steady clock nanoseconds
+    int64_t first_ns = 0;
+
+    /// Time of the newest sample, steady clock nanoseconds
+    int64_t last_ns = 0;
+};
+
+/**
+ * @brief Keeps statistics over a sliding window of samples
+ *
+ * The window holds at most a fixed number of samples,
+ * and optionally drops samples older than a time span.
+ * All memory is allocated up front, so adding samples never allocates.
+ *
+ * Statistics over the whole window are maintained incrementally:
+ *
+ * - Mean and variance - Welford's algorithm, with samples removed as they leave the window
+ * - Min and max - Monotonic queues, each sample is added and removed at most once
+ * - Rate of change - Difference between the oldest and newest sample
+ *
+ * Removing samples from Welford's algorithm slowly accumulates rounding error,
+ * so we recompute the mean and variance from scratch once every window's worth of removals.
+ * This keeps updates amortized O(1).
+ *
+ * Statistics over a smaller part of the window (by count or by time) can also be computed,
+ * which walks the samples involved.
+ *
+ * This class is not thread safe.
+ */
+class WindowStats {
+private:
+
+    /// A single sample
+    struct Sample {
+
+        /// Time of the sample, steady clock nanoseconds
+        int64_t time_ns = 0;
+
+        /// Value of the sample
+        double value = 0;
+    };
+
+    /// Storage for all samples in the window, used as a ring
+    std::vector<Sample> samples;
+
+    /// Maximum number of samples in the window
+    std::size_t capacity;
+
+    /// Mask used to wrap sequence numbers into the rings, which are a power of two in size
+    uint64_t mask;
+
+    /// Sequence numbers of candidates for the minimum, used as a ring
+    std::vector<uint64_t> min_queue;
+
+    /// Sequence numbers of candidates for the maximum, used as a ring
+    std::vector<uint64_t> max_queue;
+
+    /// Maximum age of samples in nanoseconds, zero for no limit
+    int64_t span_ns = 0;
+
+    /// Sequence number of the oldest sample in the window
+    uint64_t head = 0;
+
+    /// Sequence number of the next sample
+    uint64_t tail = 0;
+
+    /// Positions of the front and back of the min queue
+    uint64_t min_head = 0, min_tail = 0;
+
+    /// Positions of the front and back of the max queue
+    uint64_t max_head = 0, max_tail = 0;
+
+    /// Running mean of the window
+    double mean = 0;
+
+    /// Running sum of squared differences from the mean
+    double m2 = 0;
+
+    /// Number of removals since the mean and variance were last recomputed
+    std::size_t removals = 0;
+
+    /// Gets a sample by sequence number
+    const Sample& at(uint64_t seq) const { return this->samples[seq & this->mask]; }
+
+    /**
+     * @brief Rounds a number up to the next power of two
+     *
+     * @param val Number to round
+     * @return std::size_t Next power of two
+     */
+    static std::size_t round_pow2(std::size_t val) {
+
+        std::size_t res = 1;
+
+        while (res < val) {
+            res <<= 1;
+        }
+
+        return res;
+    }
+
+    /**
+     * @brief Removes the oldest sample from the window
+     */
+    void pop() {
+
+        const uint64_t seq = this->head++;
+        const double value = this->at(seq).value;
+
+        // Leave the monotonic queues if this sample is at the front:
+
+        if (this->min_head != this->min_tail && this->min_queue[this->min_head & this->mask] == seq) {
+            ++this->min_head;
+        }
+
+        if (this->max_head != this->max_tail && this->max_queue[this->max_head & this->mask] == seq) {
+            ++this->max_head;
+        }
+
+        // Undo the Welford update for this sample:
+
+        const std::size_t num = this->size();
+
+        if (num == 0) {
+            this->mean = 0;
+            this->m2 = 0;
+            this->removals = 0;
+            return;
+        }
+
+        const double delta = value - this->mean;
+
+        this->mean -= delta / static_cast<double>(num);
+        this->m2 = std::max(0.0, this->m2 - delta * (value - this->mean));
+
+        if (++this->removals >= this->capacity) {
+            this->recompute();
+        }
+    }
+
+    /**
+     * @brief Recomputes the mean and variance from the samples in the window
+     */
+    void recompute() {
+
+        double nmean = 0;
+        double nm2 = 0;
+        std::size_t num = 0;
+
+        for (uint64_t seq = this->head; seq != this->tail; ++seq) {
+
+            const double value = this->at(seq).value;
+            const double delta = value - nmean;
+
+            nmean += delta / static_cast<double>(++num);
+            nm2 += delta * (value - nmean);
+        }
+
+        this->mean = nmean;
+        this->m2 = nm2;
+        this->removals = 0;
+    }
+
+    /**
+     * @brief Computes statistics over the newest samples, starting at a sequence number
+     *
+     * @param first Sequence number of the oldest sample to include
+     * @return WindowSummary Statistics over the samples
+     */
+    WindowSummary summarize_from(uint64_t first) const {
+
+        WindowSummary summary;
+
+        if (first == this->tail) {
+            return summary;
+        }
+
+        double nmean = 0;
+        double nm2 = 0;
+        double nmin = std::numeric_limits<double>::infinity();
+        double nmax = -std::numeric_limits<double>::infinity();
+        std::size_t num = 0;
+
+        for (uint64_t seq = first; seq != this->tail; ++seq) {
+
+            const double value = this->at(seq).value;
+            const double delta = value - nmean;
+
+            nmean += delta / static_cast<double>(++num);
+            nm2 += delta * (value - nmean);
+            nmin = std::min(nmin, value);
+            nmax = std::max(nmax, value);
+        }
+
+        summary.count = num;
+        summary.mean = nmean;
+        summary.variance = nm2 / static_cast<double>(num);
+        summary.min = nmin;
+        summary.max = nmax;
+
+        this->fill_ends(summary, first);
+
+        return summary;
+    }
+
+    /**
+     * @brief Fills in the values that only depend on the oldest and newest samples
+     *
+     * @param summary Summary to fill
+     * @param first Sequence number of the oldest sample
+     */
+    void fill_ends(WindowSummary& summary, uint64_t first) const {
+
+        const Sample& oldest = this->at(first);
+        const Sample& newest = this->at(this->tail - 1);
+
+        summary.last = newest.value;
+        summary.first_ns = oldest.time_ns;
+        summary.last_ns = newest.time_ns;
+
+        if (newest.time_ns > oldest.time_ns) {
+            summary.rate = (newest.value - oldest.value) * 1e9 / static_cast<double>(newest.time_ns - oldest.time_ns);
+        }
+    }
+
+public:
+
+    /**
+     * @brief Construct a new WindowStats
+     *
+     * @param size Maximum number of samples in the window
+     * @param span Maximum age of samples in nanoseconds, zero for no limit
+     */
+    explicit WindowStats(std::size_t size = 1, int64_t span = 0)
+        : samples(round_pow2(std::max<std::size_t>(size, 1))), capacity(std::max<std::size_t>(size, 1)), mask(round_pow2(std::max<std::size_t>(size, 1)) - 1),
+          min_queue(round_pow2(std::max<std::size_t>(size, 1))), max_queue(round_pow2(std::max<std::size_t>(size, 1))), span_ns(std::max<int64_t>(span, 0)) {}
+
+    /**
+     * @brief Adds a sample to the window
+     *
+     * The oldest sample is removed if the window is full,
+     * along with any samples that are now too old.
+     * NaN values are ignored.
+     * Samples are expected to arrive in time order.
+     *
+     * @param time_ns Time of the sample, steady clock nanoseconds
+     * @param value Value of the sample
+     */
+    void add(int64_t time_ns, double value) {
+
+        if (std::isnan(value)) {
+            return;
+        }
+
+        // Make room for the new sample:
+
+        if (this->size() == this->capacity) {
+            this->pop();
+        }
+
+        const uint64_t seq = this->tail++;
+
+        this->samples[seq & this->mask] = Sample{time_ns, value};
+
+        // Drop candidates that can never be the min or max again:
+
+        while (this->min_tail != this->min_head && this->at(this->min_queue[(this->min_tail - 1) & this->mask]).value >= value) {
+            --this->min_tail;
+        }
+
+        this->min_queue[this->min_tail++ & this->mask] = seq;
+
+        while (this->max_tail != this->max_head && this->at(this->max_queue[(this->max_tail - 1) & this->mask]).value <= value) {
+            --this->max_tail;
+        }
+
+        this->max_queue[this->max_tail++ & this->mask] = seq;
+
+        // Welford update:
+
+        const double delta = value - this->mean;
+
+        this->mean += delta / static_cast<double>(this->size());
+        this->m2 += delta * (value - this->mean);
+
+        // Remove samples that are too old:
+
+        if (this->span_ns > 0) {
+            this->expire(time_ns);
+        }
+    }
+
+    /**
+     * @brief Removes samples older than the time span
+     *
+     * This is done automatically when samples are added,
+     * but can also be called when no samples are arriving.
+     *
+     * @param now_ns Current time, steady clock nanoseconds
+     */
+    void expire(int64_t now_ns) {
+
+        if (this->span_ns <= 0) {
+            return;
+        }
+
+        while (!this->empty() && now_ns - this->at(this->head).time_ns > this->span_ns) {
+            this->pop();
+        }
+    }
+
+    /**
+     * @brief Removes all samples
+     */
+    void clear() {
+        this->head = this->tail = 0;
+        this->min_head = this->min_tail = 0;
+        this->max_head = this->max_tail = 0;
+        this->mean = 0;
+        this->m2 = 0;
+        this->removals = 0;
+    }
+
+    /**
+     * @brief Gets the number of samples in the window
+     *
+     * @return std::size_t Number of samples
+     */
+    std::size_t size() const { return static_cast<std::size_t>(this->tail - this->head); }
+
+    /**
+     * @brief Determines if the window is empty
+     *
+     * @return bool true if empty
+     */
+    bool empty() const { return this->head == this->tail; }
+
+    /**
+     * @brief Gets the maximum number of samples in the window
+     *
+     * @return std::size_t Capacity of the window
+     */
+    std::size_t get_capacity() const { return this->capacity; }
+
+    /**
+     * @brief Gets the maximum age of samples
+     *
+     * @return int64_t Time span in nanoseconds, zero for no limit
+     */
+    int64_t get_span() const { return this->span_ns; }
+
+    /**
+     * @brief Gets statistics over the whole window
+     *
+     * This is O(1), as everything is maintained as samples arrive.
+     *
+     * @return WindowSummary Statistics over the window
+     */
+    WindowSummary summary() const {
+
+        WindowSummary summary;
+
+        if (this->empty()) {
+            return summary;
+        }
+
+        summary.count = this->size();
+        summary.mean = this->mean;
+        summary.variance = this->m2 / static_cast<double>(summary.count);
+        summary.min = this->at(this->min_queue[this->min_head & this->mask]).value;
+        summary.max = this->at(this->max_queue[this->max_head & this->mask]).value;
+
+        this->fill_ends(summary, this->head);
+
+        return summary;
+    }
+
+    /**
+     * @brief Gets statistics over the newest samples
+     *
+     * @param count Number of samples to include
+     * @return WindowSummary Statistics over the samples
+     */
+    WindowSummary summary_count(std::size_t count) const {
+
+        if (count >= this->size()) {
+            return this->summary();
+        }
+
+        return this->summarize_from(this->tail - count);
+    }
+
+    /**
+     * @brief Gets statistics over the samples received in a recent span of time
+     *
+     * The span is measured back from the newest sample.
+     *
+     * @param span_ns Time span in nanoseconds
+     * @return WindowSummary Statistics over the samples
+     */
+    WindowSummary summary_time(int64_t span_ns) const {
+
+        if (this->empty()) {
+            return {};
+        }
+
+        const int64_t start = this->at(this->tail - 1).time_ns - span_ns;
+
+        // Samples are in time order, so we can binary search for the oldest one in the span:
+
+        uint64_t low = this->head;
+        uint64_t high = this->tail - 1;
+
+        while (low < high) {
+
+            const uint64_t mid = low + (high - low) / 2;
+
+            if (this->at(mid).time_ns < start) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if (low == this->head) {
+            return this->summary();
+        }
+
+        return this->summarize_from(low);
+    }
+};
@@ -0,0 +1,146 @@
+/**
+ * @file trace.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Optional tracing of the telemetry pipeline
+ * @version 0.1
+ * @date 2024-12-31
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes trace points that record when each stage of the pipeline runs,
+ * so latency spikes can be pinned on a stage after the fact
+ * (the MAVSDK callback thread, queue contention, the worker or the consumer).
+ *
+ * Trace points are only compiled in if DTS_TRACING is defined
+ * (configure with -DDTS_ENABLE_TRACING=ON), otherwise the macros below expand to nothing
+ * and cost nothing at all.
+ *
+ * Each thread records events into its own fixed size ring buffer, without any locks,
+ * so tracing barely disturbs the timing it measures.
+ * Once the ring is full, the oldest events are overwritten.
+ * Events are written on demand with trace_flush() in the Chrome trace event format,
+ * which can be opened in chrome://tracing or https://ui.perfetto.dev.
+ * Times are host steady clock times, the same clock used for recv_ns.
+ *
+ * The following macros are provided:
+ *
+ * - DTS_TRACE_SCOPE(name) - Records the time from this point until the end of the scope
+ * - DTS_TRACE_INSTANT(name) - Records a single point in time
+ * - DTS_TRACE_COUNTER(name, value) - Records the value of a counter, such as a queue depth
+ * - DTS_TRACE_THREAD(name) - Names the current thread in the trace
+ *
+ * Names MUST be string literals (or otherwise live forever), as only the pointer is recorded.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#ifdef DTS_TRACING
+#include "frame.hpp"
+#endif
+
+/// Determines if trace points are compiled in
+#ifdef DTS_TRACING
+constexpr bool TRACING = true;
+#else
+constexpr bool TRACING = false;
+#endif
+
+/**
+ * @brief Writes all recorded events to a file
+ *
+ * Events are written in the Chrome trace event format (JSON).
+ * Events are not removed, see trace_clear().
+ *
+ * This is safe to call while the pipeline is running.
+ * Events that are being recorded, or are overwritten while we copy them, are left out
+ * (each slot of a ring is guarded by a sequence number, so we never write a torn event).
+ *
+ * If tracing is not compiled in, we report it and write nothing.
+ *
+ * @param path Path of the file to write
+ * @return bool true if written, false if not
+ */
+bool trace_flush(const std::string& path);
+
+/**
+ * @brief Removes all recorded events
+ *
+ * This also frees the buffers of threads that have exited,
+ * so long running programs that restart streams should call this after each flush.
+ */
+void trace_clear();
+
+#ifdef DTS_TRACING
+
+/**
+ * @brief Records an event in the buffer of the current thread
+ *
+ * This is lock free, except for the first event of each thread,
+ * which registers the buffer of the thread.
+ * Use the macros above instead of calling this directly.
+ *
+ * @param name Name of the event
+ * @param phase Chrome trace event phase ('X' for durations, 'i' for instants, 'C' for counters)
+ * @param start_ns Time the event started
+ * @param dur_ns Duration of the event
+ * @param value Value of a counter
+ */
+void trace_record(const char* name, char phase, int64_t start_ns, int64_t dur_ns, int64_t value);
+
+/**
+ * @brief Names the current thread in the trace
+ *
+ * @param name Name of the thread
+ */
+void trace_thread_name(const char* name);
+
+/**
+ * @brief Records the time spent in a scope
+ *
+ * We grab the time when created, and record the event when destroyed.
+ */
+class TraceScope {
+private:
+
+    /// Name of the event
+    const char* name;
+
+    /// Time the scope was entered
+    int64_t start_ns;
+
+public:
+
+    explicit TraceScope(const char* nname) : name(nname), start_ns(host_time_ns()) {}
+
+    ~TraceScope() { trace_record(this->name, 'X', this->start_ns, host_time_ns() - this->start_ns, 0); }
+
+    TraceScope(const TraceScope&) = delete;
+
+    TraceScope(TraceScope&&) = delete;
+
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    TraceScope& operator=(TraceScope&&) = delete;
+};
+
+#define DTS_TRACE_CONCAT_INNER(a, b) a##b
+#define DTS_TRACE_CONCAT(a, b) DTS_TRACE_CONCAT_INNER(a, b)
+
+#define DTS_TRACE_SCOPE(name) const TraceScope DTS_TRACE_CONCAT(dts_trace_scope_, __LINE__)(name)
+#define DTS_TRACE_INSTANT(name) trace_record(name, 'i', host_time_ns(), 0, 0)
+#define DTS_TRACE_COUNTER(name, value) trace_record(name, 'C', host_time_ns(), 0, static_cast<int64_t>(value))
+#define DTS_TRACE_THREAD(name) trace_thread_name(name)
+
+#else
+
+// Arguments are never evaluated, so disabled trace points cost nothing:
+
+#define DTS_TRACE_SCOPE(name) static_cast<void>(0)
+#define DTS_TRACE_INSTANT(name) static_cast<void>(0)
+#define DTS_TRACE_COUNTER(name, value) static_cast<void>(0)
+#define DTS_TRACE_THREAD(name) static_cast<void>(0)
+
+#endif
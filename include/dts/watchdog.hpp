@@ -0,0 +1,315 @@
+/**
+ * @file watchdog.hpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Health monitoring for telemetry streams
+ * @version 0.1
+ * @date 2024-11-02
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file describes a watchdog that keeps track of the health of each stream.
+ * MAVSDK subscriptions can silently stop delivering data,
+ * which means consumers will block forever without knowing why.
+ * The watchdog measures the rate of each stream and detects any gaps,
+ * so we can report a clear health state and react accordingly.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+/**
+ * @brief Health states of a stream
+ *
+ * - Unknown - We have not received enough data to make a decision
+ * - Healthy - Data is arriving at the expected rate
+ * - Degraded - Data is arriving, but slower than expected
+ * - Stalled - No data has arrived for a long time
+ */
+enum class StreamHealth : uint8_t {
+    Unknown,
+    Healthy,
+    Degraded,
+    Stalled
+};
+
+/**
+ * @brief Watches the rate of a number of streams
+ *
+ * Each time a sample arrives on a stream, record() should be called.
+ * We keep an exponentially weighted moving average (EWMA) of the interval
+ * between samples, which gives us a smoothed measured rate for each stream.
+ *
+ * Periodically, check() should be called to re-evaluate the health of each stream.
+ * A stream is stalled if the time since the last sample exceeds
+ * a multiple of the expected sample period (or the measured one,
+ * if no expected rate is configured).
+ * A stream is degraded if its measured rate falls below
+ * a fraction of the expected rate.
+ *
+ * record() is lock free, and can be called from one thread per stream
+ * while another thread calls check() and the getters.
+ *
+ * @tparam N Number of streams to watch
+ */
+template<std::size_t N>
+class Watchdog {
+public:
+
+    /// Clock we use for all measurements
+    using clock = std::chrono::steady_clock;
+
+    /// Callback type for health changes
+    using HealthCallback = std::function<void(std::size_t, StreamHealth)>;
+
+private:
+
+    /**
+     * @brief State of a single stream
+     */
+    struct Monitor {
+
+        /// Time of last sample in nanoseconds, 0 if none
+        std::atomic<int64_t> last_ns{0};
+
+        /// Smoothed interval between samples in seconds, 0 if unknown
+        std::atomic<double> period{0};
+
+        /// Expected rate in Hz, 0 if not configured
+        std::atomic<double> expected{0};
+
+        /// Current health of this stream
+        std::atomic<StreamHealth> health{StreamHealth::Unknown};
+    };
+
+    /// Monitors for each stream
+    std::array<Monitor, N> monitors;
+
+    /// Time we started watching in nanoseconds
+    std::atomic<int64_t> start_ns{0};
+
+    /// Smoothing factor of the EWMA
+    double alpha = 0.1;
+
+    /// Number of sample periods without data before a stream is stalled
+    double gap_factor = 5.0;
+
+    /// Minimum gap in seconds before a stream is stalled
+    double min_gap = 0.5;
+
+    /// Fraction of the expected rate below which a stream is degraded
+    double degraded_ratio = 0.8;
+
+    /**
+     * @brief Converts a time point into nanoseconds
+     *
+     * @param time Time point to convert
+     * @return int64_t Nanoseconds since clock epoch
+     */
+    static int64_t to_ns(clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+
+    /**
+     * @brief Determines the health of a stream
+     *
+     * @param mon Monitor of the stream
+     * @param now Current time in nanoseconds
+     * @return StreamHealth Health of the stream
+     */
+    StreamHealth evaluate(const Monitor& mon, int64_t now) const {
+
+        const int64_t last = mon.last_ns.load();
+        const double expected = mon.expected.load();
+        const double period = mon.period.load();
+
+        // Determine the period we compare gaps against:
+
+        const double ref = expected > 0 ? 1.0 / expected : period;
+
+        if (last == 0) {
+
+            // Nothing has arrived yet, we can only tell if we know what to expect:
+
+            if (expected > 0 && static_cast<double>(now - this->start_ns.load()) * 1e-9 > std::max(this->gap_factor * ref, this->min_gap)) {
+                return StreamHealth::Stalled;
+            }
+
+            return StreamHealth::Unknown;
+        }
+
+        const double gap = static_cast<double>(now - last) * 1e-9;
+
+        if (ref > 0 && gap > std::max(this->gap_factor * ref, this->min_gap)) {
+            return StreamHealth::Stalled;
+        }
+
+        if (period <= 0) {
+
+            // Only one sample so far:
+
+            return StreamHealth::Unknown;
+        }
+
+        if (expected > 0 && (1.0 / period) < expected * this->degraded_ratio) {
+            return StreamHealth::Degraded;
+        }
+
+        return StreamHealth::Healthy;
+    }
+
+public:
+
+    /**
+     * @brief Resets all measurements
+     *
+     * Expected rates are kept, everything else is forgotten.
+     * This should be called when we start listening to the streams.
+     *
+     * @param now Time we start watching
+     */
+    void reset(clock::time_point now = clock::now()) {
+
+        for (auto& mon : this->monitors) {
+            mon.last_ns = 0;
+            mon.period = 0;
+            mon.health = StreamHealth::Unknown;
+        }
+
+        this->start_ns = to_ns(now);
+    }
+
+    /**
+     * @brief Records the arrival of a sample
+     *
+     * @param index Index of the stream the sample arrived on
+     * @param now Time the sample arrived
+     */
+    void record(std::size_t index, clock::time_point now = clock::now()) {
+
+        Monitor& mon = this->monitors[index];
+
+        const int64_t tnow = to_ns(now);
+        const int64_t last = mon.last_ns.exchange(tnow);
+
+        if (last == 0 || tnow <= last) {
+            return;
+        }
+
+        // Update the moving average of the interval:
+
+        const double interval = static_cast<double>(tnow - last) * 1e-9;
+        const double period = mon.period.load();
+
+        mon.period = period > 0 ? period + this->alpha * (interval - period) : interval;
+    }
+
+    /**
+     * @brief Re-evaluates the health of all streams
+     *
+     * If the health of a stream changed since the last check,
+     * then the given callback is called with the stream index and new health.
+     *
+     * @param callback Function to call for each change
+     * @param now Current time
+     */
+    void check(const HealthCallback& callback, clock::time_point now = clock::now()) {
+
+        const int64_t tnow = to_ns(now);
+
+        for (std::size_t i = 0; i < N; ++i) {
+
+            const StreamHealth health = this->evaluate(this->monitors[i], tnow);
+
+            if (this->monitors[i].health.exchange(health) != health && callback) {
+                callback(i, health);
+            }
+        }
+    }
+
+    /**
+     * @brief Gets the health of a stream as of the last check
+     *
+     * @param index Index of the stream
+     * @return StreamHealth Health of the stream
+     */
+    StreamHealth get_health(std::size_t index) const { return this->monitors[index].health.load(); }
+
+    /**
+     * @brief Gets the measured rate of a stream
+     *
+     * This is the inverse of the smoothed interval between samples.
+     * If the current gap is longer than the smoothed interval,
+     * we report the rate implied by the gap instead,
+     * so stalled streams decay towards zero.
+     *
+     * @param index Index of the stream
+     * @param now Current time
+     * @return double Measured rate in Hz, 0 if unknown
+     */
+    double get_rate(std::size_t index, clock::time_point now = clock::now()) const {
+
+        const Monitor& mon = this->monitors[index];
+
+        const int64_t last = mon.last_ns.load();
+        const double period = mon.period.load();
+
+        if (last == 0 || period <= 0) {
+            return 0;
+        }
+
+        const double gap = static_cast<double>(to_ns(now) - last) * 1e-9;
+
+        return 1.0 / std::max(period, gap);
+    }
+
+    /**
+     * @brief Sets the expected rate of a stream
+     *
+     * @param index Index of the stream
+     * @param rate Expected rate in Hz, 0 to only use the measured rate
+     */
+    void set_expected_rate(std::size_t index, double rate) { this->monitors[index].expected = rate; }
+
+    /**
+     * @brief Gets the expected rate of a stream
+     *
+     * @param index Index of the stream
+     * @return double Expected rate in Hz, 0 if not configured
+     */
+    double get_expected_rate(std::size_t index) const { return this->monitors[index].expected.load(); }
+
+    /**
+     * @brief Sets the gap thresholds
+     *
+     * A stream is stalled if no data arrives for
+     * max(factor * period, minimum) seconds.
+     *
+     * @param factor Number of sample periods
+     * @param minimum Minimum gap in seconds
+     */
+    void set_gap(double factor, double minimum) {
+        this->gap_factor = factor;
+        this->min_gap = minimum;
+    }
+
+    /**
+     * @brief Sets the smoothing factor of the rate EWMA
+     *
+     * @param nalpha New smoothing factor, between 0 and 1
+     */
+    void set_alpha(double nalpha) { this->alpha = nalpha; }
+
+    /**
+     * @brief Sets the degraded threshold
+     *
+     * @param ratio Fraction of the expected rate below which a stream is degraded
+     */
+    void set_degraded_ratio(double ratio) { this->degraded_ratio = ratio; }
+};
@@ -12,13 +12,327 @@
  */
 
 #include <pybind11/pybind11.h>
+#include <pybind11/chrono.h>
+#include <pybind11/functional.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
+#include <clock_sync.hpp>
+#include <codec.hpp>
 #include <dts.hpp>
+#include <geodetic.hpp>
+#include <links.hpp>
+#include <trace.hpp>
 
 namespace py = pybind11;
 
+namespace {
+
+/// Array type accepted by the geodetic functions
+using darray = py::array_t<double, py::array::c_style | py::array::forcecast>;
+
+/**
+ * @brief Converts arrays of positions using a transform
+ *
+ * @param lat Latitudes in degrees
+ * @param lon Longitudes in degrees
+ * @param alt Altitudes in meters
+ * @param transform Transform to utilize
+ * @return py::tuple Tuple of three arrays, one per output coordinate
+ */
+py::tuple geodetic_batch(const darray& lat, const darray& lon, const darray& alt, const GeodeticTransform& transform) {
+
+    if (lat.size() != lon.size() || lat.size() != alt.size()) {
+        throw std::invalid_argument("lat, lon and alt must have the same size");
+    }
+
+    const auto count = static_cast<std::size_t>(lat.size());
+
+    darray a(count);
+    darray b(count);
+    darray c(count);
+
+    double* pa = a.mutable_data();
+    double* pb = b.mutable_data();
+    double* pc = c.mutable_data();
+
+    {
+        const py::gil_scoped_release release;
+
+        transform.transform(lat.data(), lon.data(), alt.data(), count, pa, pb, pc);
+    }
+
+    return py::make_tuple(a, b, c);
+}
+
+/**
+ * @brief Converts frames into arrays
+ *
+ * We copy the frames into one array per frame member,
+ * so Python never has to deal with individual frames.
+ *
+ * The returned dictionary contains the following arrays:
+ *
+ * - stream - Index of the stream of each frame
+ * - recv_ns - Host receive time of each frame
+ * - timestamp_us - Autopilot timestamp of each frame
+ * - vehicle_ns - Synchronized autopilot time of each frame
+ * - sample_ns - Synchronized sample time of each frame
+ * - mask - Bitmask of the values present in each frame
+ * - values - 2D array of values, one row per frame
+ *
+ * @param frames Frames to convert
+ * @return py::dict Dictionary of arrays
+ */
+py::dict frame_arrays(const std::vector<Frame>& frames) {
+
+    const std::size_t count = frames.size();
+
+    py::array_t<uint16_t> streams(count);
+    py::array_t<int64_t> recv(count);
+    py::array_t<uint64_t> stamps(count);
+    py::array_t<int64_t> vehicle(count);
+    py::array_t<int64_t> sample(count);
+    py::array_t<uint16_t> masks(count);
+    py::array_t<double> values({count, static_cast<std::size_t>(FRAME_FIELDS)});
+
+    uint16_t* pstreams = streams.mutable_data();
+    int64_t* precv = recv.mutable_data();
+    uint64_t* pstamps = stamps.mutable_data();
+    int64_t* pvehicle = vehicle.mutable_data();
+    int64_t* psample = sample.mutable_data();
+    uint16_t* pmasks = masks.mutable_data();
+    double* pvalues = values.mutable_data();
+
+    for (std::size_t i = 0; i < count; ++i) {
+        pstreams[i] = frames[i].stream;
+        precv[i] = frames[i].recv_ns;
+        pstamps[i] = frames[i].timestamp_us;
+        pvehicle[i] = frames[i].vehicle_ns;
+        psample[i] = frames[i].sample_ns;
+        pmasks[i] = frames[i].mask;
+        std::copy(frames[i].values.begin(), frames[i].values.end(), pvalues + i * FRAME_FIELDS);
+    }
+
+    py::dict batch;
+
+    batch["stream"] = streams;
+    batch["recv_ns"] = recv;
+    batch["timestamp_us"] = stamps;
+    batch["vehicle_ns"] = vehicle;
+    batch["sample_ns"] = sample;
+    batch["mask"] = masks;
+    batch["values"] = values;
+
+    return batch;
+}
+
+/**
+ * @brief Gets a batch of frames as arrays
+ *
+ * We retrieve the frames without the GIL,
+ * and then convert them with frame_arrays().
+ *
+ * @param stream DTStream to get frames from
+ * @param max_frames Maximum number of frames to retrieve
+ * @param timeout Time to wait if no frames are available
+ * @return py::dict Dictionary of arrays
+ */
+py::dict frame_batch(DTStream& stream, std::size_t max_frames, std::chrono::milliseconds timeout) {
+
+    std::vector<Frame> frames;
+
+    {
+        const py::gil_scoped_release release;
+
+        stream.get_batch(frames, max_frames, timeout);
+    }
+
+    return frame_arrays(frames);
+}
+
+/**
+ * @brief Gets the frames of a stream received in a time range as arrays
+ *
+ * @param stream DTStream to get frames from
+ * @param index Index of the stream
+ * @param start_ns Start of the range, host steady clock nanoseconds
+ * @param stop_ns End of the range, host steady clock nanoseconds
+ * @return py::dict Dictionary of arrays, see frame_arrays()
+ */
+py::dict history_range(const DTStream& stream, std::size_t index, int64_t start_ns, int64_t stop_ns) {
+
+    std::vector<Frame> frames;
+
+    {
+        const py::gil_scoped_release release;
+
+        stream.get_range(index, start_ns, stop_ns, frames);
+    }
+
+    return frame_arrays(frames);
+}
+
+/**
+ * @brief Gets the frame of a stream that was current at a time as arrays
+ *
+ * @param stream DTStream to get the frame from
+ * @param index Index of the stream
+ * @param time_ns Time to look up, host steady clock nanoseconds
+ * @return py::object Dictionary of arrays holding a single frame, None if not found
+ */
+py::object history_at(const DTStream& stream, std::size_t index, int64_t time_ns) {
+
+    std::vector<Frame> frames(1);
+
+    if (!stream.get_at(index, time_ns, frames[0])) {
+        return py::none();
+    }
+
+    return frame_arrays(frames);
+}
+
+/**
+ * @brief Compiles value names into a field mask
+ *
+ * Unlike compile_fields(), unknown names are an error.
+ *
+ * @param names Names of the values to select
+ * @return FieldMask Compiled field mask
+ */
+FieldMask field_mask(const std::vector<std::string>& names) {
+
+    FieldMask fields;
+
+    if (!compile_fields(names, fields)) {
+        throw std::invalid_argument("Unknown field name, see FIELD_NAMES");
+    }
+
+    return fields;
+}
+
+/**
+ * @brief Gets the latest values of the selected fields as an array
+ *
+ * @param stream DTStream to get values from
+ * @param fields Values to retrieve
+ * @return py::array_t<double> Values, in the order they were named
+ */
+py::array_t<double> field_values(DTStream& stream, const FieldMask& fields) {
+
+    std::vector<double> values;
+
+    {
+        const py::gil_scoped_release release;
+
+        stream.get_values(fields, values);
+    }
+
+    return py::array_t<double>(values.size(), values.data());
+}
+
+/**
+ * @brief Destroys streams without holding the GIL
+ *
+ * Stopping a stream joins the MAVSDK and monitor threads, which may be blocked waiting on the GIL
+ * to call a Python callback, so holding the GIL while we wait would deadlock the interpreter.
+ * This is used by the holder of DTStream, so dropping the last reference to a stream is safe.
+ */
+struct StreamDeleter {
+
+    void operator()(DTStream* stream) const {
+
+        const py::gil_scoped_release release;
+
+        delete stream;
+    }
+};
+
+/**
+ * @brief Stops a stream and forgets its callbacks
+ *
+ * The GIL is released while stopping, see StreamDeleter.
+ * Callbacks are cleared afterwards,
+ * so Python objects they capture (often the stream itself) are released.
+ *
+ * @param stream DTStream to close
+ */
+void close_stream(DTStream& stream) {
+
+    const py::gil_scoped_release release;
+
+    stream.stop();
+
+    stream.set_state_callback(nullptr);
+    stream.set_health_callback(nullptr);
+}
+
+/**
+ * @brief Records frames from a stream into a compressed recording
+ *
+ * This wraps RecordWriter along with the file it writes to,
+ * so python code can record without frames ever leaving C++.
+ */
+class Recorder {
+private:
+
+    /// File we write to
+    std::ofstream file;
+
+    /// Writer for the recording
+    RecordWriter writer;
+
+    /// Frames retrieved from the stream, reused between calls
+    std::vector<Frame> frames;
+
+public:
+
+    Recorder(const std::string& path, std::size_t block) : file(path, std::ios::binary), writer(file, block) {
+
+        if (!this->file) {
+            throw std::invalid_argument("Unable to open " + path);
+        }
+    }
+
+    /**
+     * @brief Moves available frames from a stream into the recording
+     *
+     * @param stream DTStream to get frames from
+     * @param max_frames Maximum number of frames to retrieve
+     * @param timeout Time to wait if no frames are available
+     * @return std::size_t Number of frames recorded
+     */
+    std::size_t record(DTStream& stream, std::size_t max_frames, std::chrono::milliseconds timeout) {
+
+        this->frames.clear();
+
+        stream.get_batch(this->frames, max_frames, timeout);
+
+        this->writer.write(this->frames);
+
+        return this->frames.size();
+    }
+
+    void flush() { this->writer.flush(); }
+
+    void close() { this->writer.close(); }
+
+    uint64_t get_bytes() const { return this->writer.get_bytes(); }
+
+    uint64_t get_frames() const { return this->writer.get_frames(); }
+};
+
+}  // namespace
+
 PYBIND11_MODULE(_pdts, m) {  // NOLINT
 
     // Define version:
@@ -29,16 +343,222 @@ PYBIND11_MODULE(_pdts, m) {  // NOLINT
 
     m.doc() = "Python wrapper for Drift Telemetry Stream";
 
+    // Create binding for connection states:
+
+    py::enum_<ConnectionState>(m, "ConnectionState")
+        .value("STOPPED", ConnectionState::Stopped)
+        .value("CONNECTING", ConnectionState::Connecting)
+        .value("CONNECTED", ConnectionState::Connected)
+        .value("LOST", ConnectionState::Lost)
+        .value("RECONNECTING", ConnectionState::Reconnecting);
+
+    // Create binding for ingest modes:
+
+    py::enum_<IngestMode>(m, "IngestMode")
+        .value("TELEMETRY", IngestMode::Telemetry)
+        .value("PASSTHROUGH", IngestMode::Passthrough);
+
+    // Create binding for local frames:
+
+    py::enum_<LocalFrame>(m, "LocalFrame")
+        .value("ECEF", LocalFrame::ECEF)
+        .value("ENU", LocalFrame::ENU)
+        .value("NED", LocalFrame::NED);
+
+    // Create bindings for batch geodetic transforms:
+
+    m.def("lla_to_ecef", [](const darray& lat, const darray& lon, const darray& alt) {
+        return geodetic_batch(lat, lon, alt, GeodeticTransform(0, 0, 0, LocalFrame::ECEF));
+    }, py::arg("lat"), py::arg("lon"), py::arg("alt"));
+
+    m.def("lla_to_local", [](const darray& lat, const darray& lon, const darray& alt, double origin_lat, double origin_lon, double origin_alt, LocalFrame frame) {
+        return geodetic_batch(lat, lon, alt, GeodeticTransform(origin_lat, origin_lon, origin_alt, frame));
+    }, py::arg("lat"), py::arg("lon"), py::arg("alt"), py::arg("origin_lat"), py::arg("origin_lon"), py::arg("origin_alt"), py::arg("frame") = LocalFrame::ENU);
+
+    m.def("geodetic_simd", &geodetic_simd);
+
+    // Clock used for all host side times, such as recv_ns and history lookups:
+
+    m.def("host_time_ns", &host_time_ns);
+
+    // Pipeline tracing, TRACING determines if trace points were compiled in:
+
+    m.attr("TRACING") = TRACING;
+
+    m.def("trace_flush", &trace_flush, py::arg("path"));
+    m.def("trace_clear", &trace_clear);
+
+    // Create binding for stream health states:
+
+    py::enum_<StreamHealth>(m, "StreamHealth")
+        .value("UNKNOWN", StreamHealth::Unknown)
+        .value("HEALTHY", StreamHealth::Healthy)
+        .value("DEGRADED", StreamHealth::Degraded)
+        .value("STALLED", StreamHealth::Stalled);
+
+    // Create binding for window statistics:
+
+    py::class_<WindowSummary>(m, "WindowSummary")
+        .def_readonly("count", &WindowSummary::count)
+        .def_readonly("mean", &WindowSummary::mean)
+        .def_readonly("variance", &WindowSummary::variance)
+        .def_readonly("min", &WindowSummary::min)
+        .def_readonly("max", &WindowSummary::max)
+        .def_readonly("rate", &WindowSummary::rate)
+        .def_readonly("last", &WindowSummary::last)
+        .def_readonly("first_ns", &WindowSummary::first_ns)
+        .def_readonly("last_ns", &WindowSummary::last_ns)
+        .def("__repr__", [](const WindowSummary& summary) {
+            return "<WindowSummary count=" + std::to_string(summary.count) + " mean=" + std::to_string(summary.mean) +
+                   " min=" + std::to_string(summary.min) + " max=" + std::to_string(summary.max) + ">";
+        });
+
+    // Create binding for clock estimates:
+
+    py::class_<ClockEstimate>(m, "ClockEstimate")
+        .def_readonly("valid", &ClockEstimate::valid)
+        .def_readonly("ref_ns", &ClockEstimate::ref_ns)
+        .def_readonly("offset_ns", &ClockEstimate::offset_ns)
+        .def_readonly("drift", &ClockEstimate::drift)
+        .def_readonly("rtt_ns", &ClockEstimate::rtt_ns)
+        .def_readonly("exchanges", &ClockEstimate::exchanges)
+        .def("to_vehicle", &ClockEstimate::to_vehicle)
+        .def("to_host", &ClockEstimate::to_host);
+
+    // Create binding for link statistics:
+
+    py::class_<LinkStats>(m, "LinkStats")
+        .def_readonly("url", &LinkStats::url)
+        .def_readonly("connected", &LinkStats::connected)
+        .def_readonly("received", &LinkStats::received)
+        .def_readonly("delivered", &LinkStats::delivered)
+        .def_readonly("duplicates", &LinkStats::duplicates)
+        .def_readonly("missed", &LinkStats::missed)
+        .def_readonly("loss", &LinkStats::loss)
+        .def_readonly("lag_ns", &LinkStats::lag_ns)
+        .def_readonly("rtt_ns", &LinkStats::rtt_ns)
+        .def("__repr__", [](const LinkStats& stats) {
+            return "<LinkStats url=" + stats.url + " connected=" + (stats.connected ? "True" : "False") +
+                   " loss=" + std::to_string(stats.loss) + " lag_ns=" + std::to_string(stats.lag_ns) + ">";
+        });
+
+    // Create binding for field masks:
+    // (Compile once, then hand to get_data() or get_values() on each call)
+
+    py::class_<FieldMask>(m, "FieldMask")
+        .def(py::init(&field_mask), py::arg("names"))
+        .def_readonly("masks", &FieldMask::masks)
+        .def("__len__", [](const FieldMask& fields) { return fields.order.size(); });
+
+    m.def("compile_fields", &field_mask, py::arg("names"));
+
+    // Define stream indices:
+
+    m.attr("STREAM_POSITION") = static_cast<std::size_t>(STREAM_POSITION);
+    m.attr("STREAM_ANGULAR_VELOCITY") = static_cast<std::size_t>(STREAM_ANGULAR_VELOCITY);
+    m.attr("STREAM_VELOCITY_NED") = static_cast<std::size_t>(STREAM_VELOCITY_NED);
+    m.attr("STREAM_FIXEDWING_METRICS") = static_cast<std::size_t>(STREAM_FIXEDWING_METRICS);
+    m.attr("STREAM_IMU") = static_cast<std::size_t>(STREAM_IMU);
+    m.attr("STREAM_ATTITUDE") = static_cast<std::size_t>(STREAM_ATTITUDE);
+
+    // Define the names of each stream and their values,
+    // used to interpret the arrays returned by get_batch():
+
+    py::list stream_names;
+    py::list field_names;
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+
+        stream_names.append(STREAM_NAMES[i]);
+
+        py::list fields;
+
+        for (const char* name : FIELD_NAMES[i]) {
+            if (name != nullptr) {
+                fields.append(name);
+            }
+        }
+
+        field_names.append(py::tuple(fields));
+    }
+
+    m.attr("STREAM_NAMES") = py::tuple(stream_names);
+    m.attr("FIELD_NAMES") = py::tuple(field_names);
+
     // Create binding for DTStream class:
+    // (Blocking calls release the GIL, as MAVSDK threads may need it for callbacks)
+    // (Callbacks run on background threads, and take the GIL while they run)
 
-    py::class_<DTStream>(m, "DTStream")
+    py::class_<DTStream, std::unique_ptr<DTStream, StreamDeleter>>(m, "DTStream")
         .def(py::init<std::string>())
         .def(py::init())
-        .def("start", &DTStream::start)
-        .def("stop", &DTStream::stop)
-        .def("get_data", &DTStream::get_data)
+        .def("start", py::overload_cast<>(&DTStream::start), py::call_guard<py::gil_scoped_release>())
+        .def("start", py::overload_cast<std::chrono::milliseconds>(&DTStream::start), py::call_guard<py::gil_scoped_release>())
+        .def("start_async", &DTStream::start_async, py::call_guard<py::gil_scoped_release>())
+        .def("wait_connected", &DTStream::wait_connected, py::call_guard<py::gil_scoped_release>())
+        .def("stop", &DTStream::stop, py::call_guard<py::gil_scoped_release>())
+        .def("close", &close_stream)
+        .def("__enter__", [](DTStream& stream) -> DTStream& { return stream; }, py::return_value_policy::reference)
+        .def("__exit__", [](DTStream& stream, const py::args&) { close_stream(stream); })
+        .def("get_state", &DTStream::get_state)
+        .def("set_state_callback", &DTStream::set_state_callback)
+        .def("get_data", py::overload_cast<>(&DTStream::get_data), py::call_guard<py::gil_scoped_release>())
+        .def("get_data", py::overload_cast<const FieldMask&>(&DTStream::get_data), py::call_guard<py::gil_scoped_release>(), py::arg("fields"))
+        .def("get_data", [](DTStream& stream, const std::vector<std::string>& names) {
+            const FieldMask fields = field_mask(names);
+            const py::gil_scoped_release release;
+            return stream.get_data(fields); }, py::arg("fields"))
+        .def("get_values", &field_values, py::arg("fields"))
+        .def("get_batch", &frame_batch, py::arg("max_frames") = 4096, py::arg("timeout") = std::chrono::milliseconds(100))
+        .def("get_batch_json", &DTStream::get_batch_json, py::call_guard<py::gil_scoped_release>(), py::arg("max_frames") = 4096, py::arg("timeout") = std::chrono::milliseconds(100))
         .def("get_cstr", &DTStream::get_cstr)
         .def("set_cstr", &DTStream::set_cstr)
+        .def("add_cstr", &DTStream::add_cstr)
+        .def("get_cstrs", &DTStream::get_cstrs)
+        .def("get_link_stats", &DTStream::get_link_stats)
+        .def("get_fastest_link", &DTStream::get_fastest_link)
+        .def("get_dedup_window", &DTStream::get_dedup_window)
+        .def("set_dedup_window", &DTStream::set_dedup_window)
+        .def("get_ingest_mode", &DTStream::get_ingest_mode)
+        .def("set_ingest_mode", &DTStream::set_ingest_mode)
+        .def("get_health", &DTStream::get_health)
+        .def("get_rate", &DTStream::get_rate)
+        .def("get_expected_rate", &DTStream::get_expected_rate)
+        .def("set_expected_rate", &DTStream::set_expected_rate)
+        .def("set_health_callback", &DTStream::set_health_callback)
+        .def("get_auto_resubscribe", &DTStream::get_auto_resubscribe)
+        .def("set_auto_resubscribe", &DTStream::set_auto_resubscribe)
+        .def("set_local_frame", &DTStream::set_local_frame)
+        .def("disable_local_frame", &DTStream::disable_local_frame)
+        .def("local_frame_enabled", &DTStream::local_frame_enabled)
+        .def("get_worker_cpu", &DTStream::get_worker_cpu)
+        .def("set_worker_cpu", &DTStream::set_worker_cpu)
+        .def("get_worker_priority", &DTStream::get_worker_priority)
+        .def("set_worker_priority", &DTStream::set_worker_priority)
+        .def("get_clock_estimate", &DTStream::get_clock_estimate)
+        .def("get_timesync_interval", &DTStream::get_timesync_interval)
+        .def("set_timesync_interval", &DTStream::set_timesync_interval)
+        .def("add_statistic", &DTStream::add_statistic, py::arg("field"), py::arg("count"), py::arg("span") = std::chrono::milliseconds(0))
+        .def("remove_statistic", &DTStream::remove_statistic)
+        .def("get_statistics", py::overload_cast<const std::string&>(&DTStream::get_statistics), py::arg("field"))
+        .def("get_statistics", py::overload_cast<const std::string&, std::size_t>(&DTStream::get_statistics), py::arg("field"), py::arg("count"))
+        .def("get_statistics", py::overload_cast<const std::string&, std::chrono::milliseconds>(&DTStream::get_statistics), py::arg("field"), py::arg("span"))
+        .def("set_history", &DTStream::set_history, py::arg("stream"), py::arg("capacity"))
+        .def("get_history", &DTStream::get_history)
+        .def("get_range", &history_range, py::arg("stream"), py::arg("start_ns"), py::arg("stop_ns"))
+        .def("get_at", &history_at, py::arg("stream"), py::arg("time_ns"))
+        .def("get_overruns", &DTStream::get_overruns)
         .def("get_drop_rate", &DTStream::get_drop_rate)
         .def("set_drop_rate", &DTStream::set_drop_rate);
+
+    // Create binding for recorder:
+    // (Recordings are read with pdts.recording)
+
+    py::class_<Recorder>(m, "Recorder")
+        .def(py::init<std::string, std::size_t>(), py::arg("path"), py::arg("block_frames") = RECORD_BLOCK_FRAMES)
+        .def("record", &Recorder::record, py::call_guard<py::gil_scoped_release>(), py::arg("stream"), py::arg("max_frames") = 4096, py::arg("timeout") = std::chrono::milliseconds(100))
+        .def("flush", &Recorder::flush, py::call_guard<py::gil_scoped_release>())
+        .def("close", &Recorder::close, py::call_guard<py::gil_scoped_release>())
+        .def("get_bytes", &Recorder::get_bytes)
+        .def("get_frames", &Recorder::get_frames);
 }
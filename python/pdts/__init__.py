@@ -1,5 +1,63 @@
 from __future__ import annotations
 
-from ._pdts import __version__, DTStream
+from ._pdts import (
+    __version__,
+    ClockEstimate,
+    ConnectionState,
+    DTStream,
+    FieldMask,
+    IngestMode,
+    LinkStats,
+    LocalFrame,
+    Recorder,
+    StreamHealth,
+    WindowSummary,
+    STREAM_POSITION,
+    STREAM_ANGULAR_VELOCITY,
+    STREAM_VELOCITY_NED,
+    STREAM_FIXEDWING_METRICS,
+    STREAM_IMU,
+    STREAM_ATTITUDE,
+    STREAM_NAMES,
+    FIELD_NAMES,
+    TRACING,
+    compile_fields,
+    geodetic_simd,
+    host_time_ns,
+    lla_to_ecef,
+    lla_to_local,
+    trace_clear,
+    trace_flush,
+)
+from .recording import Recording
 
-__all__ = ["__version__", "DTStream"]
+__all__ = [
+    "__version__",
+    "ClockEstimate",
+    "ConnectionState",
+    "DTStream",
+    "FieldMask",
+    "IngestMode",
+    "LinkStats",
+    "LocalFrame",
+    "Recorder",
+    "Recording",
+    "StreamHealth",
+    "WindowSummary",
+    "STREAM_POSITION",
+    "STREAM_ANGULAR_VELOCITY",
+    "STREAM_VELOCITY_NED",
+    "STREAM_FIXEDWING_METRICS",
+    "STREAM_IMU",
+    "STREAM_ATTITUDE",
+    "STREAM_NAMES",
+    "FIELD_NAMES",
+    "TRACING",
+    "compile_fields",
+    "geodetic_simd",
+    "host_time_ns",
+    "lla_to_ecef",
+    "lla_to_local",
+    "trace_clear",
+    "trace_flush",
+]
@@ -0,0 +1,462 @@
+"""
+Decoder for compressed DTS recordings.
+
+This module reads recordings made by the C++ RecordWriter (see codec.hpp for the format).
+It is written in plain python (with numpy), so recordings can be analyzed
+on machines that do not have the compiled module or MAVSDK installed.
+
+Frames are returned in the same layout as DTStream.get_batch(),
+a dictionary of arrays:
+
+- stream - Index of the stream of each frame
+- recv_ns - Host receive time of each frame
+- timestamp_us - Autopilot timestamp of each frame
+- vehicle_ns - Synchronized autopilot time of each frame (if CLOCK_BIT is set in the mask)
+- sample_ns - Synchronized sample time of each frame (if CLOCK_BIT is set in the mask)
+- mask - Bitmask of the values present in each frame
+- values - 2D array of values, one row per frame
+
+Recordings that were cut short (say, the program died while writing) are read
+up to the last complete block, a block cut short is dropped.
+read_block() raises on damaged blocks, while the other readers skip them.
+A block whose frame count could not fit in its payload is damaged,
+and is left out of the index (an index with such a block is ignored, and the blocks are walked instead).
+This matches the C++ RecordReader.
+"""
+
+from __future__ import annotations
+
+import bisect
+import struct
+from typing import BinaryIO, Dict, List, NamedTuple, Optional, Union
+
+import numpy as np
+
+FILE_MAGIC = b"DTSR"
+BLOCK_MAGIC = b"BLK0"
+INDEX_MAGIC = b"IDX0"
+END_MAGIC = b"DTSE"
+
+RECORD_VERSION = 2
+TIMESTAMP_BIT = 1 << 15
+CLOCK_BIT = 1 << 14
+
+FILE_HEADER = 8
+BLOCK_HEADER = 32
+INDEX_ENTRY = 32
+TRAILER = 12
+
+# Sizes of delta of delta values, by number of leading ones in the prefix
+DOD_SIZES = (0, 7, 12, 20, 32, 64)
+
+MASK64 = (1 << 64) - 1
+
+
+class BlockInfo(NamedTuple):
+    """Describes a block in a recording"""
+
+    stream: int
+    mask: int
+    count: int
+    first_ns: int
+    last_ns: int
+    offset: int
+
+
+class BitReader:
+    """Reads bits from a byte buffer, most significant first"""
+
+    def __init__(self, data: bytes) -> None:
+        self.data = data + bytes(9)
+        self.size = len(data)
+        self.pos = 0
+
+    def read(self, count: int) -> int:
+        """Reads a number of bits (at most 64)"""
+
+        if count == 0:
+            return 0
+
+        byte = self.pos >> 3
+        offset = self.pos & 7
+
+        # Grab enough bytes to cover the bits, then cut them out:
+
+        chunk = int.from_bytes(self.data[byte:byte + 9], "big")
+        value = (chunk >> (72 - offset - count)) & ((1 << count) - 1)
+
+        self.pos += count
+
+        return value
+
+    def bit(self) -> int:
+        """Reads a single bit"""
+
+        return self.read(1)
+
+    def overrun(self) -> bool:
+        """Determines if we read past the end of the buffer"""
+
+        return self.pos > self.size * 8
+
+
+def _decode_dod(bits: BitReader, count: int) -> List[int]:
+    """Decodes a column of delta of delta encoded integers"""
+
+    prev = bits.read(64)
+    delta = 0
+    out = [prev]
+
+    for _ in range(1, count):
+
+        ones = 0
+
+        while ones < 5 and bits.bit():
+            ones += 1
+
+        zig = bits.read(DOD_SIZES[ones])
+        dod = (zig >> 1) ^ -(zig & 1)
+
+        delta = (delta + dod) & MASK64
+        prev = (prev + delta) & MASK64
+
+        out.append(prev)
+
+    return out
+
+
+def _decode_xor(bits: BitReader, count: int) -> List[int]:
+    """Decodes a column of XOR encoded values, as raw 64 bit patterns"""
+
+    prev = bits.read(64)
+    out = [prev]
+
+    lead = 0
+    trail = 0
+
+    for _ in range(1, count):
+
+        if bits.bit():
+
+            if bits.bit():
+
+                # New window:
+
+                lead = bits.read(5)
+                length = bits.read(6) + 1
+                trail = 64 - min(64, lead + length)
+
+            prev ^= bits.read(64 - lead - trail) << trail
+
+        out.append(prev)
+
+    return out
+
+
+def _fits_payload(count: int, mask: int, size: int, fields: int) -> bool:
+    """
+    Determines if a block payload could hold a number of frames.
+
+    Each column starts with a full 64 bit value, and each frame after the first
+    takes at least one bit per column.
+    We check this before allocating frames, so a damaged count can't make us
+    allocate far more frames than the block could possibly hold.
+    """
+
+    if count == 0:
+        return False
+
+    columns = 1 + (1 if mask & TIMESTAMP_BIT else 0) + (2 if mask & CLOCK_BIT else 0)
+    columns += sum(1 for slot in range(fields) if mask & (1 << slot))
+
+    bits = size * 8
+
+    return bits >= columns * 64 and (count - 1) * columns <= bits - columns * 64
+
+
+class Recording:
+    """
+    Reads a compressed DTS recording.
+
+    When opened, we load the index of the recording
+    (or rebuild it by walking the blocks if the recording was never closed).
+    Blocks can then be decoded individually, so only the parts of interest are read.
+    """
+
+    def __init__(self, source: Union[str, BinaryIO]) -> None:
+
+        if isinstance(source, str):
+            self.file: BinaryIO = open(source, "rb")  # noqa: SIM115
+            self._owned = True
+        else:
+            self.file = source
+            self._owned = False
+
+        header = self._read_at(0, FILE_HEADER)
+
+        if header[:4] != FILE_MAGIC:
+            raise ValueError("Not a DTS recording")
+
+        if header[4] == 0 or header[4] > RECORD_VERSION:
+            raise ValueError(f"Unsupported DTS recording version {header[4]}")
+
+        self.streams = header[5]
+        self.fields = header[6]
+
+        # Load the index, or rebuild it if the recording was never closed:
+
+        self.index: List[BlockInfo] = self._load_index()
+
+        if self.index is None:
+            self.index = self._scan_index()
+
+        # Group blocks by stream, for seeking:
+
+        self.stream_blocks: List[List[int]] = [[] for _ in range(self.streams)]
+
+        for i, info in enumerate(self.index):
+            if info.stream < self.streams:
+                self.stream_blocks[info.stream].append(i)
+
+    def __enter__(self) -> Recording:
+        return self
+
+    def __exit__(self, *args) -> None:
+        self.close()
+
+    def close(self) -> None:
+        """Closes the recording, if we opened it"""
+
+        if self._owned:
+            self.file.close()
+
+    def _read_at(self, offset: int, size: int) -> bytes:
+        """Reads bytes at an offset"""
+
+        self.file.seek(offset)
+
+        return self.file.read(size)
+
+    def _size(self) -> int:
+        """Gets the size of the recording"""
+
+        self.file.seek(0, 2)
+
+        return self.file.tell()
+
+    def _load_index(self) -> Optional[List[BlockInfo]]:
+        """Loads the index written at the end of the recording"""
+
+        end = self._size()
+
+        if end < FILE_HEADER + TRAILER:
+            return None
+
+        trailer = self._read_at(end - TRAILER, TRAILER)
+
+        if trailer[8:] != END_MAGIC:
+            return None
+
+        (offset,) = struct.unpack("<Q", trailer[:8])
+
+        if offset < FILE_HEADER or offset + 8 + TRAILER > end:
+            return None
+
+        data = self._read_at(offset, end - TRAILER - offset)
+
+        if data[:4] != INDEX_MAGIC:
+            return None
+
+        (count,) = struct.unpack("<I", data[4:8])
+
+        if 8 + count * INDEX_ENTRY != len(data):
+            return None
+
+        index = [BlockInfo(*struct.unpack_from("<BxHIqqQ", data, 8 + i * INDEX_ENTRY)) for i in range(count)]
+
+        # Blocks are written back to back, so each payload ends where the next block (or the index) starts.
+        # If any entry can't be right, we don't trust the index and walk the blocks instead:
+
+        for i, info in enumerate(index):
+
+            nxt = index[i + 1].offset if i + 1 < count else offset
+
+            if info.offset < FILE_HEADER or info.offset + BLOCK_HEADER > nxt:
+                return None
+
+            if not _fits_payload(info.count, info.mask, nxt - info.offset - BLOCK_HEADER, self.fields):
+                return None
+
+        return index
+
+    def _scan_index(self) -> List[BlockInfo]:
+        """Builds the index by walking all blocks, up to the first one that is not complete"""
+
+        index = []
+        offset = FILE_HEADER
+        end = self._size()
+
+        while True:
+
+            header = self._read_at(offset, BLOCK_HEADER)
+
+            if len(header) < BLOCK_HEADER or header[:4] != BLOCK_MAGIC:
+                break
+
+            stream, mask, count, first, last, size = struct.unpack("<BxHIqqI", header[4:])
+
+            # The last block may have been cut short:
+
+            if offset + BLOCK_HEADER + size > end:
+                break
+
+            # Leave out blocks with a damaged count, the size still takes us to the next block:
+
+            if _fits_payload(count, mask, size, self.fields):
+                index.append(BlockInfo(stream, mask, count, first, last, offset))
+
+            offset += BLOCK_HEADER + size
+
+        return index
+
+    def find_block(self, stream: int, recv_ns: int) -> int:
+        """
+        Finds the first block of a stream that contains frames at or after a time.
+
+        Returns the position of the block in the index,
+        or the size of the index if there is none.
+        """
+
+        blocks = self.stream_blocks[stream]
+        ends = [self.index[i].last_ns for i in blocks]
+        pos = bisect.bisect_left(ends, recv_ns)
+
+        return blocks[pos] if pos < len(blocks) else len(self.index)
+
+    def _decode(self, block: int) -> Dict[str, np.ndarray]:
+        """Decodes a block into arrays"""
+
+        info = self.index[block]
+        header = self._read_at(info.offset, BLOCK_HEADER)
+
+        if header[:4] != BLOCK_MAGIC:
+            raise ValueError(f"Block {block} is damaged")
+
+        (size,) = struct.unpack("<I", header[28:32])
+
+        # Make sure the count is plausible before allocating frames:
+
+        if not _fits_payload(info.count, info.mask, size, self.fields):
+            raise ValueError(f"Block {block} is damaged")
+
+        bits = BitReader(self.file.read(size))
+        count = info.count
+
+        recv = np.array(_decode_dod(bits, count), dtype=np.uint64).view(np.int64)
+        stamps = np.zeros(count, dtype=np.uint64)
+        vehicle = np.zeros(count, dtype=np.int64)
+        sample = np.zeros(count, dtype=np.int64)
+        values = np.zeros((count, self.fields), dtype=np.float64)
+
+        if info.mask & TIMESTAMP_BIT:
+            stamps[:] = np.array(_decode_dod(bits, count), dtype=np.uint64)
+
+        if info.mask & CLOCK_BIT:
+            vehicle[:] = np.array(_decode_dod(bits, count), dtype=np.uint64).view(np.int64)
+            sample[:] = np.array(_decode_dod(bits, count), dtype=np.uint64).view(np.int64)
+
+        for slot in range(self.fields):
+            if info.mask & (1 << slot):
+                values[:, slot] = np.array(_decode_xor(bits, count), dtype=np.uint64).view(np.float64)
+
+        if bits.overrun():
+            raise ValueError(f"Block {block} is damaged")
+
+        return {
+            "stream": np.full(count, info.stream, dtype=np.uint16),
+            "recv_ns": recv,
+            "timestamp_us": stamps,
+            "vehicle_ns": vehicle,
+            "sample_ns": sample,
+            "mask": np.full(count, info.mask, dtype=np.uint16),
+            "values": values,
+        }
+
+    @staticmethod
+    def _concat(parts: List[Dict[str, np.ndarray]], fields: int) -> Dict[str, np.ndarray]:
+        """Joins decoded blocks together"""
+
+        if not parts:
+            return {
+                "stream": np.zeros(0, dtype=np.uint16),
+                "recv_ns": np.zeros(0, dtype=np.int64),
+                "timestamp_us": np.zeros(0, dtype=np.uint64),
+                "vehicle_ns": np.zeros(0, dtype=np.int64),
+                "sample_ns": np.zeros(0, dtype=np.int64),
+                "mask": np.zeros(0, dtype=np.uint16),
+                "values": np.zeros((0, fields), dtype=np.float64),
+            }
+
+        return {key: np.concatenate([part[key] for part in parts]) for key in parts[0]}
+
+    def _decode_blocks(self, blocks: List[int]) -> List[Dict[str, np.ndarray]]:
+        """Decodes many blocks, skipping damaged ones"""
+
+        parts = []
+
+        for block in blocks:
+            try:
+                parts.append(self._decode(block))
+            except ValueError:
+                continue
+
+        return parts
+
+    def read_block(self, block: int) -> Dict[str, np.ndarray]:
+        """Decodes a single block, raises ValueError if it is damaged"""
+
+        return self._decode(block)
+
+    def read_range(self, stream: int, start_ns: int, stop_ns: int) -> Dict[str, np.ndarray]:
+        """
+        Decodes all frames of a stream received in a time range (inclusive).
+
+        We only decode the blocks that overlap the range.
+        """
+
+        blocks = self.stream_blocks[stream]
+        pos = bisect.bisect_left(blocks, self.find_block(stream, start_ns))
+        parts = []
+
+        for block in blocks[pos:]:
+
+            if self.index[block].first_ns > stop_ns:
+                break
+
+            try:
+                part = self._decode(block)
+            except ValueError:
+                continue
+
+            keep = (part["recv_ns"] >= start_ns) & (part["recv_ns"] <= stop_ns)
+            parts.append({key: val[keep] for key, val in part.items()})
+
+        return self._concat(parts, self.fields)
+
+    def read_stream(self, stream: int) -> Dict[str, np.ndarray]:
+        """Decodes all frames of a stream"""
+
+        return self._concat(self._decode_blocks(self.stream_blocks[stream]), self.fields)
+
+    def read_all(self) -> Dict[str, np.ndarray]:
+        """
+        Decodes all frames in the recording.
+
+        Frames are sorted by the time they were received
+        (frames received at the same time keep the order they appear in the recording).
+        """
+
+        data = self._concat(self._decode_blocks(list(range(len(self.index)))), self.fields)
+        order = np.argsort(data["recv_ns"], kind="stable")
+
+        return {key: val[order] for key, val in data.items()}
@@ -0,0 +1,265 @@
+/**
+ * @file clock_sync.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Implementations for clock synchronization
+ * @version 0.1
+ * @date 2024-12-14
+ *
+ * @copyright Copyright (c) 2024
+ */
+
+#include "clock_sync.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+int64_t ClockSync::make_request(int64_t host_ns) {
+
+    const std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->pending[this->pending_next] = host_ns;
+    this->pending_next = (this->pending_next + 1) % PENDING;
+
+    return host_ns;
+}
+
+bool ClockSync::add_response(int64_t ts1, int64_t tc1, int64_t host_ns) {
+
+    const std::lock_guard<std::mutex> lock(this->mutex);
+
+    // Only accept responses to our own requests:
+
+    auto iter = std::find(this->pending.begin(), this->pending.end(), ts1);
+
+    if (ts1 == 0 || iter == this->pending.end()) {
+        return false;
+    }
+
+    *iter = 0;
+
+    const int64_t rtt = host_ns - ts1;
+
+    if (rtt < 0 || rtt > this->max_rtt_ns || tc1 <= 0 || tc1 > this->max_vehicle_ns) {
+        return true;
+    }
+
+    const int64_t mid = ts1 + rtt / 2;
+
+    // If this is way off, the autopilot clock jumped, so start over:
+
+    if (this->estimate.valid && std::abs(tc1 - this->estimate.to_vehicle(mid)) > this->jump_ns) {
+        std::cerr << "Autopilot clock jumped, resynchronizing..." << '\n';
+        this->clear();
+    }
+
+    this->exchanges[this->exchange_next] = Exchange{mid, tc1, rtt};
+    this->exchange_next = (this->exchange_next + 1) % EXCHANGES;
+    this->exchange_count = std::min(this->exchange_count + 1, EXCHANGES);
+
+    this->fit_exchanges();
+    this->update_estimate();
+
+    return true;
+}
+
+void ClockSync::add_receive(int64_t vehicle_ns, int64_t host_ns) {
+
+    if (vehicle_ns <= 0 || vehicle_ns > this->max_vehicle_ns) {
+        return;
+    }
+
+    const std::lock_guard<std::mutex> lock(this->mutex);
+
+    const int64_t bound = vehicle_ns - host_ns;
+
+    // If this frame arrived long before it was sampled, or long after,
+    // the autopilot clock jumped, so start over:
+
+    if (this->estimate.valid) {
+
+        const int64_t expected = this->estimate.to_vehicle(host_ns) - host_ns;
+
+        if (bound > expected + this->jump_ns || bound < expected - this->jump_ns) {
+            std::cerr << "Autopilot clock jumped, resynchronizing..." << '\n';
+            this->clear();
+        }
+    }
+
+    // Keep the highest bound of each period:
+
+    const int64_t period = host_ns / this->bound_period_ns;
+
+    Bound& current = this->bounds[this->bound_current];
+
+    if (this->bound_count > 0 && current.period == period) {
+
+        if (bound <= current.offset_ns) {
+            return;
+        }
+
+        current.host_ns = host_ns;
+        current.offset_ns = bound;
+
+    } else {
+
+        if (this->bound_count > 0) {
+            this->bound_current = (this->bound_current + 1) % BOUNDS;
+        }
+
+        this->bounds[this->bound_current] = Bound{period, host_ns, bound};
+        this->bound_count = std::min(this->bound_count + 1, BOUNDS);
+    }
+
+    this->update_estimate();
+}
+
+void ClockSync::fit_exchanges() {
+
+    this->exchange_estimate = ClockEstimate();
+
+    if (this->exchange_count == 0) {
+        return;
+    }
+
+    // Only use exchanges with a short round trip:
+
+    int64_t min_rtt = std::numeric_limits<int64_t>::max();
+
+    for (std::size_t i = 0; i < this->exchange_count; ++i) {
+        min_rtt = std::min(min_rtt, this->exchanges[i].rtt_ns);
+    }
+
+    const int64_t limit = min_rtt + std::max<int64_t>(min_rtt, 1000000);
+
+    // Everything is relative to the newest exchange, to keep the numbers small:
+
+    const Exchange& newest = this->exchanges[(this->exchange_next + EXCHANGES - 1) % EXCHANGES];
+
+    const int64_t ref = newest.host_ns;
+    const int64_t base = newest.vehicle_ns - newest.host_ns;
+
+    double sum_x = 0;
+    double sum_y = 0;
+    double sum_xx = 0;
+    double sum_xy = 0;
+    double min_x = 0;
+    double max_x = 0;
+    std::size_t num = 0;
+
+    for (std::size_t i = 0; i < this->exchange_count; ++i) {
+
+        const Exchange& exc = this->exchanges[i];
+
+        if (exc.rtt_ns > limit) {
+            continue;
+        }
+
+        const auto x = static_cast<double>(exc.host_ns - ref);
+        const auto y = static_cast<double>(exc.vehicle_ns - exc.host_ns - base);
+
+        sum_x += x;
+        sum_y += y;
+        sum_xx += x * x;
+        sum_xy += x * y;
+        min_x = num == 0 ? x : std::min(min_x, x);
+        max_x = num == 0 ? x : std::max(max_x, x);
+        ++num;
+    }
+
+    const double count = static_cast<double>(num);
+    const double mean_x = sum_x / count;
+    const double mean_y = sum_y / count;
+
+    // Only estimate drift once the exchanges cover enough time:
+
+    double drift = 0;
+
+    if (num >= 3 && max_x - min_x >= static_cast<double>(this->drift_span_ns)) {
+
+        const double var_x = sum_xx - count * mean_x * mean_x;
+
+        if (var_x > 0) {
+            drift = std::clamp((sum_xy - count * mean_x * mean_y) / var_x, -this->max_drift, this->max_drift);
+        }
+    }
+
+    this->exchange_estimate.valid = true;
+    this->exchange_estimate.ref_ns = ref;
+    this->exchange_estimate.offset_ns = base + std::llround(mean_y - drift * mean_x);
+    this->exchange_estimate.drift = drift;
+    this->exchange_estimate.rtt_ns = min_rtt;
+    this->exchange_estimate.exchanges = num;
+}
+
+void ClockSync::update_estimate() {
+
+    if (this->exchange_estimate.valid) {
+
+        // Frames can't arrive before they were sampled,
+        // so raise the offset if any bound says it is too low:
+
+        ClockEstimate est = this->exchange_estimate;
+
+        int64_t raise = 0;
+
+        for (std::size_t i = 0; i < this->bound_count; ++i) {
+
+            const Bound& bound = this->bounds[i];
+
+            raise = std::max(raise, bound.offset_ns - (est.to_vehicle(bound.host_ns) - bound.host_ns));
+        }
+
+        est.offset_ns += raise;
+
+        this->estimate = est;
+
+        return;
+    }
+
+    if (this->bound_count == 0) {
+        this->estimate = ClockEstimate();
+        return;
+    }
+
+    // No exchanges, so the highest bound is the best we can do:
+
+    ClockEstimate est;
+
+    const Bound& current = this->bounds[this->bound_current];
+
+    est.valid = true;
+    est.ref_ns = current.host_ns;
+    est.offset_ns = current.offset_ns;
+
+    for (std::size_t i = 0; i < this->bound_count; ++i) {
+        est.offset_ns = std::max(est.offset_ns, this->bounds[i].offset_ns);
+    }
+
+    this->estimate = est;
+}
+
+ClockEstimate ClockSync::get_estimate() const {
+
+    const std::lock_guard<std::mutex> lock(this->mutex);
+
+    return this->estimate;
+}
+
+void ClockSync::clear() {
+
+    this->exchange_count = 0;
+    this->exchange_next = 0;
+    this->bound_count = 0;
+    this->bound_current = 0;
+    this->exchange_estimate = ClockEstimate();
+    this->estimate = ClockEstimate();
+}
+
+void ClockSync::reset() {
+
+    const std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->clear();
+    this->pending.fill(0);
+}
@@ -0,0 +1,963 @@
+/**
+ * @file codec.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Implementations for compressed recordings
+ * @version 0.1
+ * @date 2024-11-30
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file implements the recording writer and reader.
+ * Bits are written most significant first.
+ *
+ * Integer columns (receive, autopilot and synchronized times) store the first value as is,
+ * followed by the difference between consecutive deltas.
+ * As samples usually arrive at a steady rate, this is often zero or very small.
+ * Each difference is zigzag encoded and stored with a prefix that determines its size:
+ *
+ * - '0' - zero
+ * - '10' - 7 bits
+ * - '110' - 12 bits
+ * - '1110' - 20 bits
+ * - '11110' - 32 bits
+ * - '11111' - 64 bits
+ *
+ * Receive times are in nanoseconds, so jitter usually lands in the 20 bit bucket.
+ *
+ * Value columns store the first value as is, followed by the XOR of each value with the previous one:
+ *
+ * - '0' - values are identical
+ * - '10' - meaningful bits fit in the previous window, followed by those bits
+ * - '11' - 5 bits of leading zeros, 6 bits of length (minus one), followed by the meaningful bits
+ */
+
+#include "codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+/// Magic at the start of a recording
+constexpr std::array<uint8_t, 4> FILE_MAGIC = {'D', 'T', 'S', 'R'};
+
+/// Magic at the start of each block
+constexpr std::array<uint8_t, 4> BLOCK_MAGIC = {'B', 'L', 'K', '0'};
+
+/// Magic at the start of the index
+constexpr std::array<uint8_t, 4> INDEX_MAGIC = {'I', 'D', 'X', '0'};
+
+/// Magic at the end of a closed recording
+constexpr std::array<uint8_t, 4> END_MAGIC = {'D', 'T', 'S', 'E'};
+
+/// Size of the recording header
+constexpr std::size_t FILE_HEADER = 8;
+
+/// Size of a block header
+constexpr std::size_t BLOCK_HEADER = 32;
+
+/// Largest encoded size of a frame in bytes
+/// (Four time columns of at most 5 + 64 bits, and values of at most 2 + 5 + 6 + 64 bits)
+constexpr std::size_t MAX_FRAME_BYTES = (4 * (5 + 64) + FRAME_FIELDS * (2 + 5 + 6 + 64) + 7) / 8;
+
+/// Size of an index entry
+constexpr std::size_t INDEX_ENTRY = 32;
+
+/// Size of the trailer
+constexpr std::size_t TRAILER = 12;
+
+/**
+ * @brief Writes bits into a byte buffer
+ */
+class BitWriter {
+private:
+
+    /// Buffer we write to
+    std::vector<uint8_t>& out;
+
+    /// Bits that do not fill a byte yet
+    uint64_t acc = 0;
+
+    /// Number of bits in the accumulator
+    unsigned int bits = 0;
+
+public:
+
+    explicit BitWriter(std::vector<uint8_t>& buffer) : out(buffer) {}
+
+    /**
+     * @brief Writes the lowest bits of a value
+     *
+     * @param value Value to write
+     * @param count Number of bits to write, at most 64
+     */
+    void write(uint64_t value, unsigned int count) {
+
+        if (count > 32) {
+            this->write(value >> 32, count - 32);
+            count = 32;
+        }
+
+        if (count == 0) {
+            return;
+        }
+
+        this->acc = (this->acc << count) | (value & ((uint64_t{1} << count) - 1));
+        this->bits += count;
+
+        while (this->bits >= 8) {
+            this->bits -= 8;
+            this->out.push_back(static_cast<uint8_t>(this->acc >> this->bits));
+        }
+
+        this->acc &= (uint64_t{1} << this->bits) - 1;
+    }
+
+    /**
+     * @brief Pads the last byte with zeros
+     */
+    void finish() {
+
+        if (this->bits > 0) {
+            this->out.push_back(static_cast<uint8_t>(this->acc << (8 - this->bits)));
+        }
+
+        this->acc = 0;
+        this->bits = 0;
+    }
+};
+
+/**
+ * @brief Reads bits from a byte buffer
+ *
+ * Reading past the end yields zeros and marks the reader as overrun,
+ * so damaged blocks can be detected after decoding.
+ */
+class BitReader {
+private:
+
+    /// Buffer we read from
+    const uint8_t* data;
+
+    /// Size of the buffer in bytes
+    std::size_t size;
+
+    /// Position of the next bit
+    std::size_t pos = 0;
+
+public:
+
+    BitReader(const uint8_t* buffer, std::size_t length) : data(buffer), size(length) {}
+
+    /**
+     * @brief Reads a number of bits
+     *
+     * @param count Number of bits to read, at most 64
+     * @return uint64_t Bits read
+     */
+    uint64_t read(unsigned int count) {
+
+        uint64_t value = 0;
+
+        // Take as many bits as we can from each byte:
+
+        while (count > 0) {
+
+            const std::size_t byte = this->pos >> 3;
+            const unsigned int avail = 8 - static_cast<unsigned int>(this->pos & 7);
+            const unsigned int take = std::min(avail, count);
+
+            uint64_t chunk = 0;
+
+            if (byte < this->size) {
+                chunk = (static_cast<uint64_t>(this->data[byte]) >> (avail - take)) & ((1U << take) - 1);
+            }
+
+            value = (value << take) | chunk;
+            this->pos += take;
+            count -= take;
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Reads a single bit
+     *
+     * @return bool Value of the bit
+     */
+    bool bit() { return this->read(1) != 0; }
+
+    /**
+     * @brief Determines if we read past the end of the buffer
+     *
+     * @return bool true if overrun
+     */
+    bool overrun() const { return this->pos > this->size * 8; }
+};
+
+/// Writes an integer in little endian
+template<typename T>
+void put_le(std::vector<uint8_t>& out, T value) {
+
+    const auto raw = static_cast<uint64_t>(value);
+
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out.push_back(static_cast<uint8_t>(raw >> (8 * i)));
+    }
+}
+
+/// Writes an integer in little endian into a buffer that is large enough
+template<typename T>
+void put_le(uint8_t* out, T value) {
+
+    const auto raw = static_cast<uint64_t>(value);
+
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        out[i] = static_cast<uint8_t>(raw >> (8 * i));
+    }
+}
+
+/// Reads an integer in little endian
+template<typename T>
+T get_le(const uint8_t* data) {
+
+    uint64_t raw = 0;
+
+    for (std::size_t i = 0; i < sizeof(T); ++i) {
+        raw |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+
+    return static_cast<T>(raw);
+}
+
+/**
+ * @brief Determines if a block payload could hold a number of frames
+ *
+ * Each column starts with a full 64 bit value, and each frame after the first
+ * takes at least one bit per column.
+ * We check this before allocating frames, so a damaged count can't make us
+ * allocate (and decode) far more frames than the block could possibly hold.
+ *
+ * @param count Number of frames in the block
+ * @param mask Mask of the block
+ * @param size Size of the payload in bytes
+ * @return bool true if plausible, false if the block is damaged
+ */
+bool fits_payload(uint32_t count, uint16_t mask, uint64_t size) {
+
+    if (count == 0) {
+        return false;
+    }
+
+    uint64_t columns = 1 + ((mask & TIMESTAMP_BIT) != 0 ? 1 : 0) + ((mask & CLOCK_BIT) != 0 ? 2 : 0);
+
+    for (std::size_t slot = 0; slot < FRAME_FIELDS; ++slot) {
+        columns += (mask >> slot) & 1U;
+    }
+
+    const uint64_t bits = size * 8;
+
+    return bits >= columns * 64 && static_cast<uint64_t>(count - 1) * columns <= bits - columns * 64;
+}
+
+/// Number of leading zeros in a non-zero value
+unsigned int leading_zeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned int>(__builtin_clzll(value));
+#else
+    unsigned int count = 0;
+    while ((value & (uint64_t{1} << 63)) == 0) {
+        value <<= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+/// Number of trailing zeros in a non-zero value
+unsigned int trailing_zeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned int>(__builtin_ctzll(value));
+#else
+    unsigned int count = 0;
+    while ((value & 1U) == 0) {
+        value >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+/**
+ * @brief Encodes a column of integers using delta of delta encoding
+ *
+ * @tparam Getter Callable that returns the value of a frame as uint64_t
+ * @param bits Writer to utilize
+ * @param frames Frames to encode
+ * @param get Getter for the column value
+ */
+template<typename Getter>
+void encode_dod(BitWriter& bits, const std::vector<Frame>& frames, Getter get) {
+
+    uint64_t prev = get(frames[0]);
+    uint64_t prev_delta = 0;
+
+    bits.write(prev, 64);
+
+    for (std::size_t i = 1; i < frames.size(); ++i) {
+
+        // Arithmetic is done unsigned, so wrapping is well defined:
+
+        const uint64_t value = get(frames[i]);
+        const uint64_t delta = value - prev;
+        const auto dod = static_cast<int64_t>(delta - prev_delta);
+
+        prev = value;
+        prev_delta = delta;
+
+        // Zigzag encode, so small negative values stay small:
+
+        const uint64_t zig = (static_cast<uint64_t>(dod) << 1) ^ static_cast<uint64_t>(dod >> 63);
+
+        if (zig == 0) {
+            bits.write(0b0, 1);
+        } else if (zig < (uint64_t{1} << 7)) {
+            bits.write(0b10, 2);
+            bits.write(zig, 7);
+        } else if (zig < (uint64_t{1} << 12)) {
+            bits.write(0b110, 3);
+            bits.write(zig, 12);
+        } else if (zig < (uint64_t{1} << 20)) {
+            bits.write(0b1110, 4);
+            bits.write(zig, 20);
+        } else if (zig < (uint64_t{1} << 32)) {
+            bits.write(0b11110, 5);
+            bits.write(zig, 32);
+        } else {
+            bits.write(0b11111, 5);
+            bits.write(zig, 64);
+        }
+    }
+}
+
+/**
+ * @brief Decodes a column of integers encoded by encode_dod()
+ *
+ * @tparam Setter Callable that stores a uint64_t value into a frame
+ * @param bits Reader to utilize
+ * @param frames Frames to fill
+ * @param set Setter for the column value
+ */
+template<typename Setter>
+void decode_dod(BitReader& bits, Frame* frames, std::size_t count, Setter set) {
+
+    uint64_t prev = bits.read(64);
+    uint64_t prev_delta = 0;
+
+    set(frames[0], prev);
+
+    for (std::size_t i = 1; i < count; ++i) {
+
+        // Determine the size of the value from the prefix:
+
+        unsigned int ones = 0;
+
+        while (ones < 5 && bits.bit()) {
+            ++ones;
+        }
+
+        static constexpr std::array<unsigned int, 6> SIZES = {0, 7, 12, 20, 32, 64};
+
+        const uint64_t zig = bits.read(SIZES[ones]);
+        const uint64_t dod = (zig >> 1) ^ (~(zig & 1U) + 1);
+
+        prev_delta += dod;
+        prev += prev_delta;
+
+        set(frames[i], prev);
+    }
+}
+
+/**
+ * @brief Encodes a column of values using XOR encoding
+ *
+ * @param bits Writer to utilize
+ * @param frames Frames to encode
+ * @param slot Slot of the value in each frame
+ */
+void encode_xor(BitWriter& bits, const std::vector<Frame>& frames, std::size_t slot) {
+
+    uint64_t prev = 0;
+    std::memcpy(&prev, &frames[0].values[slot], sizeof(prev));
+
+    bits.write(prev, 64);
+
+    // Window of meaningful bits used by the previous value, starts out invalid:
+
+    unsigned int prev_lead = 64;
+    unsigned int prev_trail = 64;
+
+    for (std::size_t i = 1; i < frames.size(); ++i) {
+
+        uint64_t value = 0;
+        std::memcpy(&value, &frames[i].values[slot], sizeof(value));
+
+        const uint64_t diff = value ^ prev;
+        prev = value;
+
+        if (diff == 0) {
+            bits.write(0b0, 1);
+            continue;
+        }
+
+        // Leading zeros are capped, as we only have 5 bits to store them:
+
+        const unsigned int lead = std::min(leading_zeros(diff), 31U);
+        const unsigned int trail = trailing_zeros(diff);
+
+        if (prev_lead + prev_trail < 64 && lead >= prev_lead && trail >= prev_trail) {
+
+            // Meaningful bits fit in the previous window:
+
+            bits.write(0b10, 2);
+            bits.write(diff >> prev_trail, 64 - prev_lead - prev_trail);
+            continue;
+        }
+
+        // Start a new window:
+
+        const unsigned int length = 64 - lead - trail;
+
+        bits.write(0b11, 2);
+        bits.write(lead, 5);
+        bits.write(length - 1, 6);
+        bits.write(diff >> trail, length);
+
+        prev_lead = lead;
+        prev_trail = trail;
+    }
+}
+
+/**
+ * @brief Decodes a column of values encoded by encode_xor()
+ *
+ * @param bits Reader to utilize
+ * @param frames Frames to fill
+ * @param count Number of frames
+ * @param slot Slot of the value in each frame
+ */
+void decode_xor(BitReader& bits, Frame* frames, std::size_t count, std::size_t slot) {
+
+    uint64_t prev = bits.read(64);
+    std::memcpy(&frames[0].values[slot], &prev, sizeof(prev));
+
+    unsigned int lead = 0;
+    unsigned int trail = 0;
+
+    for (std::size_t i = 1; i < count; ++i) {
+
+        if (bits.bit()) {
+
+            if (bits.bit()) {
+
+                // New window:
+
+                lead = static_cast<unsigned int>(bits.read(5));
+                const auto length = static_cast<unsigned int>(bits.read(6)) + 1;
+                trail = 64 - std::min(64U, lead + length);
+            }
+
+            prev ^= bits.read(64 - lead - trail) << trail;
+        }
+
+        std::memcpy(&frames[i].values[slot], &prev, sizeof(prev));
+    }
+}
+
+}  // namespace
+
+RecordWriter::RecordWriter(std::ostream& output, std::size_t block) : out(output), block_frames(std::max<std::size_t>(block, 1)) {
+
+    // Allocate block buffers up front:
+
+    for (Pending& pend : this->pending) {
+        pend.frames.reserve(this->block_frames);
+    }
+
+    // (Large enough for the worst case, plus the last partial byte)
+
+    this->scratch.reserve(BLOCK_HEADER + this->block_frames * MAX_FRAME_BYTES + 1);
+
+    // Write the recording header:
+
+    const std::array<uint8_t, FILE_HEADER> header = {FILE_MAGIC[0], FILE_MAGIC[1], FILE_MAGIC[2], FILE_MAGIC[3],
+                                                     RECORD_VERSION, static_cast<uint8_t>(STREAMS), static_cast<uint8_t>(FRAME_FIELDS), 0};
+
+    this->write_bytes(header.data(), header.size());
+}
+
+RecordWriter::~RecordWriter() {
+    this->close();
+}
+
+void RecordWriter::write_bytes(const uint8_t* data, std::size_t size) {
+
+    this->out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+    this->position += size;
+}
+
+void RecordWriter::write(const Frame& frame) {
+
+    if (this->closed || frame.stream >= STREAMS) {
+        return;
+    }
+
+    Pending& pend = this->pending[frame.stream];
+
+    // Frames in a block must share a mask, start a new block if it changes:
+
+    if (!pend.frames.empty() && pend.mask != frame.mask) {
+        this->write_block(frame.stream);
+    }
+
+    pend.mask = frame.mask;
+    pend.frames.push_back(frame);
+
+    if (pend.frames.size() >= this->block_frames) {
+        this->write_block(frame.stream);
+    }
+}
+
+void RecordWriter::write(const std::vector<Frame>& frames) {
+
+    for (const Frame& frame : frames) {
+        this->write(frame);
+    }
+}
+
+void RecordWriter::write_block(std::size_t stream) {
+
+    Pending& pend = this->pending[stream];
+
+    if (pend.frames.empty()) {
+        return;
+    }
+
+    // Encode the payload after room for the header:
+
+    this->scratch.assign(BLOCK_HEADER, 0);
+
+    BitWriter bits(this->scratch);
+
+    encode_dod(bits, pend.frames, [](const Frame& frame) { return static_cast<uint64_t>(frame.recv_ns); });
+
+    if ((pend.mask & TIMESTAMP_BIT) != 0) {
+        encode_dod(bits, pend.frames, [](const Frame& frame) { return frame.timestamp_us; });
+    }
+
+    if ((pend.mask & CLOCK_BIT) != 0) {
+        encode_dod(bits, pend.frames, [](const Frame& frame) { return static_cast<uint64_t>(frame.vehicle_ns); });
+        encode_dod(bits, pend.frames, [](const Frame& frame) { return static_cast<uint64_t>(frame.sample_ns); });
+    }
+
+    for (std::size_t slot = 0; slot < FRAME_FIELDS; ++slot) {
+        if ((pend.mask & (1U << slot)) != 0) {
+            encode_xor(bits, pend.frames, slot);
+        }
+    }
+
+    bits.finish();
+
+    // Now that we know the payload size, fill in the header:
+
+    BlockInfo info;
+
+    info.stream = static_cast<uint16_t>(stream);
+    info.mask = pend.mask;
+    info.count = static_cast<uint32_t>(pend.frames.size());
+    info.first_ns = pend.frames.front().recv_ns;
+    info.last_ns = pend.frames.back().recv_ns;
+    info.offset = this->position;
+
+    uint8_t* header = this->scratch.data();
+
+    std::copy(BLOCK_MAGIC.begin(), BLOCK_MAGIC.end(), header);
+
+    header[4] = static_cast<uint8_t>(info.stream);
+    header[5] = 0;
+    put_le<uint16_t>(header + 6, info.mask);
+    put_le<uint32_t>(header + 8, info.count);
+    put_le<int64_t>(header + 12, info.first_ns);
+    put_le<int64_t>(header + 20, info.last_ns);
+    put_le<uint32_t>(header + 28, static_cast<uint32_t>(this->scratch.size() - BLOCK_HEADER));
+
+    this->write_bytes(this->scratch.data(), this->scratch.size());
+
+    this->index.push_back(info);
+    this->frames += info.count;
+
+    pend.frames.clear();
+}
+
+void RecordWriter::flush() {
+
+    if (this->closed) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        this->write_block(i);
+    }
+
+    this->out.flush();
+}
+
+void RecordWriter::close() {
+
+    if (this->closed) {
+        return;
+    }
+
+    this->flush();
+
+    // Write the index:
+
+    const uint64_t index_offset = this->position;
+
+    std::vector<uint8_t> data(INDEX_MAGIC.begin(), INDEX_MAGIC.end());
+
+    put_le<uint32_t>(data, static_cast<uint32_t>(this->index.size()));
+
+    for (const BlockInfo& info : this->index) {
+        data.push_back(static_cast<uint8_t>(info.stream));
+        data.push_back(0);
+        put_le<uint16_t>(data, info.mask);
+        put_le<uint32_t>(data, info.count);
+        put_le<int64_t>(data, info.first_ns);
+        put_le<int64_t>(data, info.last_ns);
+        put_le<uint64_t>(data, info.offset);
+    }
+
+    // Write the trailer, so readers can find the index:
+
+    put_le<uint64_t>(data, index_offset);
+    data.insert(data.end(), END_MAGIC.begin(), END_MAGIC.end());
+
+    this->write_bytes(data.data(), data.size());
+
+    this->out.flush();
+
+    this->closed = true;
+}
+
+RecordReader::RecordReader(std::istream& input) : in(input) {
+
+    // Check the recording header:
+
+    std::array<uint8_t, FILE_HEADER> header{};
+
+    this->in.seekg(0, std::ios::beg);
+    this->in.read(reinterpret_cast<char*>(header.data()), header.size());  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+    if (!this->in || !std::equal(FILE_MAGIC.begin(), FILE_MAGIC.end(), header.begin())) {
+        std::cerr << "Not a DTS recording" << '\n';
+        return;
+    }
+
+    if (header[4] == 0 || header[4] > RECORD_VERSION || header[5] != STREAMS || header[6] != FRAME_FIELDS) {
+        std::cerr << "Unsupported DTS recording version " << static_cast<int>(header[4]) << '\n';
+        return;
+    }
+
+    // Load the index, or rebuild it if the recording was never closed:
+
+    if (!this->load_index()) {
+        this->scan_index();
+    }
+
+    // Group blocks by stream, for seeking:
+
+    for (std::size_t i = 0; i < this->index.size(); ++i) {
+        if (this->index[i].stream < STREAMS) {
+            this->stream_blocks[this->index[i].stream].push_back(i);
+        }
+    }
+
+    this->valid = true;
+}
+
+bool RecordReader::load_index() {
+
+    this->in.clear();
+    this->in.seekg(0, std::ios::end);
+
+    const auto end = static_cast<uint64_t>(this->in.tellg());
+
+    if (end < FILE_HEADER + TRAILER) {
+        return false;
+    }
+
+    std::array<uint8_t, TRAILER> trailer{};
+
+    this->in.seekg(static_cast<std::streamoff>(end - TRAILER), std::ios::beg);
+    this->in.read(reinterpret_cast<char*>(trailer.data()), trailer.size());  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+    if (!this->in || !std::equal(END_MAGIC.begin(), END_MAGIC.end(), trailer.begin() + 8)) {
+        return false;
+    }
+
+    const auto offset = get_le<uint64_t>(trailer.data());
+
+    if (offset < FILE_HEADER || offset + 8 + TRAILER > end) {
+        return false;
+    }
+
+    // Read the whole index at once:
+
+    this->scratch.resize(end - TRAILER - offset);
+
+    this->in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    this->in.read(reinterpret_cast<char*>(this->scratch.data()), static_cast<std::streamsize>(this->scratch.size()));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+    if (!this->in || !std::equal(INDEX_MAGIC.begin(), INDEX_MAGIC.end(), this->scratch.begin())) {
+        return false;
+    }
+
+    const auto count = get_le<uint32_t>(this->scratch.data() + 4);
+
+    if (8 + static_cast<uint64_t>(count) * INDEX_ENTRY != this->scratch.size()) {
+        return false;
+    }
+
+    this->index.resize(count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+
+        const uint8_t* entry = this->scratch.data() + 8 + i * INDEX_ENTRY;
+        BlockInfo& info = this->index[i];
+
+        info.stream = entry[0];
+        info.mask = get_le<uint16_t>(entry + 2);
+        info.count = get_le<uint32_t>(entry + 4);
+        info.first_ns = get_le<int64_t>(entry + 8);
+        info.last_ns = get_le<int64_t>(entry + 16);
+        info.offset = get_le<uint64_t>(entry + 24);
+    }
+
+    // Blocks are written back to back, so each payload ends where the next block (or the index) starts.
+    // If any entry can't be right, we don't trust the index and walk the blocks instead:
+
+    for (std::size_t i = 0; i < count; ++i) {
+
+        const BlockInfo& info = this->index[i];
+        const uint64_t next = i + 1 < count ? this->index[i + 1].offset : offset;
+
+        if (info.offset < FILE_HEADER || info.offset + BLOCK_HEADER > next || !fits_payload(info.count, info.mask, next - info.offset - BLOCK_HEADER)) {
+            this->index.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void RecordReader::scan_index() {
+
+    this->index.clear();
+    this->in.clear();
+
+    this->in.seekg(0, std::ios::end);
+
+    const auto end = static_cast<uint64_t>(this->in.tellg());
+
+    uint64_t offset = FILE_HEADER;
+
+    // Walk the blocks until we hit something that is not a complete block:
+
+    while (true) {
+
+        std::array<uint8_t, BLOCK_HEADER> header{};
+
+        this->in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+        this->in.read(reinterpret_cast<char*>(header.data()), header.size());  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+        if (!this->in || !std::equal(BLOCK_MAGIC.begin(), BLOCK_MAGIC.end(), header.begin())) {
+            break;
+        }
+
+        const uint64_t size = get_le<uint32_t>(header.data() + 28);
+
+        // The last block may have been cut short:
+
+        if (offset + BLOCK_HEADER + size > end) {
+            break;
+        }
+
+        BlockInfo info;
+
+        info.stream = header[4];
+        info.mask = get_le<uint16_t>(header.data() + 6);
+        info.count = get_le<uint32_t>(header.data() + 8);
+        info.first_ns = get_le<int64_t>(header.data() + 12);
+        info.last_ns = get_le<int64_t>(header.data() + 20);
+        info.offset = offset;
+
+        // Leave out blocks with a damaged count, the size still takes us to the next block:
+
+        if (fits_payload(info.count, info.mask, size)) {
+            this->index.push_back(info);
+        }
+
+        offset += BLOCK_HEADER + size;
+    }
+
+    this->in.clear();
+}
+
+std::size_t RecordReader::find_block(std::size_t stream, int64_t recv_ns) const {
+
+    if (stream >= STREAMS) {
+        return this->index.size();
+    }
+
+    // Blocks of a stream are in order, so we can binary search on their end times:
+
+    const std::vector<std::size_t>& blocks = this->stream_blocks[stream];
+
+    auto iter = std::lower_bound(blocks.begin(), blocks.end(), recv_ns, [this](std::size_t block, int64_t time) { return this->index[block].last_ns < time; });
+
+    return iter == blocks.end() ? this->index.size() : *iter;
+}
+
+bool RecordReader::read_block(std::size_t block, std::vector<Frame>& out) {
+
+    if (!this->valid || block >= this->index.size()) {
+        return false;
+    }
+
+    const BlockInfo& info = this->index[block];
+
+    // Read the header again, we need the payload size:
+
+    std::array<uint8_t, BLOCK_HEADER> header{};
+
+    this->in.clear();
+    this->in.seekg(static_cast<std::streamoff>(info.offset), std::ios::beg);
+    this->in.read(reinterpret_cast<char*>(header.data()), header.size());  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+    if (!this->in || !std::equal(BLOCK_MAGIC.begin(), BLOCK_MAGIC.end(), header.begin()) || info.stream >= STREAMS) {
+        return false;
+    }
+
+    const uint32_t size = get_le<uint32_t>(header.data() + 28);
+
+    // Make sure the count is plausible before allocating frames:
+
+    if (!fits_payload(info.count, info.mask, size)) {
+        return false;
+    }
+
+    this->scratch.resize(size);
+    this->in.read(reinterpret_cast<char*>(this->scratch.data()), static_cast<std::streamsize>(this->scratch.size()));  // NOLINT(cppcoreguidelines-pro-type-reinterpret-cast)
+
+    if (!this->in) {
+        return false;
+    }
+
+    // Decode the columns in place:
+
+    const std::size_t begin = out.size();
+
+    Frame blank;
+
+    blank.stream = info.stream;
+    blank.mask = info.mask;
+
+    out.resize(begin + info.count, blank);
+
+    Frame* frames = out.data() + begin;
+
+    BitReader bits(this->scratch.data(), this->scratch.size());
+
+    decode_dod(bits, frames, info.count, [](Frame& frame, uint64_t value) { frame.recv_ns = static_cast<int64_t>(value); });
+
+    if ((info.mask & TIMESTAMP_BIT) != 0) {
+        decode_dod(bits, frames, info.count, [](Frame& frame, uint64_t value) { frame.timestamp_us = value; });
+    }
+
+    if ((info.mask & CLOCK_BIT) != 0) {
+        decode_dod(bits, frames, info.count, [](Frame& frame, uint64_t value) { frame.vehicle_ns = static_cast<int64_t>(value); });
+        decode_dod(bits, frames, info.count, [](Frame& frame, uint64_t value) { frame.sample_ns = static_cast<int64_t>(value); });
+    }
+
+    for (std::size_t slot = 0; slot < FRAME_FIELDS; ++slot) {
+        if ((info.mask & (1U << slot)) != 0) {
+            decode_xor(bits, frames, info.count, slot);
+        }
+    }
+
+    if (bits.overrun()) {
+        out.resize(begin);
+        return false;
+    }
+
+    return true;
+}
+
+std::size_t RecordReader::read_range(std::size_t stream, int64_t start_ns, int64_t stop_ns, std::vector<Frame>& out) {
+
+    const std::size_t begin = out.size();
+
+    if (stream >= STREAMS) {
+        return 0;
+    }
+
+    const std::vector<std::size_t>& blocks = this->stream_blocks[stream];
+
+    // Find the first block that overlaps the range:
+
+    const std::size_t first = this->find_block(stream, start_ns);
+
+    auto iter = std::lower_bound(blocks.begin(), blocks.end(), first);
+
+    std::vector<Frame> frames;
+
+    for (; iter != blocks.end() && this->index[*iter].first_ns <= stop_ns; ++iter) {
+
+        // Only keep the frames inside the range:
+
+        frames.clear();
+
+        if (!this->read_block(*iter, frames)) {
+            continue;
+        }
+
+        for (const Frame& frame : frames) {
+            if (frame.recv_ns >= start_ns && frame.recv_ns <= stop_ns) {
+                out.push_back(frame);
+            }
+        }
+    }
+
+    return out.size() - begin;
+}
+
+std::size_t RecordReader::read_all(std::vector<Frame>& out) {
+
+    const std::size_t begin = out.size();
+
+    // Damaged blocks are skipped:
+
+    for (std::size_t i = 0; i < this->index.size(); ++i) {
+        this->read_block(i, out);
+    }
+
+    // Blocks of different streams overlap in time, so sort by receive time:
+    // (Stable, so frames received at the same time keep their order)
+
+    std::stable_sort(out.begin() + static_cast<std::ptrdiff_t>(begin), out.end(), [](const Frame& a, const Frame& b) { return a.recv_ns < b.recv_ns; });
+
+    return out.size() - begin;
+}
@@ -1,21 +1,87 @@
 #include "dts.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstddef>
-#include <future>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <string>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include <mavsdk.h>
 #include <connection_result.h>
 #include <plugins/telemetry/telemetry.h>
+#include <plugins/mavlink_passthrough/mavlink_passthrough.h>
 
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 
 using json = nlohmann::json;
 
-void DTStream::telem_callback(const json &newData, std::size_t index) {
+/// Degrees per radian
+constexpr double RAD_TO_DEG = 57.295779513082320876;
+
+void DTStream::telem_callback(Link* link, Frame frame) {
+
+    DTS_TRACE_THREAD("mavsdk");
+    DTS_TRACE_SCOPE("telem_callback");
+
+    // Hand the frame off to the worker thread:
+
+    frame.link = link->index;
+
+    if (!link->handoff.push(frame)) {
+        DTS_TRACE_INSTANT("overrun");
+        ++this->overruns;
+        return;
+    }
+
+    // Wake the worker if it is sleeping:
+    // (The fence pairs with the one in worker_loop(),
+    // so either we see the worker sleeping, or the worker sees our frame)
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->worker_sleeping.load(std::memory_order_relaxed)) {
+
+        // Acquire the mutex so we can't notify between the worker checking the queue and going to sleep:
+
+        { const std::lock_guard<std::mutex> lock(this->worker_mutex); }
+
+        this->worker_cond.notify_one();
+    }
+}
+
+void DTStream::process_frame(Frame& frame) {
+
+    const std::size_t index = frame.stream;
+
+    // Passthrough attitude frames may only carry a quaternion,
+    // we derive the euler angles here to keep the MAVSDK thread free:
+
+    if (index == STREAM_ATTITUDE && (frame.mask & 0b1111000) == 0b1111000 && (frame.mask & 0b111) == 0) {
+
+        const double qw = frame.values[3];
+        const double qx = frame.values[4];
+        const double qy = frame.values[5];
+        const double qz = frame.values[6];
+
+        frame.values[0] = std::atan2(2.0 * (qw * qx + qy * qz), 1.0 - 2.0 * (qx * qx + qy * qy)) * RAD_TO_DEG;
+        frame.values[1] = std::asin(std::clamp(2.0 * (qw * qy - qz * qx), -1.0, 1.0)) * RAD_TO_DEG;
+        frame.values[2] = std::atan2(2.0 * (qw * qz + qx * qy), 1.0 - 2.0 * (qy * qy + qz * qz)) * RAD_TO_DEG;
+        frame.mask |= 0b111;
+    }
+
+    // Let the watchdog know a sample arrived:
+
+    this->watchdog.record(index, std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(frame.recv_ns))));
 
     // Determine the drop rate for this value:
 
@@ -25,146 +91,1401 @@ void DTStream::telem_callback(const json &newData, std::size_t index) {
 
     if (this->drops[index] == 0) {
 
-        // Add the JSON data to the queue:
+        // Add the frame to the queue:
+
+        DTS_TRACE_SCOPE("deque_push");
+
+        this->deque[index].push(frame);
+    }
+}
+
+void DTStream::stamp_batch(Frame* frames, std::size_t count) {
+
+    // Autopilot timestamps are in microseconds since boot:
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if ((frames[i].mask & TIMESTAMP_BIT) != 0) {
+            this->clock.add_receive(static_cast<int64_t>(frames[i].timestamp_us) * 1000, frames[i].recv_ns);
+        }
+    }
+
+    const ClockEstimate estimate = this->clock.get_estimate();
+
+    if (!estimate.valid) {
+        return;
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+
+        Frame& frame = frames[i];
+
+        if ((frame.mask & TIMESTAMP_BIT) != 0) {
+
+            // We know when the autopilot sampled this frame:
+
+            frame.vehicle_ns = static_cast<int64_t>(frame.timestamp_us) * 1000;
+            frame.sample_ns = estimate.to_host(frame.vehicle_ns);
+
+        } else {
+
+            // We don't, so the receive time is the best we can do:
+
+            frame.vehicle_ns = estimate.to_vehicle(frame.recv_ns);
+            frame.sample_ns = frame.recv_ns;
+        }
+
+        frame.mask |= CLOCK_BIT;
+    }
+}
+
+std::size_t DTStream::deduplicate(Frame* frames, std::size_t count) {
+
+    DTS_TRACE_SCOPE("deduplicate");
+
+    const uint32_t active = this->active_links.load(std::memory_order_relaxed);
+
+    const std::lock_guard<std::mutex> lock(this->dedup_mutex);
+
+    std::size_t kept = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if (this->dedup.add(frames[i], active)) {
+            frames[kept++] = frames[i];
+        }
+    }
+
+    return kept;
+}
+
+void DTStream::process_batch(Frame* frames, std::size_t count) {
+
+    DTS_TRACE_SCOPE("process_batch");
+    DTS_TRACE_COUNTER("batch_frames", count);
+
+    // With several links, only keep the first copy of each sample:
+
+    if (this->links.size() > 1) {
+
+        count = this->deduplicate(frames, count);
+
+        if (count == 0) {
+            return;
+        }
+    }
+
+    GeodeticTransform transform;
+    bool enabled = false;
+
+    {
+        const std::lock_guard<std::mutex> lock(this->local_mutex);
+
+        transform = this->local_transform;
+        enabled = this->local_enabled;
+    }
+
+    if (enabled) {
+
+        // Gather all positions in this batch:
+        // (Using the AMSL altitude, the relative altitude has no fixed reference)
+
+        std::array<double, WORKER_BATCH> lat{};
+        std::array<double, WORKER_BATCH> lon{};
+        std::array<double, WORKER_BATCH> alt{};
+        std::array<std::size_t, WORKER_BATCH> indices{};
+
+        std::size_t num = 0;
+
+        for (std::size_t i = 0; i < count; ++i) {
+            if (frames[i].stream == STREAM_POSITION && (frames[i].mask & (1U << 10)) != 0) {
+                lat[num] = frames[i].values[0];
+                lon[num] = frames[i].values[1];
+                alt[num] = frames[i].values[10];
+                indices[num++] = i;
+            }
+        }
+
+        if (num > 0) {
+
+            // Convert them all at once:
+
+            std::array<double, WORKER_BATCH> a{};
+            std::array<double, WORKER_BATCH> b{};
+            std::array<double, WORKER_BATCH> c{};
+
+            transform.transform(lat.data(), lon.data(), alt.data(), num, a.data(), b.data(), c.data());
+
+            // Determine the slots each coordinate goes into:
+
+            std::array<std::size_t, 3> slots{3, 4, 5};
+
+            if (transform.get_frame() == LocalFrame::ENU) {
+                slots = {6, 7, 8};
+            } else if (transform.get_frame() == LocalFrame::NED) {
+                slots = {7, 6, 9};
+            }
+
+            for (std::size_t i = 0; i < num; ++i) {
+
+                Frame& frame = frames[indices[i]];
+
+                frame.values[slots[0]] = a[i];
+                frame.values[slots[1]] = b[i];
+                frame.values[slots[2]] = c[i];
+                frame.mask |= (1U << slots[0]) | (1U << slots[1]) | (1U << slots[2]);
+            }
+        }
+    }
+
+    // Stamp frames with synchronized times:
+
+    this->stamp_batch(frames, count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        this->process_frame(frames[i]);
+    }
+
+    // Add the frames to the history of their stream, taking each lock once:
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        this->history[i].add(frames, count, i);
+    }
+
+    // Update statistics, taking the lock once for the whole batch:
+
+    if (this->stats_enabled.load(std::memory_order_relaxed)) {
+
+        const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+        for (std::size_t i = 0; i < count; ++i) {
+            for (Statistic& stat : this->statistics[frames[i].stream]) {
+                if ((frames[i].mask & (1U << stat.slot)) != 0) {
+                    stat.window.add(frames[i].recv_ns, frames[i].values[stat.slot]);
+                }
+            }
+        }
+    }
+
+    // Let any batch consumers know there are new frames:
+    // (The fence pairs with the one in get_batch(),
+    // so either we see the waiter, or the waiter sees our update)
+
+    this->published.fetch_add(1, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->batch_waiters.load(std::memory_order_relaxed) > 0) {
+
+        { const std::lock_guard<std::mutex> lock(this->batch_mutex); }
+
+        this->batch_cond.notify_all();
+    }
+}
+
+void DTStream::worker_loop() {
+
+    DTS_TRACE_THREAD("dts worker");
+
+#ifdef __linux__
+
+    // Pin this thread to a CPU if requested:
+
+    if (this->worker_cpu >= 0) {
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(this->worker_cpu, &cpus);
+
+        const int res = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+        if (res != 0) {
+            std::cerr << "Failed to pin worker thread to CPU " << this->worker_cpu << ": " << std::strerror(res) << '\n';
+        }
+    }
+
+    // Set real time priority if requested:
+
+    if (this->worker_priority > 0) {
+
+        sched_param param{};
+        param.sched_priority = this->worker_priority;
+
+        const int res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+        if (res != 0) {
+            std::cerr << "Failed to set SCHED_FIFO priority " << this->worker_priority << ": " << std::strerror(res) << '\n';
+        }
+    }
+
+#else
+
+    if (this->worker_cpu >= 0 || this->worker_priority > 0) {
+        std::cerr << "Worker CPU pinning and priority are only supported on Linux" << '\n';
+    }
+
+#endif
+
+    std::array<Frame, WORKER_BATCH> batch;
+
+    while (true) {
 
-        this->deque[index].push(newData);
+        // Process everything that is available, in batches:
+
+        std::size_t count = 0;
+
+        if (this->links.size() == 1) {
+
+            while (count < WORKER_BATCH && this->links[0]->handoff.pop(batch[count])) {
+                ++count;
+            }
+
+        } else {
+
+            // Merge the links, always taking the frame that was received first,
+            // so the first copy of a sample is the freshest (even if one link has a backlog)
+            // and a busy link can't starve the others:
+
+            while (count < WORKER_BATCH) {
+
+                Link* next = nullptr;
+                int64_t oldest = 0;
+
+                for (auto& link : this->links) {
+
+                    const Frame* front = link->handoff.front();
+
+                    if (front != nullptr && (next == nullptr || front->recv_ns < oldest)) {
+                        next = link.get();
+                        oldest = front->recv_ns;
+                    }
+                }
+
+                if (next == nullptr) {
+                    break;
+                }
+
+                next->handoff.pop(batch[count]);
+                ++count;
+            }
+        }
+
+        if (count > 0) {
+            this->process_batch(batch.data(), count);
+            continue;
+        }
+
+        // Nothing left, go to sleep until a frame arrives or we are stopped:
+
+        std::unique_lock<std::mutex> lock(this->worker_mutex);
+
+        this->worker_sleeping.store(true, std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        this->worker_cond.wait(lock, [this] { return !this->handoff_empty() || !this->worker_running; });
+
+        this->worker_sleeping.store(false, std::memory_order_relaxed);
+
+        if (!this->worker_running && this->handoff_empty()) {
+            break;
+        }
+    }
+}
+
+bool DTStream::handoff_empty() const {
+
+    for (const auto& link : this->links) {
+        if (!link->handoff.empty()) {
+            return false;
+        }
     }
+
+    return true;
 }
 
 std::string DTStream:: get_data() {
 
-    // Final JSON data:
+    // We need to get a piece of data from each queue, with all values:
+
+    FieldMask fields;
+
+    fields.masks.fill(UINT16_MAX);
+
+    return this->get_data(fields);
+}
+
+std::string DTStream::get_data(const FieldMask& fields) {
+
+    DTS_TRACE_SCOPE("get_data");
+
+    // Only wait on the streams we need:
 
-    json final_data;
+    std::array<Frame, STREAMS> frames;
 
-    // We need to get a piece of data from each queue
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        if (fields.masks[i] != 0) {
+            DTS_TRACE_SCOPE("deque_pop");
+            frames[i] = this->deque[i].pop();
+        }
+    }
+
+    // Merge the values we need into the final JSON data:
 
-    for (std::size_t i = 0; i < this->deque.size(); ++i) {
+    json final_data = json::object();
 
-        // Get value from this queue:
-        final_data.update(this->deque[i].pop());
-        // final_data.update(this->queues[i].pop());
+    {
+        DTS_TRACE_SCOPE("merge");
+
+        for (std::size_t i = 0; i < STREAMS; ++i) {
+            if (fields.masks[i] != 0) {
+                add_json(final_data, frames[i], fields.masks[i]);
+            }
+        }
     }
 
     // Return the final data:
 
+    DTS_TRACE_SCOPE("serialize");
+
     return final_data.dump();
 }
 
-// Initialize Drone Connection via UDP Port
-bool DTStream::start() {
-    // Connects to UDP
-    std::cout << "Listening on " << connection_url << '\n';
+std::string DTStream::get_data(const std::vector<std::string>& fields) {
 
-    const mavsdk::ConnectionResult connection_result = mavsdk.add_any_connection(connection_url);
+    FieldMask mask;
 
-    if (connection_result != mavsdk::ConnectionResult::Success) {
-        std::cerr << "Connection failed: " << connection_result << '\n';
-        return false;
+    compile_fields(fields, mask);
+
+    return this->get_data(mask);
+}
+
+void DTStream::get_values(const FieldMask& fields, std::vector<double>& out) {
+
+    DTS_TRACE_SCOPE("get_values");
+
+    // Grab a frame from each stream we need:
+
+    std::array<Frame, STREAMS> frames;
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        if (fields.masks[i] != 0) {
+            DTS_TRACE_SCOPE("deque_pop");
+            frames[i] = this->deque[i].pop();
+        }
+    }
+
+    // Copy out the values in order:
+
+    out.resize(fields.order.size());
+
+    for (std::size_t i = 0; i < fields.order.size(); ++i) {
+
+        const Frame& frame = frames[fields.order[i].first];
+        const uint16_t slot = fields.order[i].second;
+
+        if ((frame.mask & (1U << slot)) == 0) {
+            out[i] = std::numeric_limits<double>::quiet_NaN();
+        } else if (slot == TIMESTAMP_SLOT) {
+            out[i] = static_cast<double>(frame.timestamp_us);
+        } else {
+            out[i] = frame.values[slot];
+        }
     }
+}
+
+std::size_t DTStream::get_batch(std::vector<Frame>& out, std::size_t max_frames, std::chrono::milliseconds timeout) {
+
+    DTS_TRACE_SCOPE("get_batch");
+
+    const std::size_t begin = out.size();
+
+    // Grab the publish count before draining, so we can't miss an update in between:
+
+    const uint64_t seen = this->published.load(std::memory_order_acquire);
+
+    // Drains each stream once, merging each into the output so frames stay in receive order:
 
-    // Waits for connection
-    std::cout << "Waiting for drone to connect..." << '\n';
-    std::promise<std::shared_ptr<mavsdk::System>> prom;
-    std::future<std::shared_ptr<mavsdk::System>> fut = prom.get_future();
+    auto drain = [this, &out, begin, max_frames]() {
 
-    // Add new temporary callback that gets called upon system add:
-    // (Callback implemented via lambda)
+        DTS_TRACE_SCOPE("drain");
 
-    const mavsdk::Mavsdk::NewSystemHandle handle = mavsdk.subscribe_on_new_system([this, &prom]() {
-        auto systems = mavsdk.systems();
-        std::cout << "Number of systems detected: " << systems.size() << '\n';
+        const std::size_t start = this->batch_start.fetch_add(1) % STREAMS;
 
-        if (!systems.empty()) {
-            auto system = systems.at(0);
-            if (system->has_autopilot()) {
-                std::cout << "Drone discovered!" << '\n';
+        auto by_recv = [](const Frame& first, const Frame& second) { return first.recv_ns < second.recv_ns; };
 
-                prom.set_value(system);
+        for (std::size_t i = 0; i < STREAMS && out.size() - begin < max_frames; ++i) {
 
-            } else {
-                std::cout << "Detected system does not have an autopilot."
-                          << '\n';
-                prom.set_value(nullptr);
+            const std::size_t mid = out.size();
+
+            this->deque[(start + i) % STREAMS].drain(out, max_frames - (mid - begin));
+
+            // The worker queues frames in receive order, except for the rare frame that was
+            // still being handed off from another link, so we only sort if needed:
+
+            if (!std::is_sorted(out.begin() + static_cast<std::ptrdiff_t>(mid), out.end(), by_recv)) {
+                std::stable_sort(out.begin() + static_cast<std::ptrdiff_t>(mid), out.end(), by_recv);
             }
-        } else {
-            std::cout << "No systems found." << '\n';
-            prom.set_value(nullptr);
-        } 
-    });
 
-    // Wait for system to be configured:
+            std::inplace_merge(out.begin() + static_cast<std::ptrdiff_t>(begin), out.begin() + static_cast<std::ptrdiff_t>(mid), out.end(), by_recv);
+        }
+    };
 
-    auto system = fut.get();
-    if (!system) {
-        std::cerr << "Failed to connect to the drone." << '\n';
-        return false;
+    drain();
+
+    if (out.size() > begin || timeout.count() <= 0) {
+        return out.size() - begin;
+    }
+
+    // Nothing available, wait for the worker to queue more frames:
+
+    {
+        DTS_TRACE_SCOPE("batch_wait");
+
+        std::unique_lock<std::mutex> lock(this->batch_mutex);
+
+        this->batch_waiters.fetch_add(1, std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        this->batch_cond.wait_for(lock, timeout, [this, seen] { return this->published.load(std::memory_order_relaxed) != seen; });
+
+        this->batch_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    drain();
+
+    return out.size() - begin;
+}
+
+std::vector<Frame> DTStream::get_batch(std::size_t max_frames, std::chrono::milliseconds timeout) {
+
+    std::vector<Frame> out;
+
+    this->get_batch(out, max_frames, timeout);
+
+    return out;
+}
+
+std::string DTStream::get_batch_json(std::size_t max_frames, std::chrono::milliseconds timeout) {
+
+    const std::vector<Frame> frames = this->get_batch(max_frames, timeout);
+
+    DTS_TRACE_SCOPE("serialize");
+
+    json data = json::array();
+
+    for (const Frame& frame : frames) {
+        data.push_back(describe_frame(frame));
     }
 
-    // Remove system callback:
+    return data.dump();
+}
 
-    mavsdk.unsubscribe_on_new_system(handle);
+bool DTStream::add_cstr(std::string cstr) {
 
-    if (!system->is_connected()) {
-        std::cerr << "System is not connected!" << '\n';
+    if (this->connection_urls.size() >= MAX_LINKS) {
+        std::cerr << "Can't add " << cstr << ", at most " << MAX_LINKS << " links are supported" << '\n';
         return false;
     }
 
-    // Initialize Telemetry
-    telemetry = std::make_unique<mavsdk::Telemetry>(system);
-
-    // Configure all callback functions
-
-    telemetry->subscribe_position([this](mavsdk::Telemetry::Position position)
-                                                         { this->telem_callback({{"relative_altitude_m", position.relative_altitude_m},
-                                                                                 {"latitude_deg", position.latitude_deg},
-                                                                                 {"longitude_deg", position.longitude_deg}}, 0); });
-
-    telemetry->subscribe_attitude_angular_velocity_body([this](mavsdk::Telemetry::AngularVelocityBody angularVelocity)
-                                                        { this->telem_callback({{"roll_rad_s", angularVelocity.roll_rad_s},
-                                                                               {"pitch_rad_s", angularVelocity.pitch_rad_s},
-                                                                               {"yaw_rad_s", angularVelocity.yaw_rad_s}}, 1); });
-
-    telemetry->subscribe_velocity_ned([this](mavsdk::Telemetry::VelocityNed velocity)
-                                      { this->telem_callback({{"north_m_s", velocity.north_m_s},
-                                                              {"east_m_s", velocity.east_m_s},
-                                                              {"down_m_s", velocity.down_m_s}}, 2); });
-
-    telemetry->subscribe_fixedwing_metrics([this](mavsdk::Telemetry::FixedwingMetrics metrics)
-                                           { this->telem_callback({{"airspeed_m_s", metrics.airspeed_m_s},
-                                                                   {"throttle_percentage", metrics.throttle_percentage},
-                                                                   {"climb_rate_m_s", metrics.climb_rate_m_s}}, 3); });
-
-    telemetry->subscribe_imu([this](mavsdk::Telemetry::Imu imu)
-                             {
-        json imuData;
-        imuData["acceleration_forward_m_s2"] = imu.acceleration_frd.forward_m_s2;
-        imuData["acceleration_right_m_s2"] = imu.acceleration_frd.right_m_s2;
-        imuData["acceleration_down_m_s2"] = imu.acceleration_frd.down_m_s2;
-        imuData["angular_velocity_forward_rad_s"] = imu.angular_velocity_frd.forward_rad_s;
-        imuData["angular_velocity_right_rad_s"] = imu.angular_velocity_frd.right_rad_s;
-        imuData["angular_velocity_down_rad_s"] = imu.angular_velocity_frd.down_rad_s;
-        imuData["magnetic_field_forward_gauss"] = imu.magnetic_field_frd.forward_gauss;
-        imuData["magnetic_field_right_gauss"] = imu.magnetic_field_frd.right_gauss;
-        imuData["magnetic_field_down_gauss"] = imu.magnetic_field_frd.down_gauss;
-        imuData["temperature_degc"] = imu.temperature_degc;
-        imuData["timestamp_us"] = imu.timestamp_us;
-        this->telem_callback(imuData, 4); });
-
-    telemetry->subscribe_attitude_euler([this](mavsdk::Telemetry::EulerAngle euler_angle)
-                                        { this->telem_callback({
-                                              {"roll_deg", euler_angle.roll_deg},
-                                              {"pitch_deg", euler_angle.pitch_deg},
-                                              {"yaw_deg", euler_angle.yaw_deg},
-                                              {"timestamp", euler_angle.timestamp_us},
-                                          }, 5); });
+    this->connection_urls.push_back(std::move(cstr));
 
     return true;
 }
 
-void DTStream::stop() {
+bool DTStream::start_async() {
+
+    DTS_TRACE_SCOPE("start_async");
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        // Do nothing if we are already started:
+
+        if (this->state != ConnectionState::Stopped) {
+            return true;
+        }
+
+        // Create a link, with a fresh MAVSDK instance, for each connection:
+        // (Separate instances let us tell which link each sample arrived over)
+
+        std::vector<std::unique_ptr<Link>> nlinks;
+
+        for (const std::string& url : this->connection_urls) {
+
+            auto link = std::make_unique<Link>();
+
+            link->index = static_cast<uint16_t>(nlinks.size());
+            link->url = url;
+            link->mavsdk = std::make_unique<mavsdk::Mavsdk>(this->config);
+
+            // Connects to UDP
+            std::cout << "Listening on " << url << '\n';
+
+            const mavsdk::ConnectionResult connection_result = link->mavsdk->add_any_connection(url);
+
+            if (connection_result != mavsdk::ConnectionResult::Success) {
+                std::cerr << "Connection to " << url << " failed: " << connection_result << '\n';
+                return false;
+            }
+
+            link->state = ConnectionState::Connecting;
+
+            nlinks.push_back(std::move(link));
+        }
+
+        this->links = std::move(nlinks);
+        this->active_links = 0;
+
+        {
+            const std::lock_guard<std::mutex> dlock(this->dedup_mutex);
+
+            this->dedup = Deduplicator(this->links.size(), std::chrono::duration_cast<std::chrono::nanoseconds>(this->dedup_window).count());
+        }
+
+        // Waits for connection
+        std::cout << "Waiting for drone to connect..." << '\n';
+
+        this->set_state(ConnectionState::Connecting);
+
+        // Start watching the streams:
+
+        this->watchdog.reset();
+
+        // Add callback that gets called upon system add:
+        // (We keep it around, as systems may appear at any time)
+
+        for (auto& link : this->links) {
+            Link* lptr = link.get();
+            link->system_handle = link->mavsdk->subscribe_on_new_system([this, lptr]() { this->on_new_system(lptr); });
+        }
+    }
+
+    this->notify_state(ConnectionState::Connecting);
+
+    // Start the worker thread:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->worker_mutex);
+
+        this->worker_running = true;
+    }
+
+    this->worker_thread = std::thread(&DTStream::worker_loop, this);
+
+    // Start the monitor thread:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->monitor_mutex);
 
-    // Destroy the MAVSDK object:
+        this->monitor_running = true;
+    }
+
+    this->monitor_thread = std::thread(&DTStream::monitor_loop, this);
+
+    // The system may have been discovered before we subscribed:
+    // (Links are only destroyed by the next start, which can't run concurrently with this one)
+
+    for (auto& link : this->links) {
+        this->on_new_system(link.get());
+    }
+
+    return true;
+}
+
+bool DTStream::start() {
+
+    if (!this->start_async()) {
+        return false;
+    }
+
+    // Wait for system to be configured:
+
+    DTS_TRACE_SCOPE("wait_connected");
+
+    std::unique_lock<std::mutex> lock(this->state_mutex);
+
+    this->state_cond.wait(lock, [this] { return this->state == ConnectionState::Connected || this->state == ConnectionState::Stopped; });
+
+    return this->state == ConnectionState::Connected;
+}
+
+bool DTStream::start(std::chrono::milliseconds timeout) {
+
+    if (!this->start_async()) {
+        return false;
+    }
+
+    return this->wait_connected(timeout);
+}
+
+bool DTStream::wait_connected(std::chrono::milliseconds timeout) {
+
+    DTS_TRACE_SCOPE("wait_connected");
+
+    std::unique_lock<std::mutex> lock(this->state_mutex);
+
+    this->state_cond.wait_for(lock, timeout, [this] { return this->state == ConnectionState::Connected || this->state == ConnectionState::Stopped; });
+
+    return this->state == ConnectionState::Connected;
+}
+
+void DTStream::set_state_callback(std::function<void(ConnectionState)> callback) {
+
+    auto ncallback = callback ? std::make_shared<const std::function<void(ConnectionState)>>(std::move(callback)) : nullptr;
+
+    // Swap the callbacks, the old one is destroyed once we release the mutex:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        this->state_callback.swap(ncallback);
+    }
+}
+
+void DTStream::set_state(ConnectionState nstate) {
+
+    this->state = nstate;
+
+    this->state_cond.notify_all();
+}
+
+void DTStream::notify_state(ConnectionState nstate) {
+
+    // Grab a copy of the callback, so we don't hold the mutex while calling it:
+
+    std::shared_ptr<const std::function<void(ConnectionState)>> callback;
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        callback = this->state_callback;
+    }
+
+    if (callback) {
+        (*callback)(nstate);
+    }
+}
+
+bool DTStream::any_connected() const {
+
+    for (const auto& link : this->links) {
+        if (link->state == ConnectionState::Connected) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void DTStream::on_new_system(Link* link) {
+
+    DTS_TRACE_SCOPE("discovery");
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        // Ignore if we are stopped, or if this link already has a system:
+        // (Reconnects of our system are handled in on_connection_change())
+
+        if (!link->mavsdk || link->system) {
+            return;
+        }
+
+        auto systems = link->mavsdk->systems();
+        std::cout << "Number of systems detected on " << link->url << ": " << systems.size() << '\n';
+
+        for (auto& sys : systems) {
+            if (sys->has_autopilot()) {
+                link->system = sys;
+                break;
+            }
+        }
+
+        if (!link->system) {
+            std::cout << "Detected system does not have an autopilot." << '\n';
+            return;
+        }
+
+        std::cout << "Drone discovered on " << link->url << "!" << '\n';
+
+        // Keep track of the connection state of this system:
+
+        link->system->subscribe_is_connected([this, link](bool connected) { this->on_connection_change(link, connected); });
+
+        // Initialize the plugins for our ingest mode:
+        // (Passthrough is always needed for clock synchronization)
+
+        link->passthrough = std::make_unique<mavsdk::MavlinkPassthrough>(link->system);
+
+        if (this->ingest_mode == IngestMode::Telemetry) {
+            link->telemetry = std::make_unique<mavsdk::Telemetry>(link->system);
+        }
+
+        // Only synchronize the clocks again if no other link is connected,
+        // otherwise this is the same autopilot we are already synchronized with:
+
+        if (!this->any_connected()) {
+            this->clock.reset();
+        }
+
+        this->subscribe_timesync(link);
+
+        this->subscribe_telemetry(link);
+
+        link->state = ConnectionState::Connected;
+        this->active_links |= 1U << link->index;
+
+        // Other links may have connected first:
+
+        if (this->state == ConnectionState::Connected) {
+            return;
+        }
+
+        this->set_state(ConnectionState::Connected);
+    }
+
+    this->notify_state(ConnectionState::Connected);
+}
+
+void DTStream::on_connection_change(Link* link, bool connected) {
+
+    if (!connected) {
+
+        {
+            const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+            if (!link->system || link->state != ConnectionState::Connected) {
+                return;
+            }
+
+            std::cerr << "Connection to the drone was lost on " << link->url << "!" << '\n';
+
+            link->state = ConnectionState::Lost;
+            this->active_links &= ~(1U << link->index);
+
+            // We are only lost once all links are:
+
+            if (this->any_connected() || this->state != ConnectionState::Connected) {
+                return;
+            }
+
+            this->set_state(ConnectionState::Lost);
+        }
+
+        this->notify_state(ConnectionState::Lost);
+
+        return;
+    }
+
+    // Only bother if we actually lost the system:
+
+    bool reconnecting = false;
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        if (!link->system || link->state != ConnectionState::Lost) {
+            return;
+        }
+
+        std::cout << "Drone reappeared on " << link->url << ", resubscribing..." << '\n';
+
+        link->state = ConnectionState::Reconnecting;
+
+        // Only report reconnecting if no other link kept us connected:
+
+        if (this->state == ConnectionState::Lost) {
+            this->set_state(ConnectionState::Reconnecting);
+            reconnecting = true;
+        }
+    }
+
+    if (reconnecting) {
+        this->notify_state(ConnectionState::Reconnecting);
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        // We may have been stopped in the meantime:
+
+        if (!link->system || link->state != ConnectionState::Reconnecting) {
+            return;
+        }
+
+        // The autopilot may have rebooted, so synchronize the clocks again:
+        // (Unless another link stayed connected the whole time)
+
+        if (!this->any_connected()) {
+            this->clock.reset();
+        }
+
+        // Resubscribe to all telemetry, the queues are left untouched:
+
+        this->unsubscribe_telemetry(link);
+        this->subscribe_telemetry(link);
+
+        link->state = ConnectionState::Connected;
+        this->active_links |= 1U << link->index;
+
+        if (this->state == ConnectionState::Connected) {
+            return;
+        }
+
+        this->set_state(ConnectionState::Connected);
+    }
+
+    this->notify_state(ConnectionState::Connected);
+}
+
+std::vector<LinkStats> DTStream::get_link_stats() {
+
+    std::vector<LinkStats> stats;
+
+    const std::lock_guard<std::mutex> lock(this->state_mutex);
+    const std::lock_guard<std::mutex> dlock(this->dedup_mutex);
+
+    for (const auto& link : this->links) {
+
+        LinkStats stat;
+
+        this->dedup.get_stats(link->index, stat);
+
+        stat.url = link->url;
+        stat.connected = link->state == ConnectionState::Connected;
+        stat.rtt_ns = link->rtt_ns.load();
+
+        stats.push_back(std::move(stat));
+    }
+
+    return stats;
+}
+
+int DTStream::get_fastest_link() {
+
+    const std::vector<LinkStats> stats = this->get_link_stats();
+
+    int fastest = -1;
+
+    for (std::size_t i = 0; i < stats.size(); ++i) {
+        if (stats[i].connected && (fastest < 0 || stats[i].lag_ns < stats[static_cast<std::size_t>(fastest)].lag_ns)) {
+            fastest = static_cast<int>(i);
+        }
+    }
+
+    return fastest;
+}
+
+void DTStream::set_health_callback(std::function<void(std::size_t, StreamHealth)> callback) {
+
+    auto ncallback = callback ? std::make_shared<const Watchdog<STREAMS>::HealthCallback>(std::move(callback)) : nullptr;
+
+    // Swap the callbacks, the old one is destroyed once we release the mutex:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->monitor_mutex);
+
+        this->health_callback.swap(ncallback);
+    }
+}
+
+void DTStream::set_local_frame(double lat_deg, double lon_deg, double alt_m, LocalFrame frame) {
+
+    const std::lock_guard<std::mutex> lock(this->local_mutex);
+
+    this->local_transform = GeodeticTransform(lat_deg, lon_deg, alt_m, frame);
+    this->local_enabled = true;
+}
+
+void DTStream::disable_local_frame() {
+
+    const std::lock_guard<std::mutex> lock(this->local_mutex);
+
+    this->local_enabled = false;
+}
+
+bool DTStream::local_frame_enabled() {
+
+    const std::lock_guard<std::mutex> lock(this->local_mutex);
+
+    return this->local_enabled;
+}
+
+DTStream::Statistic* DTStream::find_statistic(const std::string& field) {
+
+    for (auto& stats : this->statistics) {
+        for (Statistic& stat : stats) {
+            if (stat.field == field) {
+                return &stat;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+bool DTStream::add_statistic(const std::string& field, std::size_t count, std::chrono::milliseconds span) {
+
+    std::size_t stream = 0;
+    std::size_t slot = 0;
+
+    if (!find_field(field, stream, slot)) {
+        return false;
+    }
+
+    // Allocate the window outside of the lock:
+
+    WindowStats window(count, std::chrono::duration_cast<std::chrono::nanoseconds>(span).count());
+
+    const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    Statistic* stat = this->find_statistic(field);
+
+    if (stat != nullptr) {
+        stat->window = std::move(window);
+    } else {
+        this->statistics[stream].push_back(Statistic{field, slot, std::move(window)});
+    }
+
+    this->stats_enabled = true;
+
+    return true;
+}
+
+void DTStream::remove_statistic(const std::string& field) {
+
+    const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    bool any = false;
+
+    for (auto& stats : this->statistics) {
+        stats.erase(std::remove_if(stats.begin(), stats.end(), [&field](const Statistic& stat) { return stat.field == field; }), stats.end());
+        any = any || !stats.empty();
+    }
+
+    this->stats_enabled = any;
+}
+
+WindowSummary DTStream::get_statistics(const std::string& field) {
+
+    const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    Statistic* stat = this->find_statistic(field);
+
+    if (stat == nullptr) {
+        return {};
+    }
+
+    // Drop samples that aged out while the stream was quiet:
+
+    stat->window.expire(host_time_ns());
+
+    return stat->window.summary();
+}
+
+WindowSummary DTStream::get_statistics(const std::string& field, std::size_t count) {
+
+    const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    Statistic* stat = this->find_statistic(field);
+
+    if (stat == nullptr) {
+        return {};
+    }
+
+    stat->window.expire(host_time_ns());
+
+    return stat->window.summary_count(count);
+}
+
+WindowSummary DTStream::get_statistics(const std::string& field, std::chrono::milliseconds span) {
+
+    const std::lock_guard<std::mutex> lock(this->stats_mutex);
+
+    Statistic* stat = this->find_statistic(field);
+
+    if (stat == nullptr) {
+        return {};
+    }
+
+    stat->window.expire(host_time_ns());
+
+    return stat->window.summary_time(std::chrono::duration_cast<std::chrono::nanoseconds>(span).count());
+}
+
+bool DTStream::set_history(std::size_t index, std::size_t capacity) {
+
+    if (index >= STREAMS) {
+        return false;
+    }
+
+    this->history[index].resize(capacity);
+
+    return true;
+}
+
+std::size_t DTStream::get_history(std::size_t index) const {
+
+    if (index >= STREAMS) {
+        return 0;
+    }
+
+    return this->history[index].get_capacity();
+}
+
+std::size_t DTStream::get_range(std::size_t index, int64_t start_ns, int64_t stop_ns, std::vector<Frame>& out) const {
+
+    if (index >= STREAMS) {
+        return 0;
+    }
+
+    return this->history[index].get_range(start_ns, stop_ns, out);
+}
+
+std::vector<Frame> DTStream::get_range(std::size_t index, int64_t start_ns, int64_t stop_ns) const {
+
+    std::vector<Frame> out;
+
+    this->get_range(index, start_ns, stop_ns, out);
+
+    return out;
+}
+
+bool DTStream::get_at(std::size_t index, int64_t time_ns, Frame& out) const {
+
+    if (index >= STREAMS) {
+        return false;
+    }
+
+    return this->history[index].get_at(time_ns, out);
+}
+
+void DTStream::request_rate(Link* link, std::size_t index, double rate) {
+
+    if (this->ingest_mode == IngestMode::Passthrough) {
+        this->request_raw_rate(link, index, rate);
+        return;
+    }
+
+    auto callback = [index](mavsdk::Telemetry::Result result) {
+        if (result != mavsdk::Telemetry::Result::Success) {
+            std::cerr << "Failed to set rate of stream " << index << ": " << result << '\n';
+        }
+    };
+
+    switch (index) {
+        case STREAM_POSITION:
+            link->telemetry->set_rate_position_async(rate, callback);
+            break;
+        case STREAM_ANGULAR_VELOCITY:
+        case STREAM_ATTITUDE:
+            // Angular velocity is sent along with the attitude:
+            link->telemetry->set_rate_attitude_euler_async(rate, callback);
+            break;
+        case STREAM_VELOCITY_NED:
+            link->telemetry->set_rate_velocity_ned_async(rate, callback);
+            break;
+        case STREAM_FIXEDWING_METRICS:
+            link->telemetry->set_rate_fixedwing_metrics_async(rate, callback);
+            break;
+        case STREAM_IMU:
+            link->telemetry->set_rate_imu_async(rate, callback);
+            break;
+        default:
+            break;
+    }
+}
+
+void DTStream::resubscribe(std::size_t index) {
+
+    const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+    // We can only resubscribe if we are connected:
+
+    if (this->state != ConnectionState::Connected) {
+        return;
+    }
+
+    std::cerr << "Stream " << index << " stalled, resubscribing..." << '\n';
+
+    const double rate = this->watchdog.get_expected_rate(index);
+
+    for (auto& link : this->links) {
+
+        if (link->state != ConnectionState::Connected) {
+            continue;
+        }
+
+        if (link->unsubscribers[index]) {
+            link->unsubscribers[index]();
+        }
+
+        this->subscribe_stream(link.get(), index);
+
+        // Ask for the expected rate again, the autopilot may have forgotten it:
+
+        if (rate > 0) {
+            this->request_rate(link.get(), index, rate);
+        }
+    }
+}
+
+void DTStream::monitor_loop() {
+
+    DTS_TRACE_THREAD("dts monitor");
+
+    // Time of the last resubscribe attempt for each stream:
+
+    std::array<std::chrono::steady_clock::time_point, STREAMS> attempts{};
+
+    // Time of the last TIMESYNC request:
+
+    std::chrono::steady_clock::time_point last_timesync{};
+
+    // Used when no health callback is set:
+
+    const Watchdog<STREAMS>::HealthCallback none;
+
+    std::unique_lock<std::mutex> lock(this->monitor_mutex);
+
+    while (!this->monitor_cond.wait_for(lock, this->monitor_interval, [this] { return !this->monitor_running; })) {
+
+        // Grab the callback, so we don't hold the mutex while working:
+        // (Only the pointer is copied, copying the function may need the Python GIL)
+
+        auto callback = this->health_callback;
+
+        lock.unlock();
+
+        DTS_TRACE_SCOPE("monitor");
+
+        this->watchdog.check(callback ? *callback : none);
+
+        // Send TIMESYNC requests, quickly until we have a few exchanges:
+
+        const auto now = std::chrono::steady_clock::now();
+
+        const auto interval = this->clock.get_estimate().exchanges < 5 ? this->monitor_interval : this->timesync_interval;
+
+        if (now - last_timesync >= interval) {
+
+            last_timesync = now;
+
+            this->send_timesync();
+        }
+
+        // Resubscribe any streams that are stalled:
+
+        if (this->auto_resubscribe && this->state == ConnectionState::Connected) {
+
+            for (std::size_t i = 0; i < STREAMS; ++i) {
+
+                if (this->watchdog.get_health(i) == StreamHealth::Stalled && now - attempts[i] > this->resubscribe_backoff) {
+
+                    attempts[i] = now;
+
+                    this->resubscribe(i);
+                }
+            }
+        }
+
+        // Drop our reference before locking, in case it is the last one:
+
+        callback.reset();
+
+        lock.lock();
+    }
+}
+
+void DTStream::subscribe_telemetry(Link* link) {
+
+    link->quaternion_seen = false;
+
+    for (std::size_t i = 0; i < STREAMS; ++i) {
+        this->subscribe_stream(link, i);
+    }
+}
+
+void DTStream::unsubscribe_telemetry(Link* link) {
+
+    for (auto& unsub : link->unsubscribers) {
+        if (unsub) {
+            unsub();
+            unsub = nullptr;
+        }
+    }
+}
+
+void DTStream::subscribe_stream(Link* link, std::size_t index) {
+
+    if (this->ingest_mode == IngestMode::Passthrough) {
+        this->subscribe_raw_stream(link, index);
+        return;
+    }
+
+    mavsdk::Telemetry* telem = link->telemetry.get();
+
+    // Each callback only copies the values into a frame,
+    // all other work is done on the worker thread:
+
+    switch (index) {
+        case STREAM_POSITION: {
+            auto handle = telem->subscribe_position([this, link](mavsdk::Telemetry::Position position) {
+                Frame frame = make_frame(STREAM_POSITION);
+                frame.values[0] = position.latitude_deg;
+                frame.values[1] = position.longitude_deg;
+                frame.values[2] = position.relative_altitude_m;
+                frame.values[10] = position.absolute_altitude_m;
+                frame.mask = 0b10000000111;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_position(handle); };
+            break;
+        }
+        case STREAM_ANGULAR_VELOCITY: {
+            auto handle = telem->subscribe_attitude_angular_velocity_body([this, link](mavsdk::Telemetry::AngularVelocityBody angularVelocity) {
+                Frame frame = make_frame(STREAM_ANGULAR_VELOCITY);
+                frame.values[0] = angularVelocity.roll_rad_s;
+                frame.values[1] = angularVelocity.pitch_rad_s;
+                frame.values[2] = angularVelocity.yaw_rad_s;
+                frame.mask = 0b111;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_attitude_angular_velocity_body(handle); };
+            break;
+        }
+        case STREAM_VELOCITY_NED: {
+            auto handle = telem->subscribe_velocity_ned([this, link](mavsdk::Telemetry::VelocityNed velocity) {
+                Frame frame = make_frame(STREAM_VELOCITY_NED);
+                frame.values[0] = velocity.north_m_s;
+                frame.values[1] = velocity.east_m_s;
+                frame.values[2] = velocity.down_m_s;
+                frame.mask = 0b111;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_velocity_ned(handle); };
+            break;
+        }
+        case STREAM_FIXEDWING_METRICS: {
+            auto handle = telem->subscribe_fixedwing_metrics([this, link](mavsdk::Telemetry::FixedwingMetrics metrics) {
+                Frame frame = make_frame(STREAM_FIXEDWING_METRICS);
+                frame.values[0] = metrics.airspeed_m_s;
+                frame.values[1] = metrics.throttle_percentage;
+                frame.values[2] = metrics.climb_rate_m_s;
+                frame.mask = 0b111;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_fixedwing_metrics(handle); };
+            break;
+        }
+        case STREAM_IMU: {
+            auto handle = telem->subscribe_imu([this, link](mavsdk::Telemetry::Imu imu) {
+                Frame frame = make_frame(STREAM_IMU);
+                frame.values[0] = imu.acceleration_frd.forward_m_s2;
+                frame.values[1] = imu.acceleration_frd.right_m_s2;
+                frame.values[2] = imu.acceleration_frd.down_m_s2;
+                frame.values[3] = imu.angular_velocity_frd.forward_rad_s;
+                frame.values[4] = imu.angular_velocity_frd.right_rad_s;
+                frame.values[5] = imu.angular_velocity_frd.down_rad_s;
+                frame.values[6] = imu.magnetic_field_frd.forward_gauss;
+                frame.values[7] = imu.magnetic_field_frd.right_gauss;
+                frame.values[8] = imu.magnetic_field_frd.down_gauss;
+                frame.values[9] = imu.temperature_degc;
+                frame.timestamp_us = imu.timestamp_us;
+                frame.mask = 0b1111111111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_imu(handle); };
+            break;
+        }
+        case STREAM_ATTITUDE: {
+            auto handle = telem->subscribe_attitude_euler([this, link](mavsdk::Telemetry::EulerAngle euler_angle) {
+                Frame frame = make_frame(STREAM_ATTITUDE);
+                frame.values[0] = euler_angle.roll_deg;
+                frame.values[1] = euler_angle.pitch_deg;
+                frame.values[2] = euler_angle.yaw_deg;
+                frame.timestamp_us = euler_angle.timestamp_us;
+                frame.mask = 0b111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [telem, handle]() { telem->unsubscribe_attitude_euler(handle); };
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void DTStream::stop() {
+
+    // Stop the monitor thread:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->monitor_mutex);
+
+        this->monitor_running = false;
+    }
+
+    this->monitor_cond.notify_all();
+
+    if (this->monitor_thread.joinable()) {
+        this->monitor_thread.join();
+    }
+
+    // Components to destroy once we release the mutex:
+
+    std::vector<std::unique_ptr<mavsdk::Mavsdk>> old_mavsdk;
+    std::vector<std::unique_ptr<mavsdk::Telemetry>> old_telemetry;
+    std::vector<std::unique_ptr<mavsdk::MavlinkPassthrough>> old_passthrough;
+
+    {
+        const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+        if (this->state == ConnectionState::Stopped) {
+            return;
+        }
+
+        // Take ownership of the MAVSDK components of each link,
+        // any MAVSDK callbacks that run after this point will see that we are stopped:
+
+        for (auto& link : this->links) {
+
+            for (auto& unsub : link->unsubscribers) {
+                unsub = nullptr;
+            }
+
+            link->timesync_unsubscriber = nullptr;
+
+            old_telemetry.push_back(std::move(link->telemetry));
+            old_passthrough.push_back(std::move(link->passthrough));
+            old_mavsdk.push_back(std::move(link->mavsdk));
+            link->system.reset();
+            link->state = ConnectionState::Stopped;
+        }
+
+        this->active_links = 0;
+
+        this->set_state(ConnectionState::Stopped);
+    }
+
+    // Destroy the plugins, which removes all subscriptions:
+
+    old_telemetry.clear();
+    old_passthrough.clear();
+
+    // Destroy the MAVSDK objects, which stops all background threads:
+    // (We can't hold the mutex here, as MAVSDK callbacks may be waiting on it)
+
+    old_mavsdk.clear();
+
+    // MAVSDK is gone, so nothing else will be handed off.
+    // Stop the worker thread once it has processed the remaining frames:
+
+    {
+        const std::lock_guard<std::mutex> lock(this->worker_mutex);
+
+        this->worker_running = false;
+    }
+
+    this->worker_cond.notify_all();
+
+    if (this->worker_thread.joinable()) {
+        this->worker_thread.join();
+    }
 
-    this->mavsdk.~Mavsdk();
+    this->notify_state(ConnectionState::Stopped);
 }
@@ -0,0 +1,318 @@
+/**
+ * @file geodetic.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Batch geodetic coordinate transforms
+ * @version 0.1
+ * @date 2024-11-23
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file implements the geodetic transforms.
+ * Each transform is expressed as a conversion into ECEF,
+ * followed by a translation and rotation into the output frame.
+ *
+ * We provide two kernels, a scalar one and an AVX2 one that handles four positions at a time.
+ * The AVX2 kernel has its own sine and cosine, as there are no vector versions in the standard library.
+ * We reduce the angle to [-pi/4, pi/4] and evaluate the same minimax polynomials fdlibm uses,
+ * which keeps the error well below a millimeter at the surface of the Earth.
+ * The kernel is picked at runtime, so the library still runs on CPUs without AVX2.
+ */
+
+#include "geodetic.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+#if defined(DTS_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define DTS_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/// Semi-major axis of the WGS84 ellipsoid in meters
+constexpr double WGS84_A = 6378137.0;
+
+/// Flattening of the WGS84 ellipsoid
+constexpr double WGS84_F = 1.0 / 298.257223563;
+
+/// First eccentricity squared of the WGS84 ellipsoid
+constexpr double WGS84_E2 = WGS84_F * (2.0 - WGS84_F);
+
+/// Radians per degree
+constexpr double DEG_TO_RAD = 0.017453292519943295769;
+
+/**
+ * @brief Translation and rotation applied after converting into ECEF
+ *
+ * Output coordinate i is sum_j rot[i * 3 + j] * (ecef_j - origin_j)
+ */
+struct Rotation {
+
+    /// ECEF coordinates of the origin
+    std::array<double, 3> origin{};
+
+    /// Row major rotation matrix
+    std::array<double, 9> rot{1, 0, 0, 0, 1, 0, 0, 0, 1};
+};
+
+/**
+ * @brief Scalar transform kernel
+ *
+ * @param rot Rotation to apply
+ * @param lat Latitudes in degrees
+ * @param lon Longitudes in degrees
+ * @param alt Altitudes in meters
+ * @param count Number of positions
+ * @param a First output coordinate
+ * @param b Second output coordinate
+ * @param c Third output coordinate
+ */
+void transform_scalar(const Rotation& rot, const double* lat, const double* lon, const double* alt, std::size_t count, double* a, double* b, double* c) {
+
+    const auto& r = rot.rot;
+
+    for (std::size_t i = 0; i < count; ++i) {
+
+        const double phi = lat[i] * DEG_TO_RAD;
+        const double lam = lon[i] * DEG_TO_RAD;
+
+        const double sphi = std::sin(phi);
+        const double cphi = std::cos(phi);
+
+        // Prime vertical radius of curvature:
+
+        const double n = WGS84_A / std::sqrt(1.0 - WGS84_E2 * sphi * sphi);
+
+        const double dx = (n + alt[i]) * cphi * std::cos(lam) - rot.origin[0];
+        const double dy = (n + alt[i]) * cphi * std::sin(lam) - rot.origin[1];
+        const double dz = (n * (1.0 - WGS84_E2) + alt[i]) * sphi - rot.origin[2];
+
+        a[i] = r[0] * dx + r[1] * dy + r[2] * dz;
+        b[i] = r[3] * dx + r[4] * dy + r[5] * dz;
+        c[i] = r[6] * dx + r[7] * dy + r[8] * dz;
+    }
+}
+
+#ifdef DTS_HAVE_AVX2
+
+/**
+ * @brief Computes the sine and cosine of four angles
+ *
+ * @param x Angles in radians
+ * @param sin Output sines
+ * @param cos Output cosines
+ */
+__attribute__((target("avx2,fma"))) inline void sincos_avx2(__m256d x, __m256d& sin, __m256d& cos) {
+
+    // Cody-Waite reduction into [-pi/4, pi/4]:
+
+    const __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(0.63661977236758134308)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+
+    __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(1.57079632673412561417e+00), x);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(6.07710050630396597660e-11), r);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(2.02226624871116645580e-21), r);
+
+    const __m256d z = _mm256_mul_pd(r, r);
+
+    // Sine polynomial:
+
+    __m256d ps = _mm256_set1_pd(1.58969099521155010221e-10);
+    ps = _mm256_fmadd_pd(ps, z, _mm256_set1_pd(-2.50507602534068634195e-08));
+    ps = _mm256_fmadd_pd(ps, z, _mm256_set1_pd(2.75573137070700676789e-06));
+    ps = _mm256_fmadd_pd(ps, z, _mm256_set1_pd(-1.98412698298579493134e-04));
+    ps = _mm256_fmadd_pd(ps, z, _mm256_set1_pd(8.33333333332248946124e-03));
+    ps = _mm256_fmadd_pd(ps, z, _mm256_set1_pd(-1.66666666666666324348e-01));
+    const __m256d s = _mm256_fmadd_pd(_mm256_mul_pd(ps, z), r, r);
+
+    // Cosine polynomial:
+
+    __m256d pc = _mm256_set1_pd(-1.13596475577881948265e-11);
+    pc = _mm256_fmadd_pd(pc, z, _mm256_set1_pd(2.08757232129817482790e-09));
+    pc = _mm256_fmadd_pd(pc, z, _mm256_set1_pd(-2.75573143513906633035e-07));
+    pc = _mm256_fmadd_pd(pc, z, _mm256_set1_pd(2.48015872894767294178e-05));
+    pc = _mm256_fmadd_pd(pc, z, _mm256_set1_pd(-1.38888888888741095749e-03));
+    pc = _mm256_fmadd_pd(pc, z, _mm256_set1_pd(4.16666666666666019037e-02));
+    const __m256d c = _mm256_fmadd_pd(_mm256_mul_pd(pc, z), z, _mm256_fnmadd_pd(_mm256_set1_pd(0.5), z, _mm256_set1_pd(1.0)));
+
+    // Determine the quadrant (k mod 4), and pick and negate the results accordingly:
+
+    const __m256d quad = _mm256_fnmadd_pd(_mm256_set1_pd(4.0), _mm256_floor_pd(_mm256_mul_pd(k, _mm256_set1_pd(0.25))), k);
+    const __m256d odd = _mm256_fnmadd_pd(_mm256_set1_pd(2.0), _mm256_floor_pd(_mm256_mul_pd(quad, _mm256_set1_pd(0.5))), quad);
+
+    const __m256d swap = _mm256_cmp_pd(odd, _mm256_set1_pd(0.5), _CMP_GT_OQ);
+    const __m256d sneg = _mm256_cmp_pd(quad, _mm256_set1_pd(1.5), _CMP_GT_OQ);
+    const __m256d cneg = _mm256_and_pd(_mm256_cmp_pd(quad, _mm256_set1_pd(0.5), _CMP_GT_OQ), _mm256_cmp_pd(quad, _mm256_set1_pd(2.5), _CMP_LT_OQ));
+
+    const __m256d sign = _mm256_set1_pd(-0.0);
+
+    sin = _mm256_xor_pd(_mm256_blendv_pd(s, c, swap), _mm256_and_pd(sneg, sign));
+    cos = _mm256_xor_pd(_mm256_blendv_pd(c, s, swap), _mm256_and_pd(cneg, sign));
+}
+
+/**
+ * @brief AVX2 transform kernel
+ *
+ * Handles four positions at a time, the remainder is passed to the scalar kernel.
+ *
+ * @param rot Rotation to apply
+ * @param lat Latitudes in degrees
+ * @param lon Longitudes in degrees
+ * @param alt Altitudes in meters
+ * @param count Number of positions
+ * @param a First output coordinate
+ * @param b Second output coordinate
+ * @param c Third output coordinate
+ */
+__attribute__((target("avx2,fma"))) void transform_avx2(const Rotation& rot, const double* lat, const double* lon, const double* alt, std::size_t count, double* a, double* b, double* c) {
+
+    const __m256d deg = _mm256_set1_pd(DEG_TO_RAD);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d wa = _mm256_set1_pd(WGS84_A);
+    const __m256d we2 = _mm256_set1_pd(WGS84_E2);
+    const __m256d wb = _mm256_set1_pd(1.0 - WGS84_E2);
+
+    const __m256d ox = _mm256_set1_pd(rot.origin[0]);
+    const __m256d oy = _mm256_set1_pd(rot.origin[1]);
+    const __m256d oz = _mm256_set1_pd(rot.origin[2]);
+
+    __m256d r[9];  // NOLINT(cppcoreguidelines-avoid-c-arrays): std::array drops the vector attributes
+
+    for (std::size_t j = 0; j < 9; ++j) {
+        r[j] = _mm256_set1_pd(rot.rot[j]);
+    }
+
+    std::size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+
+        const __m256d h = _mm256_loadu_pd(alt + i);
+
+        __m256d sphi;
+        __m256d cphi;
+        __m256d slam;
+        __m256d clam;
+
+        sincos_avx2(_mm256_mul_pd(_mm256_loadu_pd(lat + i), deg), sphi, cphi);
+        sincos_avx2(_mm256_mul_pd(_mm256_loadu_pd(lon + i), deg), slam, clam);
+
+        // Prime vertical radius of curvature:
+
+        const __m256d n = _mm256_div_pd(wa, _mm256_sqrt_pd(_mm256_fnmadd_pd(_mm256_mul_pd(we2, sphi), sphi, one)));
+
+        const __m256d nh = _mm256_mul_pd(_mm256_add_pd(n, h), cphi);
+
+        const __m256d dx = _mm256_fmsub_pd(nh, clam, ox);
+        const __m256d dy = _mm256_fmsub_pd(nh, slam, oy);
+        const __m256d dz = _mm256_fmsub_pd(_mm256_fmadd_pd(n, wb, h), sphi, oz);
+
+        _mm256_storeu_pd(a + i, _mm256_fmadd_pd(r[0], dx, _mm256_fmadd_pd(r[1], dy, _mm256_mul_pd(r[2], dz))));
+        _mm256_storeu_pd(b + i, _mm256_fmadd_pd(r[3], dx, _mm256_fmadd_pd(r[4], dy, _mm256_mul_pd(r[5], dz))));
+        _mm256_storeu_pd(c + i, _mm256_fmadd_pd(r[6], dx, _mm256_fmadd_pd(r[7], dy, _mm256_mul_pd(r[8], dz))));
+    }
+
+    // Handle any leftovers:
+
+    transform_scalar(rot, lat + i, lon + i, alt + i, count - i, a + i, b + i, c + i);
+}
+
+#endif
+
+/**
+ * @brief Determines if the CPU supports our AVX2 kernel
+ *
+ * @return bool true if supported, false if not
+ */
+bool have_avx2() {
+
+#ifdef DTS_HAVE_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Runs the best available kernel
+ *
+ * @param rot Rotation to apply
+ * @param lat Latitudes in degrees
+ * @param lon Longitudes in degrees
+ * @param alt Altitudes in meters
+ * @param count Number of positions
+ * @param a First output coordinate
+ * @param b Second output coordinate
+ * @param c Third output coordinate
+ */
+void run_kernel(const Rotation& rot, const double* lat, const double* lon, const double* alt, std::size_t count, double* a, double* b, double* c) {
+
+#ifdef DTS_HAVE_AVX2
+    if (have_avx2()) {
+        transform_avx2(rot, lat, lon, alt, count, a, b, c);
+        return;
+    }
+#endif
+
+    transform_scalar(rot, lat, lon, alt, count, a, b, c);
+}
+
+}  // namespace
+
+bool geodetic_simd() { return have_avx2(); }
+
+void lla_to_ecef(const double* lat_deg, const double* lon_deg, const double* alt_m, std::size_t count, double* x, double* y, double* z) {
+
+    // The default rotation is the identity around the center of the Earth:
+
+    const Rotation rot;
+
+    run_kernel(rot, lat_deg, lon_deg, alt_m, count, x, y, z);
+}
+
+void GeodeticTransform::set_origin(double lat_deg, double lon_deg, double alt_m) {
+
+    this->origin_lat = lat_deg;
+    this->origin_lon = lon_deg;
+    this->origin_alt = alt_m;
+
+    // Precompute everything that only depends on the origin:
+
+    lla_to_ecef(&lat_deg, &lon_deg, &alt_m, 1, &this->ox, &this->oy, &this->oz);
+
+    this->slat = std::sin(lat_deg * DEG_TO_RAD);
+    this->clat = std::cos(lat_deg * DEG_TO_RAD);
+    this->slon = std::sin(lon_deg * DEG_TO_RAD);
+    this->clon = std::cos(lon_deg * DEG_TO_RAD);
+}
+
+void GeodeticTransform::transform(const double* lat_deg, const double* lon_deg, const double* alt_m, std::size_t count, double* a, double* b, double* c) const {
+
+    Rotation rot;
+
+    if (this->frame != LocalFrame::ECEF) {
+
+        rot.origin = {this->ox, this->oy, this->oz};
+
+        // Rows of the ECEF to ENU rotation:
+
+        const std::array<double, 3> east = {-this->slon, this->clon, 0};
+        const std::array<double, 3> north = {-this->slat * this->clon, -this->slat * this->slon, this->clat};
+        const std::array<double, 3> up = {this->clat * this->clon, this->clat * this->slon, this->slat};
+
+        for (std::size_t j = 0; j < 3; ++j) {
+            if (this->frame == LocalFrame::ENU) {
+                rot.rot[j] = east[j];
+                rot.rot[3 + j] = north[j];
+                rot.rot[6 + j] = up[j];
+            } else {
+                rot.rot[j] = north[j];
+                rot.rot[3 + j] = east[j];
+                rot.rot[6 + j] = -up[j];
+            }
+        }
+    }
+
+    run_kernel(rot, lat_deg, lon_deg, alt_m, count, a, b, c);
+}
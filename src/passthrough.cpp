@@ -0,0 +1,280 @@
+/**
+ * @file passthrough.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Raw MAVLink ingest for DTStream
+ * @version 0.1
+ * @date 2024-11-16
+ *
+ * @copyright Copyright (c) 2024
+ *
+ * This file implements the passthrough ingest mode of DTStream.
+ * Instead of going through the MAVSDK telemetry plugin,
+ * we subscribe to the MAVLink messages we need and decode them into frames ourselves.
+ *
+ * Streams are built from the following messages:
+ *
+ * - Position - GLOBAL_POSITION_INT
+ * - Angular Velocity - ATTITUDE_QUATERNION (or ATTITUDE)
+ * - Velocity NED - GLOBAL_POSITION_INT
+ * - Fixedwing Metrics - VFR_HUD
+ * - IMU - HIGHRES_IMU
+ * - Attitude - ATTITUDE_QUATERNION (or ATTITUDE)
+ *
+ * We also handle the TIMESYNC exchanges used for clock synchronization here,
+ * which are used in both ingest modes.
+ * As each link has its own passthrough plugin, everything here works on a single link.
+ *
+ * ATTITUDE is only used until the first ATTITUDE_QUATERNION arrives,
+ * as not all autopilots send quaternions.
+ * VFR_HUD carries no timestamp, so fixedwing metrics frames never have one.
+ */
+
+#include "dts.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+
+#include <plugins/mavlink_passthrough/mavlink_passthrough.h>
+
+namespace {
+
+/// Degrees per radian
+constexpr double RAD_TO_DEG = 57.295779513082320876;
+
+/**
+ * @brief Determines the MAVLink message used to request the rate of a stream
+ *
+ * @param index Index of the stream
+ * @param quaternion true if the autopilot sends ATTITUDE_QUATERNION
+ * @return uint16_t MAVLink message ID
+ */
+uint16_t stream_message(std::size_t index, bool quaternion) {
+
+    switch (index) {
+        case STREAM_POSITION:
+        case STREAM_VELOCITY_NED:
+            return MAVLINK_MSG_ID_GLOBAL_POSITION_INT;
+        case STREAM_ANGULAR_VELOCITY:
+        case STREAM_ATTITUDE:
+            return quaternion ? MAVLINK_MSG_ID_ATTITUDE_QUATERNION : MAVLINK_MSG_ID_ATTITUDE;
+        case STREAM_FIXEDWING_METRICS:
+            return MAVLINK_MSG_ID_VFR_HUD;
+        default:
+            return MAVLINK_MSG_ID_HIGHRES_IMU;
+    }
+}
+
+}  // namespace
+
+void DTStream::subscribe_raw_stream(Link* link, std::size_t index) {
+
+    mavsdk::MavlinkPassthrough* pass = link->passthrough.get();
+
+    // Each callback only decodes the message into a frame,
+    // all other work is done on the worker thread:
+
+    switch (index) {
+        case STREAM_POSITION: {
+            auto handle = pass->subscribe_message(MAVLINK_MSG_ID_GLOBAL_POSITION_INT, [this, link](const mavlink_message_t& message) {
+                mavlink_global_position_int_t pos;
+                mavlink_msg_global_position_int_decode(&message, &pos);
+                Frame frame = make_frame(STREAM_POSITION);
+                frame.values[0] = pos.lat * 1e-7;
+                frame.values[1] = pos.lon * 1e-7;
+                frame.values[2] = pos.relative_alt * 1e-3;
+                frame.values[10] = pos.alt * 1e-3;
+                frame.timestamp_us = static_cast<uint64_t>(pos.time_boot_ms) * 1000;
+                frame.mask = 0b10000000111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [pass, handle]() { pass->unsubscribe_message(MAVLINK_MSG_ID_GLOBAL_POSITION_INT, handle); };
+            break;
+        }
+        case STREAM_VELOCITY_NED: {
+            auto handle = pass->subscribe_message(MAVLINK_MSG_ID_GLOBAL_POSITION_INT, [this, link](const mavlink_message_t& message) {
+                mavlink_global_position_int_t pos;
+                mavlink_msg_global_position_int_decode(&message, &pos);
+                Frame frame = make_frame(STREAM_VELOCITY_NED);
+                frame.values[0] = pos.vx * 1e-2;
+                frame.values[1] = pos.vy * 1e-2;
+                frame.values[2] = pos.vz * 1e-2;
+                frame.timestamp_us = static_cast<uint64_t>(pos.time_boot_ms) * 1000;
+                frame.mask = 0b111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [pass, handle]() { pass->unsubscribe_message(MAVLINK_MSG_ID_GLOBAL_POSITION_INT, handle); };
+            break;
+        }
+        case STREAM_ANGULAR_VELOCITY:
+        case STREAM_ATTITUDE: {
+
+            // Both streams are made from the same messages,
+            // the only difference is which values we keep:
+
+            const bool rates = index == STREAM_ANGULAR_VELOCITY;
+
+            auto qhandle = pass->subscribe_message(MAVLINK_MSG_ID_ATTITUDE_QUATERNION, [this, link, index, rates](const mavlink_message_t& message) {
+                link->quaternion_seen = true;
+                mavlink_attitude_quaternion_t att;
+                mavlink_msg_attitude_quaternion_decode(&message, &att);
+                Frame frame = make_frame(index);
+                if (rates) {
+                    frame.values[0] = att.rollspeed;
+                    frame.values[1] = att.pitchspeed;
+                    frame.values[2] = att.yawspeed;
+                    frame.mask = 0b111;
+                } else {
+                    // Euler angles are derived from the quaternion on the worker thread
+                    frame.values[3] = att.q1;
+                    frame.values[4] = att.q2;
+                    frame.values[5] = att.q3;
+                    frame.values[6] = att.q4;
+                    frame.mask = 0b1111000;
+                }
+                frame.timestamp_us = static_cast<uint64_t>(att.time_boot_ms) * 1000;
+                frame.mask |= TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+
+            auto ehandle = pass->subscribe_message(MAVLINK_MSG_ID_ATTITUDE, [this, link, index, rates](const mavlink_message_t& message) {
+                if (link->quaternion_seen) {
+                    return;
+                }
+                mavlink_attitude_t att;
+                mavlink_msg_attitude_decode(&message, &att);
+                Frame frame = make_frame(index);
+                if (rates) {
+                    frame.values[0] = att.rollspeed;
+                    frame.values[1] = att.pitchspeed;
+                    frame.values[2] = att.yawspeed;
+                } else {
+                    frame.values[0] = att.roll * RAD_TO_DEG;
+                    frame.values[1] = att.pitch * RAD_TO_DEG;
+                    frame.values[2] = att.yaw * RAD_TO_DEG;
+                }
+                frame.timestamp_us = static_cast<uint64_t>(att.time_boot_ms) * 1000;
+                frame.mask = 0b111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+
+            link->unsubscribers[index] = [pass, qhandle, ehandle]() {
+                pass->unsubscribe_message(MAVLINK_MSG_ID_ATTITUDE_QUATERNION, qhandle);
+                pass->unsubscribe_message(MAVLINK_MSG_ID_ATTITUDE, ehandle);
+            };
+            break;
+        }
+        case STREAM_FIXEDWING_METRICS: {
+            auto handle = pass->subscribe_message(MAVLINK_MSG_ID_VFR_HUD, [this, link](const mavlink_message_t& message) {
+                mavlink_vfr_hud_t hud;
+                mavlink_msg_vfr_hud_decode(&message, &hud);
+                Frame frame = make_frame(STREAM_FIXEDWING_METRICS);
+                frame.values[0] = hud.airspeed;
+                frame.values[1] = hud.throttle;
+                frame.values[2] = hud.climb;
+                frame.mask = 0b111;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [pass, handle]() { pass->unsubscribe_message(MAVLINK_MSG_ID_VFR_HUD, handle); };
+            break;
+        }
+        case STREAM_IMU: {
+            auto handle = pass->subscribe_message(MAVLINK_MSG_ID_HIGHRES_IMU, [this, link](const mavlink_message_t& message) {
+                mavlink_highres_imu_t imu;
+                mavlink_msg_highres_imu_decode(&message, &imu);
+                Frame frame = make_frame(STREAM_IMU);
+                frame.values[0] = imu.xacc;
+                frame.values[1] = imu.yacc;
+                frame.values[2] = imu.zacc;
+                frame.values[3] = imu.xgyro;
+                frame.values[4] = imu.ygyro;
+                frame.values[5] = imu.zgyro;
+                frame.values[6] = imu.xmag;
+                frame.values[7] = imu.ymag;
+                frame.values[8] = imu.zmag;
+                frame.values[9] = imu.temperature;
+                frame.values[10] = imu.fields_updated;
+                frame.timestamp_us = imu.time_usec;
+                frame.mask = 0b11111111111 | TIMESTAMP_BIT;
+                this->telem_callback(link, frame); });
+            link->unsubscribers[index] = [pass, handle]() { pass->unsubscribe_message(MAVLINK_MSG_ID_HIGHRES_IMU, handle); };
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void DTStream::request_raw_rate(Link* link, std::size_t index, double rate) {
+
+    const uint16_t message_id = stream_message(index, link->quaternion_seen);
+    const float interval_us = rate > 0 ? static_cast<float>(1e6 / rate) : -1.0F;
+
+    const uint8_t target_sysid = link->passthrough->get_target_sysid();
+    const uint8_t target_compid = link->passthrough->get_target_compid();
+
+    // Queue the command, we don't wait around for an acknowledgement:
+
+    const mavsdk::MavlinkPassthrough::Result result = link->passthrough->queue_message(
+        [&](mavsdk::MavlinkPassthrough::MavlinkAddress address, uint8_t channel) {
+            mavlink_message_t message;
+            mavlink_msg_command_long_pack_chan(address.system_id, address.component_id, channel, &message,
+                                               target_sysid, target_compid, MAV_CMD_SET_MESSAGE_INTERVAL, 0,
+                                               static_cast<float>(message_id), interval_us, 0, 0, 0, 0, 0);
+            return message;
+        });
+
+    if (result != mavsdk::MavlinkPassthrough::Result::Success) {
+        std::cerr << "Failed to set rate of stream " << index << ": " << result << '\n';
+    }
+}
+
+void DTStream::subscribe_timesync(Link* link) {
+
+    // Remove the previous subscription, if any:
+
+    if (link->timesync_unsubscriber) {
+        link->timesync_unsubscriber();
+        link->timesync_unsubscriber = nullptr;
+    }
+
+    // Only responses are of interest, MAVSDK answers requests from the autopilot itself:
+
+    mavsdk::MavlinkPassthrough* pass = link->passthrough.get();
+
+    auto handle = pass->subscribe_message(MAVLINK_MSG_ID_TIMESYNC, [this, link](const mavlink_message_t& message) {
+        const int64_t now = host_time_ns();
+        mavlink_timesync_t sync;
+        mavlink_msg_timesync_decode(&message, &sync);
+        if (sync.tc1 != 0 && this->clock.add_response(sync.ts1, sync.tc1, now)) {
+            // Keep a running average of the round trip time of this link:
+            const int64_t rtt = now - sync.ts1;
+            const int64_t old = link->rtt_ns.load(std::memory_order_relaxed);
+            link->rtt_ns.store(old < 0 ? rtt : old + (rtt - old) / 8, std::memory_order_relaxed);
+        } });
+    link->timesync_unsubscriber = [pass, handle]() { pass->unsubscribe_message(MAVLINK_MSG_ID_TIMESYNC, handle); };
+}
+
+void DTStream::send_timesync() {
+
+    DTS_TRACE_SCOPE("send_timesync");
+
+    const std::lock_guard<std::mutex> lock(this->state_mutex);
+
+    // Send a request over each connected link:
+
+    for (auto& link : this->links) {
+
+        if (link->state != ConnectionState::Connected || !link->passthrough) {
+            continue;
+        }
+
+        const uint8_t target_sysid = link->passthrough->get_target_sysid();
+        const uint8_t target_compid = link->passthrough->get_target_compid();
+
+        const int64_t ts1 = this->clock.make_request(host_time_ns());
+
+        link->passthrough->queue_message(
+            [&](mavsdk::MavlinkPassthrough::MavlinkAddress address, uint8_t channel) {
+                mavlink_message_t message;
+                mavlink_msg_timesync_pack_chan(address.system_id, address.component_id, channel, &message,
+                                               0, ts1, target_sysid, target_compid);
+                return message;
+            });
+    }
+}
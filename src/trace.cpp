@@ -0,0 +1,341 @@
+/**
+ * @file trace.cpp
+ * @author Owen Cochell (owencochell@gmail.com)
+ * @brief Implementations for pipeline tracing
+ * @version 0.1
+ * @date 2024-12-31
+ *
+ * @copyright Copyright (c) 2024
+ */
+
+#include "trace.hpp"
+
+#include <iostream>
+
+#ifdef DTS_TRACING
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+/// Number of events kept for each thread, MUST be a power of two
+constexpr std::size_t TRACE_EVENTS = 1U << 16;
+
+/// A single recorded event
+struct TraceEvent {
+
+    /// Name of the event
+    const char* name = nullptr;
+
+    /// Time the event started
+    int64_t start_ns = 0;
+
+    /// Duration of the event
+    int64_t dur_ns = 0;
+
+    /// Value of a counter
+    int64_t value = 0;
+
+    /// Chrome trace event phase
+    char phase = 'X';
+};
+
+/**
+ * @brief A slot in the ring, holding a single event
+ *
+ * The owning thread may overwrite a slot while trace_flush() reads it,
+ * so the event is guarded by a sequence number (a seqlock):
+ * it is odd while the event is being written, and 2 * (position + 1) once event number position is complete.
+ * Readers copy the event, and only keep it if the sequence matched before and after.
+ * Fields are relaxed atomics, so a torn copy is never a data race, only discarded.
+ */
+struct TraceSlot {
+
+    /// Sequence number of the event in this slot, zero if never written
+    std::atomic<uint64_t> seq{0};
+
+    /// Name of the event
+    std::atomic<const char*> name{nullptr};
+
+    /// Time the event started
+    std::atomic<int64_t> start_ns{0};
+
+    /// Duration of the event
+    std::atomic<int64_t> dur_ns{0};
+
+    /// Value of a counter
+    std::atomic<int64_t> value{0};
+
+    /// Chrome trace event phase
+    std::atomic<char> phase{'X'};
+};
+
+/// Ring of events recorded by a single thread
+struct TraceBuffer {
+
+    /// Events, used as a ring
+    std::unique_ptr<TraceSlot[]> slots{new TraceSlot[TRACE_EVENTS]};
+
+    /// Number of events ever recorded, only written by the owning thread
+    std::atomic<uint64_t> next{0};
+
+    /// Events before this one were cleared
+    std::atomic<uint64_t> floor{0};
+
+    /// Name of the thread
+    std::atomic<const char*> name{nullptr};
+
+    /// Determines if the owning thread has exited
+    std::atomic<bool> retired{false};
+
+    /// ID of the thread in the trace
+    uint64_t tid = 0;
+};
+
+/// Mutex protecting the registry
+std::mutex registry_mutex;
+
+/// Buffers of all threads that recorded events
+std::vector<std::shared_ptr<TraceBuffer>> registry;
+
+/// ID of the next thread to register
+uint64_t next_tid = 1;
+
+/**
+ * @brief Buffer of the current thread
+ *
+ * Marks the buffer as retired when the thread exits,
+ * so trace_clear() can free it.
+ */
+struct LocalBuffer {
+
+    /// Buffer of this thread, nullptr until the first event
+    std::shared_ptr<TraceBuffer> buffer;
+
+    LocalBuffer() = default;
+
+    LocalBuffer(const LocalBuffer&) = delete;
+
+    LocalBuffer(LocalBuffer&&) = delete;
+
+    LocalBuffer& operator=(const LocalBuffer&) = delete;
+
+    LocalBuffer& operator=(LocalBuffer&&) = delete;
+
+    ~LocalBuffer() {
+        if (this->buffer) {
+            this->buffer->retired = true;
+        }
+    }
+};
+
+thread_local LocalBuffer local;
+
+/**
+ * @brief Gets the buffer of the current thread, registering it if needed
+ *
+ * @return TraceBuffer& Buffer of this thread
+ */
+TraceBuffer& local_buffer() {
+
+    if (!local.buffer) {
+
+        auto buffer = std::make_shared<TraceBuffer>();
+
+        const std::lock_guard<std::mutex> lock(registry_mutex);
+
+        buffer->tid = next_tid++;
+        registry.push_back(buffer);
+
+        local.buffer = std::move(buffer);
+    }
+
+    return *local.buffer;
+}
+
+/**
+ * @brief Writes a time in microseconds, as expected by the trace format
+ *
+ * We use integer math, so no precision is lost on large steady clock times.
+ *
+ * @param file File to write to
+ * @param time_ns Time in nanoseconds
+ */
+void write_us(std::FILE* file, int64_t time_ns) {
+
+    const char* sign = time_ns < 0 ? "-" : "";
+    const uint64_t mag = time_ns < 0 ? static_cast<uint64_t>(-(time_ns + 1)) + 1 : static_cast<uint64_t>(time_ns);
+
+    std::fprintf(file, "%s%" PRIu64 ".%03" PRIu64, sign, mag / 1000, mag % 1000);
+}
+
+}  // namespace
+
+void trace_record(const char* name, char phase, int64_t start_ns, int64_t dur_ns, int64_t value) {
+
+    TraceBuffer& buffer = local_buffer();
+
+    // Only this thread writes, so we simply claim the next slot:
+
+    const uint64_t pos = buffer.next.load(std::memory_order_relaxed);
+
+    TraceSlot& slot = buffer.slots[pos & (TRACE_EVENTS - 1)];
+
+    // Mark the slot as being written, the fence keeps the fields from being written before the mark:
+
+    slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.dur_ns.store(dur_ns, std::memory_order_relaxed);
+    slot.value.store(value, std::memory_order_relaxed);
+    slot.phase.store(phase, std::memory_order_relaxed);
+
+    // Publish the event:
+
+    slot.seq.store(2 * pos + 2, std::memory_order_release);
+    buffer.next.store(pos + 1, std::memory_order_release);
+}
+
+void trace_thread_name(const char* name) {
+
+    local_buffer().name.store(name, std::memory_order_relaxed);
+}
+
+bool trace_flush(const std::string& path) {
+
+    // Grab the buffers, so we don't hold the registry while writing:
+
+    std::vector<std::shared_ptr<TraceBuffer>> buffers;
+
+    {
+        const std::lock_guard<std::mutex> lock(registry_mutex);
+
+        buffers = registry;
+    }
+
+    std::FILE* file = std::fopen(path.c_str(), "w");
+
+    if (file == nullptr) {
+        std::cerr << "Unable to open trace file " << path << '\n';
+        return false;
+    }
+
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", file);
+
+    bool first = true;
+
+    std::vector<TraceEvent> events;
+
+    for (const auto& buffer : buffers) {
+
+        // Name the thread, if it has a name:
+
+        const char* name = buffer->name.load(std::memory_order_relaxed);
+
+        if (name != nullptr) {
+            std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu64 ",\"args\":{\"name\":\"%s\"}}",
+                         first ? "" : ",\n", buffer->tid, name);
+            first = false;
+        }
+
+        // Copy out the events still in the ring,
+        // skipping any the thread is writing or has overwritten while we copy:
+
+        const uint64_t end = buffer->next.load(std::memory_order_acquire);
+        const uint64_t begin = std::max(buffer->floor.load(std::memory_order_relaxed), end > TRACE_EVENTS ? end - TRACE_EVENTS : 0);
+
+        events.clear();
+
+        for (uint64_t i = begin; i < end; ++i) {
+
+            const TraceSlot& slot = buffer->slots[i & (TRACE_EVENTS - 1)];
+
+            const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+
+            if (seq != 2 * i + 2) {
+                continue;
+            }
+
+            TraceEvent event;
+
+            event.name = slot.name.load(std::memory_order_relaxed);
+            event.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+            event.dur_ns = slot.dur_ns.load(std::memory_order_relaxed);
+            event.value = slot.value.load(std::memory_order_relaxed);
+            event.phase = slot.phase.load(std::memory_order_relaxed);
+
+            // The fence keeps the fields from being read after the check:
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                events.push_back(event);
+            }
+        }
+
+        for (const TraceEvent& event : events) {
+
+            std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%" PRIu64 ",\"ts\":", first ? "" : ",\n", event.name, event.phase, buffer->tid);
+            write_us(file, event.start_ns);
+
+            if (event.phase == 'X') {
+                std::fputs(",\"dur\":", file);
+                write_us(file, event.dur_ns);
+            } else if (event.phase == 'i') {
+                std::fputs(",\"s\":\"t\"", file);
+            } else if (event.phase == 'C') {
+                std::fprintf(file, ",\"args\":{\"value\":%" PRId64 "}", event.value);
+            }
+
+            std::fputc('}', file);
+
+            first = false;
+        }
+    }
+
+    std::fputs("\n]}\n", file);
+
+    const bool good = std::ferror(file) == 0;
+
+    if (std::fclose(file) != 0 || !good) {
+        std::cerr << "Failed to write trace file " << path << '\n';
+        return false;
+    }
+
+    return true;
+}
+
+void trace_clear() {
+
+    const std::lock_guard<std::mutex> lock(registry_mutex);
+
+    // Forget the events of live threads, and the buffers of threads that are gone:
+
+    for (const auto& buffer : registry) {
+        buffer->floor.store(buffer->next.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+
+    registry.erase(std::remove_if(registry.begin(), registry.end(), [](const std::shared_ptr<TraceBuffer>& buffer) { return buffer->retired.load(); }), registry.end());
+}
+
+#else
+
+bool trace_flush(const std::string& path) {
+
+    std::cerr << "Tracing is not compiled in, unable to write " << path << " (configure with -DDTS_ENABLE_TRACING=ON)" << '\n';
+
+    return false;
+}
+
+void trace_clear() {}
+
+#endif